@@ -1,9 +1,13 @@
 #include "engine.h"
 
 #include <ranges>
+#include <atomic>
+#include <chrono>
 #include <map>
-#include <queue>
+#include <fstream>
 #include <random>
+#include <numbers>
+#include <unordered_set>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <mpg123.h>
@@ -17,14 +21,13 @@ auto generate_uuid() -> std::string {
 }
 
 int generate_random_int(const int min, const int max) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dis(min, max);
-  return dis(gen);
+  // Seeded once per thread, std::random_device is a syscall on most platforms
+  thread_local roguely::common::Xoshiro256 gen(std::random_device{}());
+  return gen.next_int(min, max);
 }
 
 namespace roguely::level_generation {
-  int get_neighbor_wall_count(const std::shared_ptr<boost::numeric::ublas::matrix<int> > &map, const int map_width,
+  int get_neighbor_wall_count(const common::TileGrid<std::uint8_t> &map, const int map_width,
                               const int map_height,
                               const int x, const int y) {
     int wall_count = 0;
@@ -32,7 +35,7 @@ namespace roguely::level_generation {
     for (int row = y - 1; row <= y + 1; row++) {
       for (int col = x - 1; col <= x + 1; col++) {
         if (row >= 1 && col >= 1 && row < map_height - 1 && col < map_width - 1) {
-          if ((*map)(row, col) == 0)
+          if (map(row, col) == 0)
             wall_count++;
         } else {
           wall_count++;
@@ -43,10 +46,11 @@ namespace roguely::level_generation {
     return wall_count;
   }
 
-  void perform_cellular_automaton(const std::shared_ptr<boost::numeric::ublas::matrix<int>> &map, const int map_width,
+  void perform_cellular_automaton(const std::shared_ptr<common::TileGrid<std::uint8_t> > &map, const int map_width,
                                   const int map_height, const int passes) {
     for (int p = 0; p < passes; p++) {
-      const auto &temp_map = std::make_shared<boost::numeric::ublas::matrix<int> >() = map;
+      // Take a real copy so every cell in this pass sees the previous pass
+      const auto temp_map = *map;
 
       for (int rows = 0; rows < map_height; rows++) {
         for (int columns = 0; columns < map_width; columns++) {
@@ -60,23 +64,346 @@ namespace roguely::level_generation {
     }
   }
 
-  auto is_active_cell() -> int {
-    constexpr int threshold = 48; // Threshold for cell activation
-    return (std::rand() % 100 + 1 > threshold) ? 1 : 0;
+  bool is_active_cell(const std::uint64_t seed, const int x, const int y) {
+    constexpr std::uint64_t threshold = 48; // Threshold for cell activation
+    const std::uint64_t cell = (static_cast<std::uint64_t>(static_cast<std::uint32_t>(y)) << 32) | static_cast<std::uint32_t>(x);
+    const std::uint64_t hash = common::splitmix64(seed ^ common::splitmix64(cell));
+    // Map the top 32 bits onto 1..100
+    return ((hash >> 32) * 100 >> 32) + 1 > threshold;
   }
 
-  std::shared_ptr<boost::numeric::ublas::matrix<int>> init_cellular_automata(int map_width, int map_height) {
-    auto map = std::make_shared<boost::numeric::ublas::matrix<int>>(map_height, map_width);
+  std::shared_ptr<common::TileGrid<std::uint8_t> > init_cellular_automata(int map_width, int map_height,
+                                                                  const std::uint64_t seed) {
+    auto map = std::make_shared<common::TileGrid<std::uint8_t> >(map_width, map_height);
 
     for (int r = 0; r < map_height; ++r) {
       for (int c = 0; c < map_width; ++c) {
-        (*map)(r, c) = is_active_cell(); // Simplified and clearer
+        (*map)(r, c) = is_active_cell(seed, c, r) ? 1 : 0;
       }
     }
 
     return map;
   }
 
+  common::BitGrid init_cellular_automata_bit_grid(const int map_width, const int map_height, const std::uint64_t seed,
+                                                  common::WorkerPool *pool) {
+    common::BitGrid map(map_width, map_height);
+
+    const auto fill_rows = [&](const int row_begin, const int row_end) {
+      for (int r = row_begin; r < row_end; ++r) {
+        for (int c = 0; c < map_width; ++c) {
+          if (is_active_cell(seed, c, r))
+            map.set(c, r, true);
+        }
+      }
+    };
+
+    // Rows never share a word so bands can be filled independently
+    constexpr int band_rows = 32;
+    if (pool != nullptr && map_height > band_rows) {
+      pool->parallel_for((map_height + band_rows - 1) / band_rows, [&](const int band) {
+        fill_rows(band * band_rows, std::min((band + 1) * band_rows, map_height));
+      });
+    } else {
+      fill_rows(0, map_height);
+    }
+
+    return map;
+  }
+
+  // Add three bit-sliced 1 bit numbers, returning the sum bit and the carry bit
+  static void full_adder(const std::uint64_t a, const std::uint64_t b, const std::uint64_t c, std::uint64_t &sum,
+                         std::uint64_t &carry) {
+    const std::uint64_t ab = a ^ b;
+    sum = ab ^ c;
+    carry = (a & b) | (c & ab);
+  }
+
+  // Horizontal floor count (0..3) of a row for the 64 cells in word k, as two bit planes
+  static void row_sum(const std::uint64_t *row, const std::vector<std::uint64_t> &interior_mask, const int k,
+                      const int words_per_row, std::uint64_t &s0, std::uint64_t &s1) {
+    if (row == nullptr) {
+      s0 = s1 = 0;
+      return;
+    }
+
+    const std::uint64_t center = row[k] & interior_mask[k];
+    const std::uint64_t prev = k > 0 ? row[k - 1] & interior_mask[k - 1] : 0;
+    const std::uint64_t next = k + 1 < words_per_row ? row[k + 1] & interior_mask[k + 1] : 0;
+    const std::uint64_t left = (center << 1) | (prev >> 63);
+    const std::uint64_t right = (center >> 1) | (next << 63);
+
+    full_adder(left, center, right, s0, s1);
+  }
+
+  // Computes rows [row_begin, row_end) of dst from src. Cells on the map border
+  // always count as walls, same as get_neighbor_wall_count, which the interior
+  // mask and the row range check take care of. A cell becomes floor when at
+  // least 5 of the 9 cells around it (itself included) are floor.
+  static void step_cellular_automaton(const common::BitGrid &src, common::BitGrid &dst,
+                                      const std::vector<std::uint64_t> &interior_mask,
+                                      const std::vector<std::uint64_t> &width_mask,
+                                      const int row_begin, const int row_end) {
+    const int height = src.get_height();
+    const int words_per_row = src.get_words_per_row();
+    const auto interior_row = [&](const int r) { return r >= 1 && r < height - 1 ? src.row(r) : nullptr; };
+
+    for (int r = row_begin; r < row_end; r++) {
+      const std::uint64_t *above = interior_row(r - 1);
+      const std::uint64_t *center = interior_row(r);
+      const std::uint64_t *below = interior_row(r + 1);
+      std::uint64_t *out = dst.row(r);
+
+      for (int k = 0; k < words_per_row; k++) {
+        std::uint64_t a0, a1, c0, c1, b0, b1;
+        row_sum(above, interior_mask, k, words_per_row, a0, a1);
+        row_sum(center, interior_mask, k, words_per_row, c0, c1);
+        row_sum(below, interior_mask, k, words_per_row, b0, b1);
+
+        // ones + 2 * (twos + carry) where twos/fours are the weight 2 and 4 planes
+        std::uint64_t ones, twos_carry, twos, fours;
+        full_adder(a0, c0, b0, ones, twos_carry);
+        full_adder(a1, c1, b1, twos, fours);
+        const std::uint64_t twos_sum = twos ^ twos_carry;
+        const std::uint64_t fours_carry = twos & twos_carry;
+
+        // count >= 5 means at least one 4 plus at least one more of anything
+        out[k] = (fours | fours_carry) & (ones | twos_sum | (fours & fours_carry)) & width_mask[k];
+      }
+    }
+  }
+
+  void perform_cellular_automaton(common::BitGrid &map, const int passes, common::WorkerPool *pool) {
+    const int width = map.get_width();
+    const int words_per_row = map.get_words_per_row();
+
+    // width_mask keeps the row padding bits clear, interior_mask also drops the
+    // first and last column since those always count as walls
+    std::vector<std::uint64_t> width_mask(words_per_row, ~std::uint64_t{0});
+    if (width % 64 != 0)
+      width_mask.back() = (std::uint64_t{1} << (width % 64)) - 1;
+
+    std::vector<std::uint64_t> interior_mask = width_mask;
+    if (width > 0) {
+      interior_mask.front() &= ~std::uint64_t{1};
+      interior_mask[(width - 1) >> 6] &= ~(std::uint64_t{1} << ((width - 1) & 63));
+    }
+
+    const int height = map.get_height();
+    common::BitGrid back(width, height);
+
+    // Bands are kept to at least 32 rows so small maps don't drown in overhead
+    constexpr int min_band_rows = 32;
+    int bands = 1;
+    if (pool != nullptr)
+      bands = std::clamp(height / min_band_rows, 1, (pool->get_thread_count() + 1) * 4);
+    const int band_rows = (height + bands - 1) / bands;
+
+    for (int p = 0; p < passes; p++) {
+      if (bands == 1) {
+        step_cellular_automaton(map, back, interior_mask, width_mask, 0, height);
+      } else {
+        pool->parallel_for(bands, [&](const int band) {
+          const int row_begin = band * band_rows;
+          step_cellular_automaton(map, back, interior_mask, width_mask, row_begin, std::min(row_begin + band_rows, height));
+        });
+      }
+      std::swap(map, back);
+    }
+  }
+
+  common::BitGrid generate_cellular_automata_region(const int region_x, const int region_y, const int region_width,
+                                                    const int region_height, const int map_width, const int map_height,
+                                                    const std::uint64_t seed, const int passes) {
+    common::BitGrid region(region_width, region_height);
+
+    const auto inside_map = [&](const int x, const int y) {
+      return x >= 1 && y >= 1 && x < map_width - 1 && y < map_height - 1;
+    };
+
+    for (int r = 0; r < region_height; ++r) {
+      for (int c = 0; c < region_width; ++c) {
+        if (inside_map(region_x + c, region_y + r) && is_active_cell(seed, region_x + c, region_y + r))
+          region.set(c, r, true);
+      }
+    }
+
+    // The map border and anything past it always count as wall, so they have to
+    // be knocked back down after every pass
+    for (int p = 0; p < passes; p++) {
+      perform_cellular_automaton(region, 1);
+
+      for (int r = 0; r < region_height; ++r) {
+        for (int c = 0; c < region_width; ++c) {
+          if (!inside_map(region_x + c, region_y + r))
+            region.set(c, r, false);
+        }
+      }
+    }
+
+    return region;
+  }
+
+  MapRegions label_regions(const common::BitGrid &map) {
+    const int width = map.get_width();
+    const int height = map.get_height();
+
+    MapRegions regions{width, height};
+    regions.labels = common::TileGrid<std::int32_t>(width, height);
+
+    // Scanline union-find, provisional labels get merged as runs touch
+    std::vector<std::int32_t> parent{0};
+    const auto find = [&](std::int32_t a) {
+      while (parent[a] != a) {
+        parent[a] = parent[parent[a]];
+        a = parent[a];
+      }
+      return a;
+    };
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        if (!map.get(x, y))
+          continue;
+
+        const std::size_t i = static_cast<std::size_t>(y) * width + x;
+        const std::int32_t up = y > 0 ? regions.labels[i - width] : 0;
+        const std::int32_t left = x > 0 ? regions.labels[i - 1] : 0;
+        std::int32_t label;
+
+        if (up == 0 && left == 0) {
+          label = static_cast<std::int32_t>(parent.size());
+          parent.push_back(label);
+        } else if (up != 0 && left != 0) {
+          const auto root_up = find(up);
+          const auto root_left = find(left);
+          label = std::min(root_up, root_left);
+          parent[std::max(root_up, root_left)] = label;
+        } else {
+          label = up != 0 ? up : left;
+        }
+
+        regions.labels[i] = label;
+      }
+    }
+
+    // Flatten to consecutive ids
+    std::vector<std::int32_t> final_id(parent.size(), 0);
+    regions.sizes.push_back(0);
+    for (std::size_t l = 1; l < parent.size(); l++) {
+      if (find(static_cast<std::int32_t>(l)) == static_cast<std::int32_t>(l)) {
+        final_id[l] = static_cast<std::int32_t>(regions.sizes.size());
+        regions.sizes.push_back(0);
+      }
+    }
+
+    for (auto &label: regions.labels) {
+      if (label != 0) {
+        label = final_id[find(label)];
+        regions.sizes[label]++;
+      }
+    }
+
+    for (std::int32_t r = 1; r < static_cast<std::int32_t>(regions.sizes.size()); r++) {
+      if (regions.largest == 0 || regions.sizes[r] > regions.sizes[regions.largest])
+        regions.largest = r;
+    }
+
+    return regions;
+  }
+
+  // Digs the shortest corridor from every region to the largest one. A single
+  // breadth first search out from the largest region gives every cell the way
+  // back, so each region just follows it from its closest cell.
+  static void connect_regions(common::BitGrid &map, const MapRegions &regions) {
+    const int width = map.get_width();
+    const int height = map.get_height();
+    const std::size_t cell_count = static_cast<std::size_t>(width) * height;
+
+    std::vector<std::int32_t> distance(cell_count, -1);
+    std::vector<std::int32_t> came_from(cell_count, -1);
+    std::deque<std::int32_t> frontier{};
+
+    for (std::size_t i = 0; i < cell_count; i++) {
+      if (regions.labels[i] == regions.largest) {
+        distance[i] = 0;
+        frontier.push_back(static_cast<std::int32_t>(i));
+      }
+    }
+
+    while (!frontier.empty()) {
+      const auto i = frontier.front();
+      frontier.pop_front();
+      const int x = i % width;
+      const int y = i / width;
+
+      for (const auto &[dx, dy]: {std::pair{-1, 0}, std::pair{1, 0}, std::pair{0, -1}, std::pair{0, 1}}) {
+        const int nx = x + dx;
+        const int ny = y + dy;
+
+        // Corridors never cut through the outer wall
+        if (nx < 1 || ny < 1 || nx >= width - 1 || ny >= height - 1)
+          continue;
+
+        if (const auto n = ny * width + nx; distance[n] == -1) {
+          distance[n] = distance[i] + 1;
+          came_from[n] = i;
+          frontier.push_back(n);
+        }
+      }
+    }
+
+    std::vector<std::int32_t> closest(regions.sizes.size(), -1);
+    for (std::size_t i = 0; i < cell_count; i++) {
+      if (const auto r = regions.labels[i]; r != 0 && r != regions.largest && distance[i] >= 0 &&
+                                            (closest[r] == -1 || distance[i] < distance[closest[r]])) {
+        closest[r] = static_cast<std::int32_t>(i);
+      }
+    }
+
+    for (auto i: closest) {
+      while (i >= 0 && distance[i] > 0) {
+        map.set(i % width, i / width, true);
+        i = came_from[i];
+      }
+    }
+  }
+
+  MapRegions process_regions(common::BitGrid &map, const RegionOptions &options) {
+    auto regions = label_regions(map);
+
+    if (options.min_region_size > 0) {
+      bool filled = false;
+      for (std::size_t i = 0; i < regions.labels.size(); i++) {
+        if (const auto r = regions.labels[i]; r != 0 && regions.sizes[r] < options.min_region_size) {
+          map.set(static_cast<int>(i % regions.width), static_cast<int>(i / regions.width), false);
+          filled = true;
+        }
+      }
+
+      if (filled)
+        regions = label_regions(map);
+    }
+
+    if (options.connect_regions && regions.get_region_count() > 1) {
+      connect_regions(map, regions);
+      regions = label_regions(map);
+    }
+
+    return regions;
+  }
+
+  std::shared_ptr<common::TileGrid<std::uint8_t> > bit_grid_to_tile_grid(const common::BitGrid &map) {
+    auto grid = std::make_shared<common::TileGrid<std::uint8_t> >(map.get_width(), map.get_height());
+
+    for (int r = 0; r < map.get_height(); ++r) {
+      for (int c = 0; c < map.get_width(); ++c) {
+        (*grid)(r, c) = map.get(c, r) ? 1 : 0;
+      }
+    }
+
+    return grid;
+  }
 }
 
 namespace roguely::common {
@@ -86,6 +413,170 @@ namespace roguely::common {
 
   bool Dimension::eq(const Dimension &d) const { return d.point.eq(point) && d.supplimental_point.eq(supplimental_point) && d.size.eq(size); }
 
+  static std::uint64_t rotl(const std::uint64_t x, const int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  void Xoshiro256::seed(std::uint64_t seed) {
+    for (auto &s: state) {
+      seed += 0x9e3779b97f4a7c15;
+      s = splitmix64(seed);
+    }
+  }
+
+  Xoshiro256::result_type Xoshiro256::operator()() {
+    const std::uint64_t result = rotl(state[1] * 5, 7) * 9;
+    const std::uint64_t t = state[1] << 17;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+
+    return result;
+  }
+
+  void Xoshiro256::jump() {
+    constexpr std::uint64_t jump_table[] = {
+      0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c
+    };
+
+    std::array<std::uint64_t, 4> s{};
+    for (const auto j: jump_table) {
+      for (int b = 0; b < 64; b++) {
+        if (j & std::uint64_t{1} << b) {
+          for (int i = 0; i < 4; i++) {
+            s[i] ^= state[i];
+          }
+        }
+        (*this)();
+      }
+    }
+
+    state = s;
+  }
+
+  int Xoshiro256::next_int(int min, int max) {
+    if (min > max)
+      std::swap(min, max);
+
+    const std::uint64_t range = static_cast<std::uint64_t>(static_cast<std::int64_t>(max) - min) + 1;
+
+    // The full int range, every 32 bit value is already fair
+    if (range > std::numeric_limits<std::uint32_t>::max())
+      return static_cast<int>(static_cast<std::int64_t>(min) + static_cast<std::int64_t>((*this)() >> 32));
+
+    // Lemire's multiply and shift, with rejection to stay unbiased. The threshold
+    // is 2^32 mod range so it has to be worked out in 32 bits
+    const auto range32 = static_cast<std::uint32_t>(range);
+    std::uint64_t m = ((*this)() >> 32) * range;
+
+    if (static_cast<std::uint32_t>(m) < range32) {
+      const std::uint32_t threshold = static_cast<std::uint32_t>(-range32) % range32;
+      while (static_cast<std::uint32_t>(m) < threshold) {
+        m = ((*this)() >> 32) * range;
+      }
+    }
+
+    return static_cast<int>(min + static_cast<std::int64_t>(m >> 32));
+  }
+
+  std::optional<RandomStream> random_stream_from_string(std::string name) {
+    to_upper(name);
+    return magic_enum::enum_cast<RandomStream>(name);
+  }
+
+  void RandomService::set_seed(const std::uint64_t seed) {
+    this->seed = seed;
+
+    Xoshiro256 base(seed);
+    for (auto &stream: streams) {
+      stream = base;
+      base.jump();
+    }
+  }
+
+  WorkerPool::WorkerPool(unsigned int thread_count) {
+    if (thread_count == 0)
+      thread_count = 1;
+
+    for (unsigned int i = 0; i < thread_count; i++) {
+      workers.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  WorkerPool::~WorkerPool() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    jobs_available.notify_all();
+
+    for (auto &w: workers) {
+      w.join();
+    }
+  }
+
+  void WorkerPool::worker_loop() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(mutex);
+        jobs_available.wait(lock, [&] { return stopping || !jobs.empty(); });
+
+        if (stopping && jobs.empty())
+          return;
+
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  void WorkerPool::parallel_for(const int count, const std::function<void(int)> &fn) {
+    if (count <= 0)
+      return;
+
+    struct ParallelForState {
+      std::atomic<int> next{0};
+      std::atomic<int> done{0};
+      std::mutex mutex{};
+      std::condition_variable finished{};
+    };
+
+    // Helpers that only get picked up after everything is done find no work
+    // left and never touch fn, the shared state keeps them safe after we return.
+    const auto state = std::make_shared<ParallelForState>();
+    const auto run = [state, count, &fn] {
+      for (int i = state->next++; i < count; i = state->next++) {
+        fn(i);
+
+        if (++state->done == count) {
+          std::lock_guard lock(state->mutex);
+          state->finished.notify_all();
+        }
+      }
+    };
+
+    if (const int helpers = std::min(count - 1, get_thread_count()); helpers > 0) {
+      {
+        std::lock_guard lock(mutex);
+        for (int i = 0; i < helpers; i++) {
+          jobs.emplace_back(run);
+        }
+      }
+      jobs_available.notify_all();
+    }
+
+    run();
+
+    std::unique_lock lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done == count; });
+  }
+
   int Text::load_font(const std::string &path, const int ptsize) {
     font = TTF_OpenFont(path.c_str(), ptsize);
 
@@ -135,615 +626,2760 @@ namespace roguely::ecs {
     return gn;
   }
 
+  const SpatialIndex::Location *SpatialIndex::find_location(const EntityHandle id) const {
+    const auto slot = get_handle_slot(id);
+    if (slot >= locations.size() || locations[slot].id != id)
+      return nullptr;
+    return &locations[slot];
+  }
+
+  void SpatialIndex::place(const Entry &entry) {
+    const auto slot = get_handle_slot(entry.id);
+    if (slot >= locations.size())
+      locations.resize(slot + 1);
+
+    const auto key = get_bucket_key(entry.x >> BUCKET_SHIFT, entry.y >> BUCKET_SHIFT);
+    auto &bucket = buckets[key];
+    locations[slot] = {entry.id, key, static_cast<std::uint32_t>(bucket.size())};
+    bucket.emplace_back(entry);
+  }
+
+  SpatialIndex::Entry SpatialIndex::take(const Location location) {
+    const auto bucket = buckets.find(location.bucket);
+    auto &entries = bucket->second;
+    const auto entry = entries[location.index];
+
+    if (location.index != entries.size() - 1) {
+      entries[location.index] = entries.back();
+      locations[get_handle_slot(entries[location.index].id)].index = location.index;
+    }
+    entries.pop_back();
+
+    if (entries.empty())
+      buckets.erase(bucket);
+
+    return entry;
+  }
+
+  void SpatialIndex::insert(const EntityHandle id, const GroupId group, const int x, const int y) {
+    if (contains(id)) {
+      move(id, x, y);
+      return;
+    }
+
+    place({id, group, x, y});
+    count++;
+  }
+
+  void SpatialIndex::move(const EntityHandle id, const int x, const int y) {
+    const auto location = find_location(id);
+    if (location == nullptr)
+      return;
+
+    if (location->bucket == get_bucket_key(x >> BUCKET_SHIFT, y >> BUCKET_SHIFT)) {
+      auto &entry = buckets[location->bucket][location->index];
+      entry.x = x;
+      entry.y = y;
+      return;
+    }
+
+    auto entry = take(*location);
+    entry.x = x;
+    entry.y = y;
+    place(entry);
+  }
+
+  void SpatialIndex::erase(const EntityHandle id) {
+    const auto location = find_location(id);
+    if (location == nullptr)
+      return;
+
+    take(*location);
+    locations[get_handle_slot(id)] = {};
+    count--;
+  }
+
+  std::optional<common::Point> SpatialIndex::get_position(const EntityHandle id) const {
+    const auto location = find_location(id);
+    if (location == nullptr)
+      return std::nullopt;
+
+    const auto &entry = buckets.at(location->bucket)[location->index];
+    return common::Point{entry.x, entry.y};
+  }
+
+  bool SpatialIndex::is_occupied(const int x, const int y) const {
+    const auto bucket = buckets.find(get_bucket_key(x >> BUCKET_SHIFT, y >> BUCKET_SHIFT));
+    if (bucket == buckets.end())
+      return false;
+
+    return std::ranges::any_of(bucket->second, [&](const Entry &e) { return e.x == x && e.y == y; });
+  }
+
+  void SpatialIndex::query_point(const int x, const int y, std::vector<Entry> &results,
+                                 const std::optional<GroupId> group) const {
+    const auto bucket = buckets.find(get_bucket_key(x >> BUCKET_SHIFT, y >> BUCKET_SHIFT));
+    if (bucket == buckets.end())
+      return;
+
+    for (const auto &e: bucket->second) {
+      if (e.x == x && e.y == y && (!group.has_value() || e.group == *group))
+        results.emplace_back(e);
+    }
+  }
+
+  void SpatialIndex::query_rect(const common::Rect &rect, std::vector<Entry> &results, const std::optional<GroupId> group) const {
+    if (rect.size.width <= 0 || rect.size.height <= 0)
+      return;
+
+    const int x1 = rect.point.x + rect.size.width - 1;
+    const int y1 = rect.point.y + rect.size.height - 1;
+    const auto matches = [&](const Entry &e) {
+      return e.x >= rect.point.x && e.x <= x1 && e.y >= rect.point.y && e.y <= y1 &&
+             (!group.has_value() || e.group == *group);
+    };
+
+    const int bx0 = rect.point.x >> BUCKET_SHIFT, bx1 = x1 >> BUCKET_SHIFT;
+    const int by0 = rect.point.y >> BUCKET_SHIFT, by1 = y1 >> BUCKET_SHIFT;
+
+    // A rect covering more buckets than exist is cheaper to answer by walking the buckets we have
+    if (static_cast<std::int64_t>(bx1 - bx0 + 1) * (by1 - by0 + 1) > static_cast<std::int64_t>(buckets.size())) {
+      for (const auto &entries: buckets | std::views::values) {
+        for (const auto &e: entries) {
+          if (matches(e))
+            results.emplace_back(e);
+        }
+      }
+      return;
+    }
+
+    for (int by = by0; by <= by1; by++) {
+      for (int bx = bx0; bx <= bx1; bx++) {
+        const auto bucket = buckets.find(get_bucket_key(bx, by));
+        if (bucket == buckets.end())
+          continue;
+
+        for (const auto &e: bucket->second) {
+          if (matches(e))
+            results.emplace_back(e);
+        }
+      }
+    }
+  }
+
+  void SpatialIndex::query_radius(const int x, const int y, const int radius, std::vector<Entry> &results,
+                                  const std::optional<GroupId> group) const {
+    if (radius < 0)
+      return;
+
+    const auto first = results.size();
+    query_rect({{x - radius, y - radius}, {radius * 2 + 1, radius * 2 + 1}}, results, group);
+
+    const auto r2 = static_cast<std::int64_t>(radius) * radius;
+    const auto outside = std::remove_if(results.begin() + static_cast<std::ptrdiff_t>(first), results.end(),
+                                        [&](const Entry &e) {
+                                          const std::int64_t dx = e.x - x, dy = e.y - y;
+                                          return dx * dx + dy * dy > r2;
+                                        });
+    results.erase(outside, results.end());
+  }
+
+  void SpatialIndex::query_nearest(const int x, const int y, const std::size_t k, std::vector<Entry> &results,
+                                   const std::optional<GroupId> group) const {
+    if (k == 0 || count == 0)
+      return;
+
+    std::vector<std::pair<std::int64_t, Entry> > candidates{};
+    const auto consider = [&](const std::vector<Entry> &entries) {
+      for (const auto &e: entries) {
+        if (group.has_value() && e.group != *group)
+          continue;
+        const std::int64_t dx = e.x - x, dy = e.y - y;
+        candidates.emplace_back(dx * dx + dy * dy, e);
+      }
+    };
+    const auto closer = [](const std::pair<std::int64_t, Entry> &a, const std::pair<std::int64_t, Entry> &b) {
+      return a.first != b.first ? a.first < b.first : a.second.id < b.second.id;
+    };
+
+    // Grow square rings of buckets outwards. Once ring r is done anything left is more than r * BUCKET_SIZE away,
+    // so we can stop as soon as the k-th best is within that. If the rings get bigger than the index just take
+    // everything
+    const int bx = x >> BUCKET_SHIFT, by = y >> BUCKET_SHIFT;
+    std::size_t seen = 0;
+    std::int64_t buckets_visited = 0;
+
+    for (int ring = 0; seen < count; ring++) {
+      buckets_visited += ring == 0 ? 1 : 8 * ring;
+      if (buckets_visited > static_cast<std::int64_t>(buckets.size()) * 4 + 16) {
+        candidates.clear();
+        for (const auto &entries: buckets | std::views::values)
+          consider(entries);
+        break;
+      }
+
+      const auto visit = [&](const int cx, const int cy) {
+        if (const auto bucket = buckets.find(get_bucket_key(cx, cy)); bucket != buckets.end()) {
+          seen += bucket->second.size();
+          consider(bucket->second);
+        }
+      };
+
+      if (ring == 0) {
+        visit(bx, by);
+      } else {
+        for (int cx = bx - ring; cx <= bx + ring; cx++) {
+          visit(cx, by - ring);
+          visit(cx, by + ring);
+        }
+        for (int cy = by - ring + 1; cy <= by + ring - 1; cy++) {
+          visit(bx - ring, cy);
+          visit(bx + ring, cy);
+        }
+      }
+
+      if (candidates.size() >= k) {
+        std::nth_element(candidates.begin(), candidates.begin() + static_cast<std::ptrdiff_t>(k - 1), candidates.end(),
+                         closer);
+        const auto reach = static_cast<std::int64_t>(ring) * BUCKET_SIZE;
+        if (candidates[k - 1].first <= reach * reach)
+          break;
+      }
+    }
+
+    const auto n = std::min(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + static_cast<std::ptrdiff_t>(n), candidates.end(), closer);
+    for (std::size_t i = 0; i < n; i++)
+      results.emplace_back(candidates[i].second);
+  }
+
   std::shared_ptr<EntityGroup> EntityManager::create_entity_group(const std::string &group_name) const {
+    if (auto existing = get_entity_group(group_name); existing != nullptr)
+      return existing;
+
+    sol::state_view lua(lua_entities.lua_state());
     auto entityGroup = std::make_shared<EntityGroup>();
+    entityGroup->id = static_cast<GroupId>(entity_groups->size());
     entityGroup->name = group_name;
     entityGroup->entities = std::make_shared<std::vector<std::shared_ptr<Entity> > >();
+    entityGroup->lua_entities = lua.create_table();
     entity_groups->emplace_back(entityGroup);
+    group_ids->emplace(group_name, entityGroup->id);
+
+    // Create Lua mapping (entity_group->entity->components), the copy refers to the same table
+    sol::table groups = lua_entities;
+    groups.set(group_name, entityGroup->lua_entities);
     return entityGroup;
   }
 
-  void EntityManager::add_entity_to_group(const std::string &group_name, const std::shared_ptr<Entity>& e, const sol::this_state s) {
-    sol::state_view lua(s);
-    auto group = get_entity_group(group_name);
-    if (group == nullptr) {
-      group = std::make_shared<EntityGroup>();
-      group->name = group_name;
-      group->entities = std::make_unique<std::vector<std::shared_ptr<Entity> > >();
-      entity_groups->emplace_back(group);
+  void EntityManager::index_entity(EntityGroup &group, const std::shared_ptr<Entity> &e) {
+    if (group.index_by_id.contains(e->get_id()))
+      return;
+
+    auto &ids = group.ids_by_name[e->get_name()];
+    group.index_by_id.emplace(e->get_id(), EntityGroup::Location{group.entities->size(), ids.size()});
+    ids.emplace_back(e->get_id());
+    group.entities->emplace_back(e);
+  }
+
+  void EntityManager::add_entity_to_group(const std::string &group_name, const std::shared_ptr<Entity>& e, const sol::this_state s) {
+    add_entities_to_group(group_name, {e}, s);
+  }
+
+  void EntityManager::add_entities_to_group(const std::string &group_name,
+                                            const std::vector<std::shared_ptr<Entity> > &entities,
+                                            const sol::this_state s) {
+    sol::state_view lua(s);
+    const auto group = create_entity_group(group_name);
+    group->entities->reserve(group->entities->size() + entities.size());
+
+    for (const auto &e: entities) {
+      index_entity(*group, e);
+
+      if (const auto lua_component = e->get<roguely::components::LuaComponent>();
+        lua_component != nullptr) {
+        group->lua_entities.set(e->get_id(),
+                                lua.create_table_with(
+                                  "id", e->get_id(),
+                                  "name", e->get_name(),
+                                  "components", lua_component->get_properties()));
+
+        if (const auto position = get_lua_position(lua_component->get_properties()); position.has_value())
+          spatial_index->insert(e->get_id(), group->id, position->x, position->y);
+      }
+    }
+  }
+
+  std::shared_ptr<Entity> EntityManager::create_entity_in_group(const std::string &group_name,
+                                                                const std::string &entity_name) const {
+    if (const auto entity_group = get_entity_group(group_name); entity_group != nullptr) {
+      auto entity = create_entity(entity_name);
+      index_entity(*entity_group, entity);
+      return entity;
+    }
+    return nullptr;
+  }
+
+  void EntityManager::remove_entity(const std::string &entity_group_name, const EntityHandle entity_id) {
+    const auto entity_group = get_entity_group(entity_group_name);
+    if (entity_group == nullptr)
+      return;
+
+    const auto index = entity_group->index_by_id.find(entity_id);
+    if (index == entity_group->index_by_id.end())
+      return;
+
+    const auto [position, name_position] = index->second;
+    auto &entities = *entity_group->entities;
+    const auto entity = entities[position];
+    entity_group->index_by_id.erase(index);
+
+    // Swap and pop in both the group and the name list, fixing up whatever got moved
+    if (position != entities.size() - 1) {
+      entities[position] = std::move(entities.back());
+      entity_group->index_by_id[entities[position]->get_id()].index = position;
+    }
+    entities.pop_back();
+
+    if (const auto ids = entity_group->ids_by_name.find(entity->get_name()); ids != entity_group->ids_by_name.end()) {
+      auto &named = ids->second;
+      if (name_position != named.size() - 1) {
+        named[name_position] = named.back();
+        entity_group->index_by_id[named[name_position]].name_index = name_position;
+      }
+      named.pop_back();
+
+      if (named.empty())
+        entity_group->ids_by_name.erase(ids);
+    }
+
+    entity_group->lua_entities.set(entity_id, sol::nil);
+    spatial_index->erase(entity_id);
+  }
+
+  std::shared_ptr<EntityGroup> EntityManager::get_entity_group(const std::string &group_name) const {
+    if (const auto group_id = group_ids->find(group_name); group_id != group_ids->end()) {
+      return (*entity_groups)[group_id->second];
+    }
+
+    return nullptr;
+  }
+
+  std::shared_ptr<std::vector<std::shared_ptr<Entity> > > EntityManager::get_entities_in_group(
+    const std::string &group_name) const {
+    if (const auto entity_group = get_entity_group(group_name); entity_group != nullptr) {
+      return entity_group->entities;
+    }
+
+    return nullptr;
+  }
+
+  EntityHandle EntityManager::get_entity_id_by_name(const std::string &group_name, const std::string &entity_name) const {
+    if (const auto entity = EntityManager::get_entity_by_name(group_name, entity_name); entity != nullptr) {
+      return entity->get_id();
+    }
+    return INVALID_ENTITY;
+  }
+
+  std::shared_ptr<Entity> EntityManager::get_entity_by_name(const std::string &entity_group,
+                                                            const std::string &entity_name) const {
+    if (const auto group = get_entity_group(entity_group); group != nullptr) {
+      if (const auto ids = group->ids_by_name.find(entity_name); ids != group->ids_by_name.end()) {
+        return (*group->entities)[group->index_by_id.at(ids->second.front()).index];
+      }
+    }
+
+    return nullptr;
+  }
+
+  std::shared_ptr<Entity>
+  EntityManager::get_entity_by_id(const std::string &entity_group, const EntityHandle entity_id) const {
+    if (const auto group = get_entity_group(entity_group); group != nullptr) {
+      if (const auto index = group->index_by_id.find(entity_id); index != group->index_by_id.end()) {
+        return (*group->entities)[index->second.index];
+      }
+    }
+
+    return nullptr;
+  }
+
+  std::shared_ptr<std::vector<std::shared_ptr<Entity>>> EntityManager::find_entities_in_group(
+    const std::string &entity_group, const std::function<bool(std::shared_ptr<Entity>)> &predicate) const {
+    const auto entity_group_ptr = get_entity_group(entity_group);
+    auto entities = std::make_shared<std::vector<std::shared_ptr<Entity> > >();
+
+    if (entity_group_ptr != nullptr) {
+      for (const auto &e: *entity_group_ptr->entities) {
+        if (predicate(e)) {
+          entities->emplace_back(e);
+        }
+      }
+
+      return entities;
+    }
+
+    return nullptr;
+  }
+
+  std::shared_ptr<Entity> EntityManager::find_entity(const std::string &entity_group,
+                                                     const std::function<bool(std::shared_ptr<Entity>)> &predicate) const {
+    if (const auto entity_group_ptr = get_entity_group(entity_group); entity_group_ptr != nullptr) {
+      const auto entity = std::ranges::find_if(*entity_group_ptr->entities,
+                                               [&](const std::shared_ptr<Entity> &e) {
+                                                 return predicate(e);
+                                               });
+
+      if (entity != entity_group_ptr->entities->end()) {
+        return *entity;
+      }
+    }
+
+    return nullptr;
+  }
+
+  bool EntityManager::lua_entities_for_each(const std::function<bool(sol::table)> &predicate) const {
+    bool result = false;
+
+    each<roguely::components::LuaComponent>([&](const Entity &, const roguely::components::LuaComponent &c) {
+      if (auto lua_components_table = c.get_properties(); lua_components_table.valid()) {
+        result = predicate(lua_components_table);
+      }
+    });
+
+    return result;
+  }
+
+  std::optional<common::Point> EntityManager::get_lua_position(const sol::table &components) {
+    if (!components.valid())
+      return std::nullopt;
+
+    const sol::table position_component = components["position_component"];
+    if (!position_component.valid())
+      return std::nullopt;
+
+    const int x = position_component["x"];
+    const int y = position_component["y"];
+    return common::Point{x, y};
+  }
+
+  sol::table EntityManager::get_proxied_fields(const sol::table &table) {
+    if (const auto meta = table.get<sol::optional<sol::table> >(sol::metatable_key); meta.has_value()) {
+      if (const auto fields = meta->get<sol::optional<sol::table> >("__index"); fields.has_value())
+        return *fields;
+    }
+    return table;
+  }
+
+  bool EntityManager::lua_is_point_unique(const roguely::common::Point point) const {
+    return !spatial_index->is_occupied(point.x, point.y);
+  }
+
+  void EntityManager::lua_for_each_overlapping_point(const std::string &entity_name, const int x, const int y,
+                                                     const sol::function &point_callback) const {
+    std::vector<SpatialIndex::Entry> hits{};
+    spatial_index->query_point(x, y, hits);
+
+    for (const auto &hit: hits) {
+      // Looked up again each time in case the callback removed something
+      const auto e = storage->get_entity(hit.id);
+      if (e == nullptr || e->get_name() == entity_name)
+        continue;
+
+      if (const auto lua_component = e->get<roguely::components::LuaComponent>(); lua_component != nullptr) {
+        if (auto point_callback_result = point_callback(hit.id, e->get_name(), lua_component->get_properties());
+          !point_callback_result.valid()) {
+          sol::error err = point_callback_result;
+          fmt::println("Lua script error: {}", err.what());
+        }
+      }
+    }
+  }
+
+  sol::table EntityManager::get_lua_blocked_points(const std::string &entity_group, const int x, const int y,
+                                                   const std::string &direction, const sol::this_state s) const {
+    sol::state_view lua(s);
+    sol::table result = lua.create_table();
+
+    const auto eg = get_entity_group(entity_group);
+    if (eg == nullptr)
+      return result;
+
+    common::Point target{x, y};
+    if (direction == "up")
+      target.y--;
+    else if (direction == "down")
+      target.y++;
+    else if (direction == "left")
+      target.x--;
+    else if (direction == "right")
+      target.x++;
+    else
+      return result;
+
+    std::vector<SpatialIndex::Entry> hits{};
+    spatial_index->query_point(target.x, target.y, hits, eg->id);
+
+    for (const auto &hit: hits) {
+      if (const auto e = storage->get_entity(hit.id); e != nullptr) {
+        result.set("entity_name", e->get_name());
+        result.set("entity_id", hit.id);
+        result.set("entity_position", lua.create_table_with("x", hit.x, "y", hit.y));
+        result.set("direction", direction);
+        break;
+      }
+    }
+
+    return result;
+  }
+
+  sol::table EntityManager::get_lua_entities_in_viewport(const roguely::common::Rect &viewport,
+                                                         const sol::this_state s) const {
+    // find the entities that are in the viewport and return them keyed by id
+    sol::state_view lua(s);
+    sol::table result = lua.create_table();
+
+    std::vector<SpatialIndex::Entry> hits{};
+    spatial_index->query_rect(viewport, hits);
+
+    for (const auto &hit: hits) {
+      if (const auto e = storage->get_entity(hit.id); e != nullptr) {
+        result.set(hit.id,
+                   lua.create_table_with(
+                     "group_name", (*entity_groups)[hit.group]->name,
+                     "name", e->get_name(),
+                     "id", hit.id));
+      }
+    }
+
+    return result;
+  }
+
+  sol::table EntityManager::query_lua_entities(const sol::optional<std::string> &group_name,
+                                               const std::function<void(std::vector<SpatialIndex::Entry> &,
+                                                                        std::optional<GroupId>)> &query,
+                                               const sol::this_state s) const {
+    sol::state_view lua(s);
+    sol::table result = lua.create_table();
+
+    std::optional<GroupId> group{};
+    if (group_name.has_value()) {
+      const auto eg = get_entity_group(*group_name);
+      if (eg == nullptr)
+        return result;
+      group = eg->id;
+    }
+
+    std::vector<SpatialIndex::Entry> hits{};
+    query(hits, group);
+
+    int i = 1;
+    for (const auto &hit: hits) {
+      if (const auto e = storage->get_entity(hit.id); e != nullptr) {
+        result[i++] = lua.create_table_with(
+          "id", hit.id,
+          "group_name", (*entity_groups)[hit.group]->name,
+          "name", e->get_name(),
+          "x", hit.x,
+          "y", hit.y);
+      }
+    }
+
+    return result;
+  }
+}
+
+namespace roguely::sprites {
+  SpriteSheet::SpriteSheet(SDL_Renderer *renderer, const std::string &n, const std::string &p, int sw, int sh, int sf) {
+    path = p;
+    name = n;
+    sprite_width = sw;
+    sprite_height = sh;
+
+    if (sf <= 0)
+      sf = 1;
+
+    scale_factor = sf;
+
+    // fmt::println("loading spritesheet: {}", path);
+    // fmt::println("sprite width: {} | sprite height: {}", sprite_width, sprite_height);
+    // fmt::println("scale factor: {}", scale_factor);
+
+    const auto tileset = IMG_Load(p.c_str());
+    spritesheet_texture = SDL_CreateTextureFromSurface(renderer, tileset);
+    const int total_sprites_on_sheet = tileset->w / sw * tileset->h / sh;
+    sprites = std::make_unique<std::vector<std::shared_ptr<SDL_Rect> > >(0);
+    // fmt::println("total sprites on sheet: {}", total_sprites_on_sheet);
+
+    SDL_GetTextureColorMod(spritesheet_texture, &o_red, &o_green, &o_blue);
+
+    for (int y = 0; y < total_sprites_on_sheet / (sw + sh); y++) {
+      for (int x = 0; x < total_sprites_on_sheet / (sw + sh); x++) {
+        SDL_Rect rect = {x * sw, y * sh, sw, sh};
+        sprites->emplace_back(std::make_shared<SDL_Rect>(rect));
+      }
+    }
+
+    sprites->resize(total_sprites_on_sheet);
+
+    SDL_FreeSurface(tileset);
+  }
+
+  void SpriteSheet::draw_sprite(SDL_Renderer *renderer, const int sprite_id, const int x, const int y) const {
+    draw_sprite(renderer, sprite_id, x, y, scale_factor);
+  }
+
+  void SpriteSheet::draw_sprite(SDL_Renderer *renderer, int sprite_id, const int x, const int y,
+                                const int scale_factor) const {
+    if (sprite_id < 0 || sprite_id > sprites->capacity()) {
+      fmt::println("sprite id out of range: {}", sprite_id);
+      return;
+    }
+
+    int width = sprite_width;
+    int height = sprite_height;
+
+    if (scale_factor > 0) {
+      width = sprite_width * scale_factor;
+      height = sprite_height * scale_factor;
+    }
+
+    const SDL_Rect dest = {x, y, width, height};
+    const auto &sprite_rect = sprites->at(sprite_id);
+    SDL_RenderCopy(renderer, spritesheet_texture, &(*sprite_rect), &dest);
+  }
+
+  void SpriteSheet::draw_sprite_sheet(SDL_Renderer *renderer, const int x, const int y) const {
+    int col = 0;
+    int row_height = 0;
+
+    // fmt::println("scale_factor: {}", scale_factor);
+
+    for (int i = 0; i < sprites->size(); i++) {
+      // fmt::println("col * sprite_width = {}", col * sprite_width);
+      // fmt::println("col * (sprite_width * scale_factor) = {}", col * (sprite_width * scale_factor));
+
+      draw_sprite(renderer, i, x + (col * (sprite_width * scale_factor)), y + row_height);
+      col++;
+
+      if ((i + 1) % 16 == 0) {
+        row_height += sprite_height * scale_factor;
+        col = 0;
+      }
+    }
+  }
+
+  sol::table SpriteSheet::get_sprites_as_lua_table(const sol::this_state s) const {
+    sol::state_view lua(s);
+    sol::table sprites_table = lua.create_table();
+
+    for (std::size_t i = 0, sp = sprites->size(); i != sp; ++i) {
+      const auto &sprite_rect = sprites->at(i);
+
+      sol::table rect_table = lua.create_table();
+
+      rect_table.set("x", sprite_rect->x);
+      rect_table.set("y", sprite_rect->y);
+      rect_table.set("w", sprite_rect->w);
+      rect_table.set("h", sprite_rect->h);
+
+      sprites_table.set(i, rect_table);
+    }
+
+    return sprites_table;
+  }
+}
+
+namespace roguely::map {
+  ChunkStore::ChunkStore(std::string name, const int world_width, const int world_height, const std::uint64_t seed,
+                         const int chunk_size, const std::size_t max_resident_chunks, const int passes)
+    : name(std::move(name)), world_width(world_width), world_height(world_height), seed(seed),
+      chunk_size(std::max(chunk_size, 1)), max_resident_chunks(std::max<std::size_t>(max_resident_chunks, 1)),
+      passes(passes) {
+    // Another copy of the game could have the same map open, so the name and seed alone aren't enough
+    const auto suffix = static_cast<std::uint64_t>(std::random_device{}()) << 32 | std::random_device{}();
+    page_directory = std::filesystem::temp_directory_path() / "roguely" /
+                     fmt::format("{}-{:x}-{:016x}", this->name, seed, suffix);
+  }
+
+  ChunkStore::~ChunkStore() {
+    // Paged out chunks only live as long as the map does
+    if (!paged_out_chunks.empty()) {
+      std::error_code ec;
+      std::filesystem::remove_all(page_directory, ec);
+    }
+  }
+
+  int ChunkStore::get_cell(const int x, const int y) {
+    if (x < 0 || y < 0 || x >= world_width || y >= world_height)
+      return 0;
+
+    const int chunk_x = x / chunk_size;
+    const int chunk_y = y / chunk_size;
+
+    // Most lookups land in the same chunk as the last one
+    MapChunk *chunk = last_chunk;
+    if (chunk == nullptr || chunk->chunk_x != chunk_x || chunk->chunk_y != chunk_y)
+      chunk = &get_chunk(chunk_x, chunk_y);
+
+    return chunk->cells[(y - chunk_y * chunk_size) * chunk_size + (x - chunk_x * chunk_size)];
+  }
+
+  void ChunkStore::set_cell(const int x, const int y, const int value) {
+    if (x < 0 || y < 0 || x >= world_width || y >= world_height || value < 0 ||
+        value > std::numeric_limits<std::uint8_t>::max())
+      return;
+
+    const int chunk_x = x / chunk_size;
+    const int chunk_y = y / chunk_size;
+    auto &chunk = get_chunk(chunk_x, chunk_y);
+    chunk.cells[(y - chunk_y * chunk_size) * chunk_size + (x - chunk_x * chunk_size)] = static_cast<std::uint8_t>(value);
+    chunk.dirty = true;
+  }
+
+  std::optional<int> ChunkStore::peek_cell(const int x, const int y) const {
+    if (x < 0 || y < 0 || x >= world_width || y >= world_height)
+      return std::nullopt;
+
+    const int chunk_x = x / chunk_size;
+    const int chunk_y = y / chunk_size;
+
+    if (const auto chunk = chunks.find(chunk_key(chunk_x, chunk_y)); chunk != chunks.end()) {
+      return chunk->second->cells[(y - chunk_y * chunk_size) * chunk_size + (x - chunk_x * chunk_size)];
+    }
+
+    return std::nullopt;
+  }
+
+  void ChunkStore::for_each_resident_cell(const std::function<void(int x, int y, int cell)> &fn) const {
+    for (const auto &chunk: chunks | std::views::values) {
+      const int left = chunk->chunk_x * chunk_size;
+      const int top = chunk->chunk_y * chunk_size;
+      const int right = std::min(left + chunk_size, world_width);
+      const int bottom = std::min(top + chunk_size, world_height);
+
+      for (int y = top; y < bottom; y++) {
+        for (int x = left; x < right; x++)
+          fn(x, y, chunk->cells[(y - top) * chunk_size + (x - left)]);
+      }
+    }
+  }
+
+  void ChunkStore::stream_region(const int x, const int y, const int end_x, const int end_y) {
+    const int max_chunk_x = (world_width - 1) / chunk_size;
+    const int max_chunk_y = (world_height - 1) / chunk_size;
+
+    pinned_begin = {std::clamp(x / chunk_size - 1, 0, max_chunk_x), std::clamp(y / chunk_size - 1, 0, max_chunk_y)};
+    pinned_end = {
+      std::clamp((end_x - 1) / chunk_size + 1, 0, max_chunk_x) + 1,
+      std::clamp((end_y - 1) / chunk_size + 1, 0, max_chunk_y) + 1
+    };
+
+    for (int cy = pinned_begin.y; cy < pinned_end.y; cy++) {
+      for (int cx = pinned_begin.x; cx < pinned_end.x; cx++) {
+        get_chunk(cx, cy);
+      }
+    }
+
+    evict_cold_chunks();
+  }
+
+  MapChunk &ChunkStore::get_chunk(const int chunk_x, const int chunk_y) {
+    const auto key = chunk_key(chunk_x, chunk_y);
+    auto it = chunks.find(key);
+
+    if (it == chunks.end()) {
+      auto chunk = std::make_unique<MapChunk>();
+      chunk->chunk_x = chunk_x;
+      chunk->chunk_y = chunk_y;
+      chunk->cells.resize(static_cast<std::size_t>(chunk_size) * chunk_size);
+
+      if (paged_out_chunks.contains(key)) {
+        std::ifstream in(get_chunk_path(chunk_x, chunk_y), std::ios::binary);
+        in.read(reinterpret_cast<char *>(chunk->cells.data()), static_cast<std::streamsize>(chunk->cells.size()));
+
+        if (!in) {
+          fmt::println("unable to page in chunk ({}, {}) of map {}, regenerating it", chunk_x, chunk_y, name);
+          paged_out_chunks.erase(key);
+          generate_chunk(*chunk);
+        }
+      } else {
+        generate_chunk(*chunk);
+      }
+
+      it = chunks.emplace(key, std::move(chunk)).first;
+      it->second->last_used = ++use_counter;
+      last_chunk = it->second.get();
+      evict_cold_chunks();
+    }
+
+    it->second->last_used = ++use_counter;
+    last_chunk = it->second.get();
+    return *it->second;
+  }
+
+  void ChunkStore::generate_chunk(MapChunk &chunk) const {
+    // Each pass can only move information one cell, so an apron one wider than
+    // the number of passes makes the chunk match a whole map generated from the
+    // same seed exactly, no seams between chunks.
+    const int apron = passes + 1;
+    const int region_size = chunk_size + apron * 2;
+    const int origin_x = chunk.chunk_x * chunk_size;
+    const int origin_y = chunk.chunk_y * chunk_size;
+
+    const auto region = level_generation::generate_cellular_automata_region(
+      origin_x - apron, origin_y - apron, region_size, region_size, world_width, world_height, seed, passes);
+
+    for (int r = 0; r < chunk_size; r++) {
+      for (int c = 0; c < chunk_size; c++) {
+        chunk.cells[r * chunk_size + c] = region.get(c + apron, r + apron) ? 1 : 0;
+      }
+    }
+  }
+
+  void ChunkStore::evict_cold_chunks() {
+    if (chunks.size() <= max_resident_chunks)
+      return;
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > candidates{}; // last used, key
+    for (const auto &[key, chunk]: chunks) {
+      if (chunk.get() != last_chunk && !is_pinned(*chunk))
+        candidates.emplace_back(chunk->last_used, key);
+    }
+    std::ranges::sort(candidates);
+
+    for (const auto &key: candidates | std::views::values) {
+      if (chunks.size() <= max_resident_chunks)
+        break;
+
+      if (const auto &chunk = *chunks.at(key); chunk.dirty) {
+        std::error_code ec;
+        std::filesystem::create_directories(page_directory, ec);
+
+        std::ofstream out(get_chunk_path(chunk.chunk_x, chunk.chunk_y), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(chunk.cells.data()), static_cast<std::streamsize>(chunk.cells.size()));
+
+        if (!out) {
+          // Better to go over budget than to lose changes
+          if (!page_out_failed)
+            fmt::println("unable to page out chunks of map {} to {}", name, page_directory.string());
+          page_out_failed = true;
+          continue;
+        }
+
+        paged_out_chunks.insert(key);
+      }
+
+      chunks.erase(key);
+    }
+  }
+
+  std::filesystem::path ChunkStore::get_chunk_path(const int chunk_x, const int chunk_y) const {
+    return page_directory / fmt::format("{}_{}.chunk", chunk_x, chunk_y);
+  }
+
+  void Map::set_cell(const int x, const int y, const int value) {
+    if (x < 0 || y < 0 || x >= width || y >= height)
+      return;
+
+    // Cells are stored as bytes, anything bigger would wrap around to some other tile
+    if (value < 0 || value > std::numeric_limits<std::uint8_t>::max()) {
+      fmt::println("cell value out of range: {} at ({}, {}) on map {}", value, x, y, name);
+      return;
+    }
+
+    if (chunks != nullptr)
+      chunks->set_cell(x, y, value);
+    else
+      (*map)(y, x) = static_cast<std::uint8_t>(value);
+
+    version++;
+
+    // With regions one cell can change which region is largest, so the free cells wait for the relabel
+    if (has_regions())
+      regions_dirty = true;
+    else if (!free_cells.empty())
+      free_cells.set_passable(x, y, is_spawnable(x, y));
+
+    if (chunks == nullptr)
+      hierarchy.mark_dirty(x, y);
+
+    redraw_cell(x, y);
+    mark_minimap_dirty(x, y);
+  }
+
+  void Map::stream_chunks(const common::Dimension &dimensions) const {
+    if (chunks != nullptr)
+      chunks->stream_region(dimensions.point.x, dimensions.point.y, dimensions.size.width, dimensions.size.height);
+  }
+
+  void Map::draw_map(SDL_Renderer *renderer, const roguely::common::Dimension &dimensions,
+                     const std::shared_ptr<roguely::sprites::SpriteSheet> &sprite_sheet,
+                     const std::function<void(int, int, int, int, int, int, int)> &draw_hook) {
+    const int scale_factor = sprite_sheet->get_scale_factor();
+    const common::Size cell_size{
+      sprite_sheet->get_sprite_width() * scale_factor, sprite_sheet->get_sprite_height() * scale_factor
+    };
+
+    draw_map_segment(renderer, dimensions, cell_size, [&](const int cols, const int rows, const int dx, const int dy) {
+      if (draw_hook != nullptr) {
+        // rows, cols = map Y, X
+        draw_hook(rows, cols, dx, dy, get_cell(cols, rows), get_light_value(cols, rows), scale_factor);
+      }
+    });
+  }
+
+  void Map::draw_map(SDL_Renderer *renderer, const roguely::common::Dimension &dimensions) {
+    const auto &sprite_sheet = tile_sprites.sprite_sheet;
+    if (sprite_sheet == nullptr)
+      return;
+
+    const int scale_factor = sprite_sheet->get_scale_factor();
+    const common::Size cell_size{
+      sprite_sheet->get_sprite_width() * scale_factor, sprite_sheet->get_sprite_height() * scale_factor
+    };
+
+    // Color mod is only touched when the tint changes from one cell to the next
+    std::optional<SDL_Color> current_tint{};
+
+    draw_map_segment(renderer, dimensions, cell_size, [&](const int cols, const int rows, const int dx, const int dy) {
+      const auto &tint = tile_sprites.tints[get_light_value(cols, rows)];
+      const int sprite_id = tile_sprites.sprite_ids[static_cast<std::uint8_t>(get_cell(cols, rows))];
+      if (!tint.has_value() || sprite_id < 0)
+        return;
+
+      if (!current_tint.has_value() || current_tint->r != tint->r || current_tint->g != tint->g ||
+          current_tint->b != tint->b) {
+        SDL_SetTextureColorMod(sprite_sheet->get_spritesheet_texture(), tint->r, tint->g, tint->b);
+        current_tint = tint;
+      }
+
+      sprite_sheet->draw_sprite(renderer, sprite_id, dx, dy, scale_factor);
+    });
+
+    if (current_tint.has_value())
+      sprite_sheet->reset_highlight_color();
+  }
+
+  void Map::draw_minimap(SDL_Renderer *renderer, const int x, const int y, const int a) {
+    // A chunked map is only ever partly there, it's too big for this anyway
+    if (chunks != nullptr || width == 0 || height == 0)
+      return;
+
+    if (minimap_texture == nullptr) {
+      minimap_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+      SDL_SetTextureBlendMode(minimap_texture, SDL_BLENDMODE_BLEND);
+      minimap_pixels = common::TileGrid<std::uint32_t>(width, height);
+      mark_minimap_dirty(0, 0);
+      mark_minimap_dirty(width - 1, height - 1);
+    }
+
+    if (minimap_dirty_max.x >= 0) {
+      const int begin_x = std::max(minimap_dirty_min.x, 0);
+      const int end_x = std::min(minimap_dirty_max.x, width - 1) + 1;
+      const int begin_y = std::max(minimap_dirty_min.y, 0);
+      const int end_y = std::min(minimap_dirty_max.y, height - 1) + 1;
+      const auto &palette = minimap_colors.palette;
+
+      for (int row = begin_y; row < end_y; row++) {
+        const auto cells = map->row(row);
+        const auto pixels = minimap_pixels.row(row);
+
+        if (!minimap_colors.unexplored.has_value()) {
+          for (int col = begin_x; col < end_x; col++)
+            pixels[col] = palette[cells[col]];
+        } else {
+          const auto unexplored = *minimap_colors.unexplored;
+          for (int col = begin_x; col < end_x; col++)
+            pixels[col] = explored.get(col, row) ? palette[cells[col]] : unexplored;
+        }
+      }
+
+      const SDL_Rect dirty = {begin_x, begin_y, end_x - begin_x, end_y - begin_y};
+      SDL_UpdateTexture(minimap_texture, &dirty, &minimap_pixels(begin_y, begin_x),
+                        static_cast<int>(width * sizeof(std::uint32_t)));
+
+      minimap_dirty_min = {width, height};
+      minimap_dirty_max = {-1, -1};
+    }
+
+    SDL_SetTextureAlphaMod(minimap_texture, a);
+    const SDL_Rect destination = {x, y, width, height};
+    SDL_RenderCopy(renderer, minimap_texture, nullptr, &destination);
+  }
+
+  void FreeCellIndex::set_passable(const int x, const int y, const bool value) {
+    if (passable.get(x, y) == value)
+      return;
+
+    passable.set(x, y, value);
+
+    if (value && occupancy(y, x) == 0)
+      insert(x, y);
+    else if (!value)
+      erase(x, y);
+  }
+
+  void FreeCellIndex::occupy(const int x, const int y) {
+    if (occupancy(y, x)++ == 0)
+      erase(x, y);
+  }
+
+  void FreeCellIndex::vacate(const int x, const int y) {
+    if (occupancy(y, x) == 0)
+      return;
+
+    if (--occupancy(y, x) == 0 && passable.get(x, y))
+      insert(x, y);
+  }
+
+  void FreeCellIndex::clear_occupancy() {
+    for (int y = 0; y < occupancy.get_height(); y++) {
+      for (int x = 0; x < width; x++) {
+        if (occupancy(y, x) != 0) {
+          occupancy(y, x) = 0;
+          if (passable.get(x, y))
+            insert(x, y);
+        }
+      }
+    }
+  }
+
+  std::optional<common::Point> FreeCellIndex::get_random_cell(common::Xoshiro256 &rng) const {
+    if (cells.empty())
+      return std::nullopt;
+
+    const auto i = cells[rng.next_int(0, static_cast<int>(cells.size()) - 1)];
+    return common::Point{static_cast<int>(i % width), static_cast<int>(i / width)};
+  }
+
+  void FreeCellIndex::insert(const int x, const int y) {
+    if (slots(y, x) >= 0)
+      return;
+
+    slots(y, x) = static_cast<std::int32_t>(cells.size());
+    cells.push_back(static_cast<std::uint32_t>(y * width + x));
+  }
+
+  void FreeCellIndex::erase(const int x, const int y) {
+    const auto slot = slots(y, x);
+    if (slot < 0)
+      return;
+
+    // Swap the last cell into the hole
+    const auto last = cells.back();
+    cells[slot] = last;
+    slots[last] = slot;
+    cells.pop_back();
+    slots(y, x) = -1;
+  }
+
+  bool Map::is_spawnable(const int x, const int y) {
+    return get_cell(x, y) != 0 && (!has_regions() || get_region_id(x, y) == get_largest_region());
+  }
+
+  void Map::update_regions() {
+    if (!regions_dirty || chunks != nullptr)
+      return;
+    regions_dirty = false;
+
+    common::BitGrid floor(width, height);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++)
+        floor.set(x, y, (*map)(y, x) != 0);
+    }
+    regions = level_generation::label_regions(floor);
+
+    // Occupancy is kept, only which cells count as passable changes
+    if (!free_cells.empty()) {
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+          free_cells.set_passable(x, y, is_spawnable(x, y));
+      }
+    }
+  }
+
+  FreeCellIndex &Map::get_free_cells() {
+    update_regions();
+    if (free_cells.empty() && chunks == nullptr) {
+      free_cells = FreeCellIndex(width, height);
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          if (is_spawnable(x, y))
+            free_cells.set_passable(x, y, true);
+        }
+      }
+    }
+
+    return free_cells;
+  }
+
+  std::optional<common::Point> Map::get_random_free_point(common::Xoshiro256 &rng) {
+    if (chunks != nullptr)
+      return std::nullopt;
+    return get_free_cells().get_random_cell(rng);
+  }
+
+  bool Map::is_free(const int x, const int y) {
+    if (chunks != nullptr || x < 0 || y < 0 || x >= width || y >= height)
+      return false;
+    return get_free_cells().is_free(x, y);
+  }
+
+  bool Map::is_occupied(const int x, const int y) {
+    if (chunks != nullptr || x < 0 || y < 0 || x >= width || y >= height)
+      return false;
+    return get_free_cells().is_occupied(x, y);
+  }
+
+  std::vector<common::Point> Map::get_spawn_points(const int count, const SpawnOptions &options,
+                                                   common::Xoshiro256 &rng,
+                                                   const std::function<bool(int x, int y)> &is_taken) {
+    std::vector<common::Point> points{};
+    if (count <= 0 || width == 0 || height == 0)
+      return points;
+
+    points.reserve(count);
+
+    // Accepted points are bucketed in cells small enough that each holds at most
+    // one of them, so checking the spacing only looks at a few neighbors.
+    const int min_distance = std::max(1, options.min_distance);
+    const int min_distance_sq = min_distance * min_distance;
+    const int bucket_size = std::max(1, static_cast<int>(min_distance / std::numbers::sqrt2));
+    const int reach = min_distance / bucket_size + 1;
+    const auto bucket_key = [](const int bx, const int by) {
+      return static_cast<std::uint64_t>(static_cast<std::uint32_t>(bx)) << 32 | static_cast<std::uint32_t>(by);
+    };
+    std::unordered_map<std::uint64_t, common::Point> buckets{};
+    buckets.reserve(count);
+
+    const auto try_point = [&](const common::Point p) {
+      if (options.avoid.has_value() && options.avoid_distance > 0) {
+        const int dx = p.x - options.avoid->x;
+        const int dy = p.y - options.avoid->y;
+        if (dx * dx + dy * dy < options.avoid_distance * options.avoid_distance)
+          return;
+      }
+
+      const int bx = p.x / bucket_size;
+      const int by = p.y / bucket_size;
+      for (int y = by - reach; y <= by + reach; y++) {
+        for (int x = bx - reach; x <= bx + reach; x++) {
+          if (const auto it = buckets.find(bucket_key(x, y)); it != buckets.end()) {
+            const int dx = p.x - it->second.x;
+            const int dy = p.y - it->second.y;
+            if (dx * dx + dy * dy < min_distance_sq)
+              return;
+          }
+        }
+      }
+
+      if (is_taken(p.x, p.y))
+        return;
+
+      buckets.emplace(bucket_key(bx, by), p);
+      points.push_back(p);
+    };
+
+    if (chunks != nullptr) {
+      for (int attempts = 0; attempts < count * 64 && static_cast<int>(points.size()) < count; attempts++)
+        try_point(get_random_point({0}, rng));
+      return points;
+    }
+
+    const auto region = options.region < 0 ? get_largest_region() : options.region;
+    const auto is_full = [&] { return static_cast<int>(points.size()) >= count; };
+    const auto to_point = [&](const std::uint32_t i) {
+      return common::Point{static_cast<int>(i % width), static_cast<int>(i / width)};
+    };
+
+    // The free cells only cover the largest region, which is what nearly every
+    // batch asks for. Random draws from them cost about the same per point however
+    // big the map is.
+    std::vector<std::uint32_t> candidates{};
+    if (!has_regions() || region == get_largest_region()) {
+      const auto &cells = get_free_cells().get_cells();
+      for (int attempts = 0; attempts < count * 32 && !is_full() && !cells.empty(); attempts++)
+        try_point(to_point(cells[rng.next_int(0, static_cast<int>(cells.size()) - 1)]));
+
+      if (is_full())
+        return points;
+      candidates = cells;
+    } else {
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          if ((*map)(y, x) != 0 && get_region_id(x, y) == region)
+            candidates.push_back(static_cast<std::uint32_t>(y * width + x));
+        }
+      }
+    }
+
+    // Crowded, so go through every candidate. Shuffled as we go so we stop as soon
+    // as the batch is full
+    for (std::size_t i = 0; i < candidates.size() && !is_full(); i++) {
+      std::swap(candidates[i], candidates[rng.next_int(static_cast<int>(i), static_cast<int>(candidates.size()) - 1)]);
+      try_point(to_point(candidates[i]));
+    }
+
+    return points;
+  }
+
+  std::vector<common::Point> Map::find_path(AStar &astar, const common::Point start, const common::Point goal,
+                                            const PathOptions &options) {
+    if (chunks == nullptr)
+      return astar.find_path(*map, start, goal, options);
+
+    return astar.find_path(get_path_bounds(start, goal), start, goal,
+                           [this](const int x, const int y) { return chunks->get_cell(x, y) != 0; }, options);
+  }
+
+  void Map::build_path_hierarchy(common::WorkerPool *pool) {
+    if (chunks == nullptr)
+      hierarchy.build(*map, pool);
+  }
+
+  std::vector<common::Point> Map::find_long_path(const common::Point start, const common::Point goal) {
+    if (chunks != nullptr)
+      return {};
+    return hierarchy.find_path(*map, start, goal);
+  }
+
+  common::Rect Map::get_path_bounds(const common::Point start, const common::Point goal) const {
+    const int padding = chunks->get_chunk_size();
+    const int left = std::max(0, std::min(start.x, goal.x) - padding);
+    const int top = std::max(0, std::min(start.y, goal.y) - padding);
+    const int right = std::min(width, std::max(start.x, goal.x) + padding + 1);
+    const int bottom = std::min(height, std::max(start.y, goal.y) + padding + 1);
+
+    return common::Rect{{left, top}, {std::max(0, right - left), std::max(0, bottom - top)}};
+  }
+
+  std::vector<std::vector<common::Point> > Map::find_paths(
+    const std::vector<std::pair<common::Point, common::Point> > &queries, common::WorkerPool &pool,
+    const PathOptions &options) {
+    std::vector<std::vector<common::Point> > paths(queries.size());
+
+    // The map can't change under the workers since we don't return until they're
+    // done, so a regular map is searched in place
+    if (chunks == nullptr) {
+      const auto &grid = *map;
+      pool.parallel_for(static_cast<int>(queries.size()), [&](const int i) {
+        thread_local AStar astar{};
+        paths[i] = astar.find_path(grid, queries[i].first, queries[i].second, options);
+      });
+      return paths;
+    }
+
+    // Loading chunks isn't thread safe, so copy the part of the map each query
+    // needs up front and let the workers search the copies. The copies are
+    // capped, queries past that are searched here one at a time instead
+    constexpr std::size_t MAX_WINDOW_CELLS = std::size_t{1} << 22;
+    std::vector<std::pair<common::Rect, common::TileGrid<std::uint8_t> > > windows{};
+    std::vector<int> window_queries{};
+    std::vector<int> sequential_queries{};
+    std::size_t window_cells = 0;
+    for (int i = 0; i < static_cast<int>(queries.size()); i++) {
+      const auto &[start, goal] = queries[i];
+      const auto bounds = get_path_bounds(start, goal);
+      const auto area = static_cast<std::size_t>(bounds.size.width) * bounds.size.height;
+      if (window_cells + area > MAX_WINDOW_CELLS) {
+        sequential_queries.push_back(i);
+        continue;
+      }
+
+      window_cells += area;
+      common::TileGrid<std::uint8_t> window(bounds.size.width, bounds.size.height);
+      for (int y = 0; y < bounds.size.height; y++) {
+        for (int x = 0; x < bounds.size.width; x++)
+          window(y, x) = static_cast<std::uint8_t>(chunks->get_cell(bounds.point.x + x, bounds.point.y + y));
+      }
+      windows.emplace_back(bounds, std::move(window));
+      window_queries.push_back(i);
+    }
+
+    pool.parallel_for(static_cast<int>(windows.size()), [&](const int w) {
+      thread_local AStar astar{};
+      const auto &[bounds, window] = windows[w];
+      const auto &[start, goal] = queries[window_queries[w]];
+      paths[window_queries[w]] = astar.find_path(bounds, start, goal, [&](const int x, const int y) {
+        return window(y - bounds.point.y, x - bounds.point.x) != 0;
+      }, options);
+    });
+
+    AStar astar{};
+    for (const auto i: sequential_queries)
+      paths[i] = find_path(astar, queries[i].first, queries[i].second, options);
+
+    return paths;
+  }
+
+  void Map::compute_distance_field(DistanceField &field, const std::vector<common::Point> &sources,
+                                   const int max_distance) {
+    if (chunks == nullptr) {
+      field.compute(common::Rect{{0, 0}, {width, height}}, sources, max_distance, [this](const int x, const int y) {
+        return (*map)(y, x) != 0;
+      });
+      return;
+    }
+
+    const int reach = max_distance > 0 ? max_distance : chunks->get_chunk_size();
+    int left = width, top = height, right = 0, bottom = 0;
+    for (const auto &[x, y]: sources) {
+      left = std::min(left, x - reach);
+      top = std::min(top, y - reach);
+      right = std::max(right, x + reach + 1);
+      bottom = std::max(bottom, y + reach + 1);
+    }
+    left = std::max(0, left);
+    top = std::max(0, top);
+    right = std::min(width, right);
+    bottom = std::min(height, bottom);
+
+    field.compute(common::Rect{{left, top}, {std::max(0, right - left), std::max(0, bottom - top)}}, sources,
+                  max_distance, [this](const int x, const int y) { return chunks->get_cell(x, y) != 0; });
+  }
+
+  void Map::occupy(const int x, const int y) {
+    if (chunks == nullptr && x >= 0 && y >= 0 && x < width && y < height)
+      get_free_cells().occupy(x, y);
+  }
+
+  void Map::vacate(const int x, const int y) {
+    if (chunks == nullptr && x >= 0 && y >= 0 && x < width && y < height)
+      get_free_cells().vacate(x, y);
+  }
+
+  void Map::clear_occupancy() {
+    if (chunks == nullptr)
+      get_free_cells().clear_occupancy();
+  }
+
+  int Map::get_light_value(const int x, const int y) const {
+    const auto light_cell = get_light_cell(x, y);
+    return light_cell == 0 && is_explored(x, y) ? 2 : light_cell;
+  }
+
+  void Map::draw_map_segment(SDL_Renderer *renderer, const roguely::common::Dimension &dimensions,
+                             const common::Size cell_size,
+                             const std::function<void(int, int, int, int)> &draw_cell_hook) {
+    const common::Size cells{dimensions.size.width - dimensions.point.x, dimensions.size.height - dimensions.point.y};
+
+    if (cells.width <= 0 || cells.height <= 0)
+      return;
+
+    const int texture_width = cells.width * cell_size.width;
+    const int texture_height = cells.height * cell_size.height;
+
+    // Only a new viewport size needs a new texture
+    if (current_map_segment_texture == nullptr || !map_segment_cells.eq(cells) || !map_segment_cell_size.eq(cell_size)) {
+      if (current_map_segment_texture != nullptr)
+        SDL_DestroyTexture(current_map_segment_texture);
+
+      current_map_segment_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                                      texture_width, texture_height);
+      map_segment_cells = cells;
+      map_segment_cell_size = cell_size;
+      redraw_all = true;
+    }
+
+    const auto wrap = [](const int v, const int n) { return ((v % n) + n) % n; };
+
+    // What scrolled into view since the last draw
+    int new_columns_begin = 0, new_columns_end = 0, new_rows_begin = 0, new_rows_end = 0;
+
+    if (!redraw_all && !map_segment_origin.eq(dimensions.point)) {
+      const int scroll_x = dimensions.point.x - map_segment_origin.x;
+      const int scroll_y = dimensions.point.y - map_segment_origin.y;
+
+      if (std::abs(scroll_x) >= cells.width || std::abs(scroll_y) >= cells.height) {
+        redraw_all = true;
+      } else {
+        new_columns_begin = scroll_x > 0 ? dimensions.size.width - scroll_x : dimensions.point.x;
+        new_columns_end = scroll_x > 0 ? dimensions.size.width : dimensions.point.x - scroll_x;
+        new_rows_begin = scroll_y > 0 ? dimensions.size.height - scroll_y : dimensions.point.y;
+        new_rows_end = scroll_y > 0 ? dimensions.size.height : dimensions.point.y - scroll_y;
+      }
+    }
+
+    map_segment_origin = dimensions.point;
+
+    if (redraw_all || new_columns_begin != new_columns_end || new_rows_begin != new_rows_end || !dirty_cells.empty()) {
+      SDL_SetRenderTarget(renderer, current_map_segment_texture);
+
+      SDL_BlendMode blend_mode;
+      SDL_GetRenderDrawBlendMode(renderer, &blend_mode);
+
+      const auto draw_cell = [&](const int cols, const int rows) {
+        if (cols < dimensions.point.x || cols >= dimensions.size.width ||
+            rows < dimensions.point.y || rows >= dimensions.size.height)
+          return;
+
+        // dx, dy = where the cell's slot is in the texture
+        const int dx = wrap(cols, cells.width) * cell_size.width;
+        const int dy = wrap(rows, cells.height) * cell_size.height;
+
+        // Whatever was in this slot before has to go, including its alpha
+        const SDL_Rect slot = {dx, dy, cell_size.width, cell_size.height};
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderFillRect(renderer, &slot);
+        SDL_SetRenderDrawBlendMode(renderer, blend_mode);
+
+        draw_cell_hook(cols, rows, dx, dy);
+      };
+
+      if (redraw_all) {
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+
+        for (int rows = dimensions.point.y; rows < dimensions.size.height; rows++) {
+          for (int cols = dimensions.point.x; cols < dimensions.size.width; cols++)
+            draw_cell(cols, rows);
+        }
+      } else {
+        for (int rows = dimensions.point.y; rows < dimensions.size.height; rows++) {
+          for (int cols = new_columns_begin; cols < new_columns_end; cols++)
+            draw_cell(cols, rows);
+        }
+
+        for (int rows = new_rows_begin; rows < new_rows_end; rows++) {
+          for (int cols = dimensions.point.x; cols < dimensions.size.width; cols++)
+            draw_cell(cols, rows);
+        }
+
+        for (const auto &[cols, rows]: dirty_cells)
+          draw_cell(cols, rows);
+      }
+
+      redraw_all = false;
+      dirty_cells.clear();
+    }
+
+    SDL_SetRenderTarget(renderer, nullptr);
+
+    // Unwrap the texture, the slot for the top left cell of the viewport is
+    // where the copy starts from
+    const int split_x = wrap(dimensions.point.x, cells.width) * cell_size.width;
+    const int split_y = wrap(dimensions.point.y, cells.height) * cell_size.height;
+    const int right = texture_width - split_x;
+    const int bottom = texture_height - split_y;
+
+    const std::array<std::pair<SDL_Rect, SDL_Rect>, 4> pieces = {{
+      {{split_x, split_y, right, bottom}, {0, 0, right, bottom}},
+      {{0, split_y, split_x, bottom}, {right, 0, split_x, bottom}},
+      {{split_x, 0, right, split_y}, {0, bottom, right, split_y}},
+      {{0, 0, split_x, split_y}, {right, bottom, split_x, split_y}}
+    }};
+
+    for (const auto &[source, destination]: pieces) {
+      if (source.w > 0 && source.h > 0)
+        SDL_RenderCopy(renderer, current_map_segment_texture, &source, &destination);
+    }
+  }
+
+  void Map::draw_map(SDL_Renderer *renderer, const common::Dimension &dimensions, const int x, const int y,
+                     const int a, const std::function<void(int, int, int)> &draw_hook) {
+    if (!current_full_map_dimension.eq(dimensions)) {
+      current_full_map_dimension = dimensions;
+
+      if (current_full_map_texture != nullptr)
+        SDL_DestroyTexture(current_full_map_texture);
+
+      current_full_map_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width,
+                                                   height);
+      SDL_SetTextureBlendMode(current_full_map_texture, SDL_BLENDMODE_BLEND);
+      SDL_SetRenderTarget(renderer, current_full_map_texture);
+      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+      SDL_SetTextureAlphaMod(current_full_map_texture, a);
+      SDL_RenderClear(renderer);
+
+      if (chunks != nullptr) {
+        // Chunked maps only show what is currently loaded
+        if (draw_hook != nullptr)
+          chunks->for_each_resident_cell([&](const int cols, const int rows, const int cell_id) {
+            draw_hook(rows, cols, cell_id);
+          });
+      } else {
+        for (int rows = 0; rows < height; rows++) {
+          for (int cols = 0; cols < width; cols++) {
+            if (draw_hook != nullptr) {
+              draw_hook(rows, cols, (*map)(rows, cols));
+            }
+          }
+        }
+      }
+    }
+
+    SDL_SetRenderTarget(renderer, nullptr);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    const SDL_Rect destination = {x, y, width, height};
+    SDL_RenderCopy(renderer, current_full_map_texture, nullptr, &destination);
+  }
+
+  // Symmetric shadowcasting (https://www.albertford.com/shadowcasting/), one
+  // quadrant at a time. Slopes are kept as fractions so the edges of shadows
+  // come out the same in every direction.
+  template<typename IsOpaque, typename Reveal>
+  static void cast_shadows(const common::Point origin, const int radius, const int max_depth, IsOpaque &&is_opaque,
+                           Reveal &&reveal) {
+    struct Row {
+      int depth;
+      int start_num, start_den; // slopes are num / den, den is always positive
+      int end_num, end_den;
+    };
+
+    // (depth, col) -> map offsets for north, south, east and west
+    constexpr int transforms[4][4] = {{1, 0, 0, -1}, {1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}};
+
+    const auto floor_div = [](const int a, const int b) { return a / b - (a % b != 0 && a < 0); };
+    const auto in_radius = [&](const int depth, const int col) {
+      return radius <= 0 || depth * depth + col * col <= radius * radius + radius;
+    };
+
+    thread_local std::vector<Row> rows{};
+
+    reveal(origin.x, origin.y);
+
+    for (const auto &[xx, xy, yx, yy]: transforms) {
+      rows.clear();
+      rows.push_back({1, -1, 1, 1, 1});
+
+      while (!rows.empty()) {
+        auto row = rows.back();
+        rows.pop_back();
+
+        if (row.depth > max_depth)
+          continue;
+
+        // Round ties up at the start and down at the end
+        const int min_col = floor_div(2 * row.depth * row.start_num + row.start_den, 2 * row.start_den);
+        const int max_col = -floor_div(-(2 * row.depth * row.end_num - row.end_den), 2 * row.end_den);
+        int previous = -1; // -1 nothing yet, 0 floor, 1 wall
+
+        for (int col = min_col; col <= max_col; col++) {
+          const int x = origin.x + col * xx + row.depth * xy;
+          const int y = origin.y + col * yx + row.depth * yy;
+          const bool wall = is_opaque(x, y);
+          const bool symmetric = col * row.start_den >= row.depth * row.start_num &&
+                                 col * row.end_den <= row.depth * row.end_num;
+
+          if ((wall || symmetric) && in_radius(row.depth, col))
+            reveal(x, y);
+
+          if (previous == 1 && !wall) {
+            row.start_num = 2 * col - 1;
+            row.start_den = 2 * row.depth;
+          }
+
+          if (previous == 0 && wall)
+            rows.push_back({row.depth + 1, row.start_num, row.start_den, 2 * col - 1, 2 * row.depth});
+
+          previous = wall ? 1 : 0;
+        }
+
+        if (previous == 0)
+          rows.push_back({row.depth + 1, row.start_num, row.start_den, row.end_num, row.end_den});
+      }
+    }
+  }
+
+  void Map::calculate_field_of_view(const roguely::common::Dimension &dimensions, const int radius) {
+    // Only the viewport ever gets drawn so that is all we light, which also keeps
+    // this from growing with the size of the map.
+    const int window_width = dimensions.size.width - dimensions.point.x;
+    const int window_height = dimensions.size.height - dimensions.point.y;
+
+    // Only cells that change between lit and unlit need to be redrawn, cells
+    // lit last time are marked so the ones that stay lit can be told apart
+    constexpr std::uint8_t WAS_LIT = 3;
+    const int previous_width = light_map.get_width();
+    const common::Point previous_origin = light_origin;
+
+    std::swap(previously_lit_cells, lit_cells);
+    lit_cells.clear();
+
+    if (light_map.get_height() != window_height || light_map.get_width() != window_width) {
+      light_map = common::TileGrid<std::uint8_t>(window_width, window_height);
+    } else {
+      for (const auto i: previously_lit_cells)
+        light_map[i] = 0;
+    }
+
+    light_origin = dimensions.point;
+
+    // Carry over what was lit into the new window, anything that scrolled out
+    // of it won't be drawn anyway
+    std::size_t kept = 0;
+    for (const auto i: previously_lit_cells) {
+      const int lx = previous_origin.x + static_cast<int>(i % previous_width) - light_origin.x;
+      const int ly = previous_origin.y + static_cast<int>(i / previous_width) - light_origin.y;
+      if (light_map.contains(ly, lx)) {
+        light_map(ly, lx) = WAS_LIT;
+        previously_lit_cells[kept++] = static_cast<std::uint32_t>(ly * window_width + lx);
+      }
+    }
+    previously_lit_cells.resize(kept);
+
+    // Whoever is at the origin moved, so both spots need drawing again
+    redraw_cell(fov_origin.x, fov_origin.y);
+    fov_origin = dimensions.supplimental_point;
+    redraw_cell(fov_origin.x, fov_origin.y);
+
+    const auto is_opaque = [&](const int x, const int y) {
+      return x < 0 || y < 0 || x >= width || y >= height || get_cell(x, y) == 0;
+    };
+
+    // Bounds of whatever gets explored for the first time
+    common::Point explored_min{width, height};
+    common::Point explored_max{-1, -1};
+
+    const auto reveal = [&](const int x, const int y) {
+      const int lx = x - light_origin.x;
+      const int ly = y - light_origin.y;
+      if (!light_map.contains(ly, lx) || light_map(ly, lx) == 1)
+        return;
+
+      if (light_map(ly, lx) == 0)
+        redraw_cell(x, y);
+
+      light_map(ly, lx) = 1;
+      lit_cells.push_back(static_cast<std::uint32_t>(ly * window_width + lx));
+
+      if (mark_explored(x, y)) {
+        explored_min = {std::min(explored_min.x, x), std::min(explored_min.y, y)};
+        explored_max = {std::max(explored_max.x, x), std::max(explored_max.y, y)};
+      }
+    };
+
+    // Nothing further out than the viewport is ever drawn
+    const int window_depth = std::max(window_width, window_height);
+    const int max_depth = radius > 0 ? std::min(radius, window_depth) : window_depth;
+
+    cast_shadows(dimensions.supplimental_point, radius, max_depth, is_opaque, reveal);
+
+    for (const auto i: previously_lit_cells) {
+      if (light_map[i] == WAS_LIT) {
+        light_map[i] = 0;
+        redraw_cell(light_origin.x + static_cast<int>(i % window_width), light_origin.y + static_cast<int>(i / window_width));
+      }
+    }
+
+    if (explored_max.x >= 0) {
+      // Nobody may be collecting these, so don't let them pile up
+      if (explored_regions.size() >= 64) {
+        for (const auto &[point, size]: explored_regions) {
+          explored_min = {std::min(explored_min.x, point.x), std::min(explored_min.y, point.y)};
+          explored_max = {
+            std::max(explored_max.x, point.x + size.width - 1), std::max(explored_max.y, point.y + size.height - 1)
+          };
+        }
+        explored_regions.clear();
+      }
+
+      explored_regions.push_back({
+        explored_min, {explored_max.x - explored_min.x + 1, explored_max.y - explored_min.y + 1}
+      });
+    }
+  }
+
+  bool Map::mark_explored(const int x, const int y) {
+    common::BitGrid *bits = &explored;
+    int bx = x;
+    int by = y;
+
+    if (chunks != nullptr) {
+      const auto key = (static_cast<std::uint64_t>(static_cast<std::uint32_t>(y / EXPLORED_TILE_SIZE)) << 32) |
+                       static_cast<std::uint32_t>(x / EXPLORED_TILE_SIZE);
+      auto [it, _] = explored_tiles.try_emplace(key, EXPLORED_TILE_SIZE, EXPLORED_TILE_SIZE);
+      bits = &it->second;
+      bx = x % EXPLORED_TILE_SIZE;
+      by = y % EXPLORED_TILE_SIZE;
+    }
+
+    if (bits->get(bx, by))
+      return false;
+
+    bits->set(bx, by, true);
+    explored_count++;
+
+    if (minimap_colors.unexplored.has_value())
+      mark_minimap_dirty(x, y);
+    return true;
+  }
+
+  bool Map::is_explored(const int x, const int y) const {
+    if (x < 0 || y < 0 || x >= width || y >= height)
+      return false;
+
+    if (chunks == nullptr)
+      return explored.get(x, y);
+
+    const auto key = (static_cast<std::uint64_t>(static_cast<std::uint32_t>(y / EXPLORED_TILE_SIZE)) << 32) |
+                     static_cast<std::uint32_t>(x / EXPLORED_TILE_SIZE);
+    const auto it = explored_tiles.find(key);
+    return it != explored_tiles.end() && it->second.get(x % EXPLORED_TILE_SIZE, y % EXPLORED_TILE_SIZE);
+  }
+
+  std::vector<roguely::common::Point> Map::get_visible_points() const {
+    std::vector<roguely::common::Point> points{};
+    points.reserve(lit_cells.size());
+
+    for (const auto i: lit_cells) {
+      points.push_back({light_origin.x + static_cast<int>(i % light_map.get_width()),
+                        light_origin.y + static_cast<int>(i / light_map.get_width())});
+    }
+
+    return points;
+  }
+
+  roguely::common::Point Map::get_random_point(const std::set<int> &off_limit_sprites_ids, common::Xoshiro256 &rng,
+                                               const std::int32_t region) {
+    if (width == 0 || height == 0) {
+      throw std::runtime_error("Empty map");
+    }
+
+    if (off_limit_sprites_ids.empty()) {
+      const int row = rng.next_int(0, height - 1);
+      return roguely::common::Point{rng.next_int(0, width - 1), row};
+    }
+
+    if (chunks != nullptr) {
+      // Pick a chunk, then a cell in it. Only the chunks we land on get loaded.
+      const int chunk_size = chunks->get_chunk_size();
+      const int chunks_across = (width + chunk_size - 1) / chunk_size;
+      const int chunks_down = (height + chunk_size - 1) / chunk_size;
+
+      for (int attempts = 0; attempts < chunks_across * chunks_down * 16; attempts++) {
+        const int chunk_x = rng.next_int(0, chunks_across - 1);
+        const int chunk_y = rng.next_int(0, chunks_down - 1);
+        const int col = std::min(chunk_x * chunk_size + rng.next_int(0, chunk_size - 1), width - 1);
+
+        if (const int row = std::min(chunk_y * chunk_size + rng.next_int(0, chunk_size - 1), height - 1);
+          !off_limit_sprites_ids.contains(chunks->get_cell(col, row))) {
+          return roguely::common::Point{col, row};
+        }
+      }
+
+      throw std::runtime_error("Unable to find a random point in map");
+    }
+
+    const size_t maxAttempts = height * width;
+    size_t attempts = 0;
+
+    while (attempts < maxAttempts) {
+      const int row = rng.next_int(0, height - 1);
+
+      if (const int col = rng.next_int(0, width - 1); !off_limit_sprites_ids.contains((*map)(row, col)) &&
+                                                       (region == 0 || get_region_id(col, row) == region)) {
+        // fmt::println("Found random point: ({},{}) = {}", row, col, (*map)(row, col));
+        return roguely::common::Point{col, row};
+      }
+
+      attempts++;
+    }
+
+    throw std::runtime_error("Unable to find a random point in map");
+  }
+
+  void AStar::prepare(const std::size_t cell_count) {
+    if (stamps.size() != cell_count) {
+      stamps.assign(cell_count, 0);
+      costs.resize(cell_count);
+      parents.resize(cell_count);
+      generation = 0;
     }
-    group->entities->emplace_back(e);
-
-    // Create Lua mapping (entity_group->entity->components)
-    sol::table lua_entity_table;
-    if (!lua_entities[group_name].valid()) {
-      lua_entity_table = lua.create_table();
-    } else
-      lua_entity_table = lua_entities[group_name];
 
-    if (const auto lua_component = e->find_first_component_by_type<roguely::components::LuaComponent>();
-      lua_component != nullptr) {
-      auto full_name = fmt::format("{}-{}", e->get_name(), e->get_id());
-      lua_entity_table.set(full_name,
-                           lua.create_table_with(
-                             "id", e->get_id(),
-                             "name", e->get_name(),
-                             "full_name", full_name,
-                             "components", lua_component->get_properties()));
+    // Wipe the stamps when the generation wraps so old ones can't match
+    if (++generation == 0) {
+      std::ranges::fill(stamps, 0);
+      generation = 1;
     }
 
-    lua_entities.set(group_name, lua_entity_table);
+    open.clear();
+    nodes_expanded = 0;
   }
 
-  std::shared_ptr<Entity> EntityManager::create_entity_in_group(const std::string &group_name,
-                                                                const std::string &entity_name) const {
-    auto entity = std::make_shared<Entity>(entity_name);
-    if (const auto entity_group = get_entity_group(group_name); entity_group != nullptr) {
-      entity_group->entities->emplace_back(entity);
-      return entity;
-    }
-    return nullptr;
-  }
+  void AStar::push(const OpenNode node) {
+    auto i = open.size();
+    open.push_back(node);
 
-  void EntityManager::remove_entity(const std::string &entity_group_name, const std::string &entity_id) {
-    if (const auto entity_group = get_entity_group(entity_group_name); entity_group != nullptr) {
-      const auto entity_to_remove = std::ranges::find_if(*entity_group->entities,
-                                                         [&](const std::shared_ptr<Entity> &e) {
-                                                           return (e->get_id() == entity_id) ? true : false;
-                                                         });
+    while (i > 0) {
+      const auto parent = (i - 1) / 4;
+      if (!before(node, open[parent]))
+        break;
+      open[i] = open[parent];
+      i = parent;
+    }
 
-      if (entity_to_remove != entity_group->entities->end()) {
-        std::string full_name = fmt::format("{}-{}", (*entity_to_remove)->get_name(), (*entity_to_remove)->get_id());
+    open[i] = node;
+  }
 
-        // fmt::println("Removing entity: {}", full_name);
+  AStar::OpenNode AStar::pop() {
+    const auto top = open.front();
+    const auto last = open.back();
+    open.pop_back();
 
-        sol::table entity_group_table = lua_entities[entity_group_name];
-        entity_group_table.set(full_name, sol::nil);
+    if (open.empty())
+      return top;
 
-        // fmt::println("Checking entity is valid: {}", entity_group_table[full_name].valid());
+    std::size_t i = 0;
+    while (true) {
+      const auto first_child = i * 4 + 1;
+      if (first_child >= open.size())
+        break;
 
-        entity_group->entities->erase(entity_to_remove);
+      auto best = first_child;
+      for (auto child = first_child + 1; child < std::min(first_child + 4, open.size()); child++) {
+        if (before(open[child], open[best]))
+          best = child;
       }
-    }
-  }
 
-  std::shared_ptr<EntityGroup> EntityManager::get_entity_group(const std::string &group_name) const {
-    const auto group = std::ranges::find_if(*entity_groups,
-                                            [&](const std::shared_ptr<EntityGroup> &eg) {
-                                              return eg->name == group_name;
-                                            });
+      if (!before(open[best], last))
+        break;
 
-    if (group != entity_groups->end()) {
-      return *group;
+      open[i] = open[best];
+      i = best;
     }
 
-    return nullptr;
+    open[i] = last;
+    return top;
   }
 
-  std::shared_ptr<std::vector<std::shared_ptr<Entity> > > EntityManager::get_entities_in_group(
-    const std::string &group_name) const {
-    if (const auto entity_group = get_entity_group(group_name); entity_group != nullptr) {
-      return entity_group->entities;
+  int AStar::get_jump_directions(const int x, const int y, const int px, const int py,
+                                 std::array<std::pair<int, int>, 8> &directions) const {
+    int count = 0;
+    const auto add = [&](const int dx, const int dy) { directions[count++] = {dx, dy}; };
+
+    // The start has nothing to prune
+    if (px == INT_MIN) {
+      for (const auto &[dx, dy]: DIRECTIONS) {
+        if (dx != 0 && dy != 0 && (!is_open(x + dx, y) || !is_open(x, y + dy)))
+          continue;
+        add(dx, dy);
+      }
+      return count;
     }
 
-    return nullptr;
-  }
-
-  std::string EntityManager::get_entity_id_by_name(const std::string &group_name, const std::string &entity_name) const {
-    if (const auto entity = EntityManager::get_entity_by_name(group_name, entity_name); entity != nullptr) {
-      return entity->get_id();
+    const int dx = (x > px) - (x < px);
+    const int dy = (y > py) - (y < py);
+
+    if (dx != 0 && dy != 0) {
+      const bool horizontal = is_open(x + dx, y);
+      const bool vertical = is_open(x, y + dy);
+      if (vertical)
+        add(0, dy);
+      if (horizontal)
+        add(dx, 0);
+      if (horizontal && vertical)
+        add(dx, dy);
+    } else if (dx != 0) {
+      const bool ahead = is_open(x + dx, y);
+      const bool below = is_open(x, y + 1);
+      const bool above = is_open(x, y - 1);
+      add(dx, 0);
+      if (ahead && below)
+        add(dx, 1);
+      if (ahead && above)
+        add(dx, -1);
+      if (below)
+        add(0, 1);
+      if (above)
+        add(0, -1);
+    } else {
+      const bool ahead = is_open(x, y + dy);
+      const bool right = is_open(x + 1, y);
+      const bool left = is_open(x - 1, y);
+      add(0, dy);
+      if (ahead && right)
+        add(1, dy);
+      if (ahead && left)
+        add(-1, dy);
+      if (right)
+        add(1, 0);
+      if (left)
+        add(-1, 0);
     }
-    return "";
-  }
-
-  std::shared_ptr<Entity> EntityManager::get_entity_by_name(const std::string &entity_group,
-                                                            const std::string &entity_name) const {
-    return find_entity(entity_group, [&](const std::shared_ptr<Entity> &e) { return e->get_name() == entity_name; });
-  }
 
-  std::shared_ptr<Entity>
-  EntityManager::get_entity_by_id(const std::string &entity_group, const std::string &entity_id) const {
-    return find_entity(entity_group, [&](const std::shared_ptr<Entity> &e) { return e->get_id() == entity_id; });
+    return count;
   }
 
-  std::shared_ptr<std::vector<std::shared_ptr<Entity>>> EntityManager::find_entities_in_group(
-    const std::string &entity_group, const std::function<bool(std::shared_ptr<Entity>)> &predicate) const {
-    const auto entity_group_ptr = get_entity_group(entity_group);
-    auto entities = std::make_shared<std::vector<std::shared_ptr<Entity> > >();
-
-    if (entity_group_ptr != nullptr) {
-      for (const auto &e: *entity_group_ptr->entities) {
-        if (predicate(e)) {
-          entities->emplace_back(e);
-        }
+  std::optional<common::Point> AStar::jump(int x, int y, const int dx, const int dy) const {
+    while (true) {
+      if (!is_open(x, y))
+        return std::nullopt;
+
+      if (x == goal.x && y == goal.y)
+        return common::Point{x, y};
+
+      if (dx != 0 && dy != 0) {
+        // Stop wherever a straight jump would find something
+        if (jump(x + dx, y, dx, 0) || jump(x, y + dy, 0, dy))
+          return common::Point{x, y};
+
+        // No squeezing between two walls
+        if (!is_open(x + dx, y) || !is_open(x, y + dy))
+          return std::nullopt;
+      } else if (dx != 0) {
+        // A wall behind us that opens up here means there's a forced neighbor
+        if ((is_open(x, y - 1) && !is_open(x - dx, y - 1)) || (is_open(x, y + 1) && !is_open(x - dx, y + 1)))
+          return common::Point{x, y};
+      } else {
+        if ((is_open(x - 1, y) && !is_open(x - 1, y - dy)) || (is_open(x + 1, y) && !is_open(x + 1, y - dy)))
+          return common::Point{x, y};
       }
 
-      return entities;
+      x += dx;
+      y += dy;
     }
+  }
 
-    return nullptr;
+  std::vector<common::Point> AStar::find_path(const common::Rect &search_bounds, const common::Point start,
+                                              const common::Point search_goal,
+                                              const std::function<bool(int x, int y)> &is_walkable,
+                                              const PathOptions &options) {
+    bounds = search_bounds;
+    goal = search_goal;
+    grid = nullptr;
+    walkable = &is_walkable;
+    return search(start, options);
   }
 
-  std::shared_ptr<Entity> EntityManager::find_entity(const std::string &entity_group,
-                                                     const std::function<bool(std::shared_ptr<Entity>)> &predicate) const {
-    if (const auto entity_group_ptr = get_entity_group(entity_group); entity_group_ptr != nullptr) {
-      const auto entity = std::ranges::find_if(*entity_group_ptr->entities,
-                                               [&](const std::shared_ptr<Entity> &e) {
-                                                 return predicate(e);
-                                               });
+  std::vector<common::Point> AStar::find_path(const common::TileGrid<std::uint8_t> &search_grid,
+                                              const common::Point start, const common::Point search_goal,
+                                              const PathOptions &options) {
+    bounds = common::Rect{{0, 0}, {search_grid.get_width(), search_grid.get_height()}};
+    goal = search_goal;
+    grid = &search_grid;
+    walkable = nullptr;
+    return search(start, options);
+  }
 
-      if (entity != entity_group_ptr->entities->end()) {
-        return *entity;
-      }
-    }
+  std::vector<common::Point> AStar::search(const common::Point start, const PathOptions &options) {
+    diagonal = options.diagonal;
 
-    return nullptr;
-  }
+    const int left = bounds.point.x;
+    const int top = bounds.point.y;
+    const int width = bounds.size.width;
 
-  bool EntityManager::lua_entities_for_each(const std::function<bool(sol::table)> &predicate) const {
-    bool result = false;
+    nodes_expanded = 0;
+    if (!is_open(start.x, start.y) || !is_open(goal.x, goal.y))
+      return {};
 
-    for (const auto &eg: *entity_groups) {
-      for (const auto &e: *eg->entities) {
-        if (auto lua_component = e->find_first_component_by_type<roguely::components::LuaComponent>();
-          lua_component != nullptr) {
-          if (auto lua_components_table = lua_component->get_properties(); lua_components_table.valid()) {
-            result = predicate(lua_components_table);
+    prepare(static_cast<std::size_t>(width) * bounds.size.height);
+
+    const auto index_of = [&](const int x, const int y) {
+      return static_cast<std::uint32_t>((y - top) * width + (x - left));
+    };
+    const auto distance = [&](const int x1, const int y1, const int x2, const int y2) {
+      const int dx = std::abs(x1 - x2);
+      const int dy = std::abs(y1 - y2);
+      return diagonal
+               ? STRAIGHT_COST * std::max(dx, dy) + (DIAGONAL_COST - STRAIGHT_COST) * std::min(dx, dy)
+               : STRAIGHT_COST * (dx + dy);
+    };
+    const auto relax = [&](const std::uint32_t next, const std::uint32_t index, const int next_cost, const int x,
+                           const int y) {
+      if (stamps[next] == generation && costs[next] <= next_cost)
+        return;
+
+      stamps[next] = generation;
+      costs[next] = next_cost;
+      parents[next] = static_cast<std::int32_t>(index);
+
+      const int next_h = distance(x, y, goal.x, goal.y);
+      push({next_cost + next_h, next_h, next});
+    };
+
+    const auto start_index = index_of(start.x, start.y);
+    const auto goal_index = index_of(goal.x, goal.y);
+    stamps[start_index] = generation;
+    costs[start_index] = 0;
+    parents[start_index] = -1;
+    push({distance(start.x, start.y, goal.x, goal.y), distance(start.x, start.y, goal.x, goal.y), start_index});
+
+    // Only 8-connected searches jump. Without diagonals the sideways scans cost more than the expansions they
+    // save on cave maps (see --bench-paths), so those are plain A*
+    const bool jump_points = options.algorithm == PathAlgorithm::JUMP_POINT && diagonal;
+    std::array<std::pair<int, int>, 8> jump_directions{};
+
+    while (!open.empty()) {
+      const auto [f, h, index] = pop();
+      const int cost = f - h;
+
+      // A cheaper way here was found after this was queued
+      if (cost > costs[index])
+        continue;
+
+      if (index == goal_index) {
+        // Jump point paths only hold the turns, so walk each leg out cell by cell
+        std::vector<common::Point> path{};
+        for (auto i = static_cast<std::int32_t>(goal_index); i != -1; i = parents[i]) {
+          const common::Point p{left + i % width, top + i / width};
+          if (!path.empty()) {
+            const auto [bx, by] = path.back();
+            const int dx = (p.x > bx) - (p.x < bx);
+            const int dy = (p.y > by) - (p.y < by);
+            for (int x = bx + dx, y = by + dy; x != p.x || y != p.y; x += dx, y += dy)
+              path.push_back({x, y});
           }
+          path.push_back(p);
         }
+        std::ranges::reverse(path);
+        return path;
       }
-    }
 
-    return result;
-  }
+      nodes_expanded++;
+      const int x = left + static_cast<int>(index) % width;
+      const int y = top + static_cast<int>(index) / width;
 
-  bool EntityManager::lua_is_point_unique(const roguely::common::Point point) const {
-    auto result = true;
-
-    for (const auto &eg: *entity_groups) {
-      for (const auto &e: *eg->entities) {
-        if (auto lua_component = e->find_first_component_by_type<roguely::components::LuaComponent>();
-          lua_component != nullptr) {
-          if (auto lua_components_table = lua_component->get_properties(); lua_components_table.valid()) {
-            if (auto position_component = lua_components_table["position_component"]; position_component.valid()) {
-              const int x = position_component["x"];
-
-              if (const int y = position_component["y"]; x == point.x && y == point.y) {
-                result = false;
-                break;
-              }
-            }
-          }
+      if (jump_points) {
+        int px = INT_MIN, py = INT_MIN;
+        if (parents[index] != -1) {
+          px = left + parents[index] % width;
+          py = top + parents[index] / width;
         }
-      }
-    }
 
-    return result;
-  }
-
-  void EntityManager::lua_for_each_overlapping_point(const std::string &entity_name, const int x, const int y,
-                                                     const sol::function &point_callback) const {
-    for (const auto &eg: *entity_groups) {
-      for (const auto &e: *eg->entities) {
-        if (auto lua_component = e->find_first_component_by_type<roguely::components::LuaComponent>();
-          e->get_name() != entity_name && lua_component != nullptr) {
-          if (auto lua_components_table = lua_component->get_properties(); lua_components_table.valid()) {
-            if (auto position_component = lua_components_table["position_component"]; position_component.valid()) {
-              const int pc_x = position_component["x"];
-
-              if (const int pc_y = position_component["y"]; pc_x == x && pc_y == y) {
-                // fmt::println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, pc_x, pc_y);
-                if (auto point_callback_result = point_callback(fmt::format("{}-{}", e->get_name(), e->get_id()),
-                                                                e->get_name(),
-                                                                lua_components_table); !point_callback_result.valid()) {
-                  sol::error err = point_callback_result;
-                  fmt::println("Lua script error: {}", err.what());
-                }
-              }
-            }
+        const int count = get_jump_directions(x, y, px, py, jump_directions);
+        for (int d = 0; d < count; d++) {
+          const auto [dx, dy] = jump_directions[d];
+          if (const auto jump_point = jump(x + dx, y + dy, dx, dy); jump_point.has_value()) {
+            relax(index_of(jump_point->x, jump_point->y), index,
+                  cost + distance(x, y, jump_point->x, jump_point->y), jump_point->x, jump_point->y);
           }
         }
+        continue;
       }
-    }
-  }
 
-  sol::table EntityManager::get_lua_blocked_points(const std::string &entity_group, const int x, const int y,
-                                                   const std::string &direction, const sol::this_state s) const {
-    sol::state_view lua(s);
-    const auto eg = get_entity_group(entity_group);
-    sol::table result = lua.create_table();
+      for (int d = 0; d < (diagonal ? 8 : 4); d++) {
+        const auto [dx, dy] = DIRECTIONS[d];
+        const int nx = x + dx;
+        const int ny = y + dy;
+        if (nx < left || ny < top || nx >= left + width || ny >= top + bounds.size.height)
+          continue;
 
-    for (const auto &e: *eg->entities) {
-      if (auto lua_component = e->find_first_component_by_type<components::LuaComponent>();
-        lua_component != nullptr) {
-        if (auto lua_components_table = lua_component->get_properties(); lua_components_table.valid()) {
-          if (auto position_component = lua_components_table["position_component"]; position_component.valid()) {
-            bool is_blocked = false;
+        const auto next = index_of(nx, ny);
+        const int next_cost = cost + (dx != 0 && dy != 0 ? DIAGONAL_COST : STRAIGHT_COST);
 
-            int entity_x = position_component["x"];
-            int entity_y = position_component["y"];
+        // Walls are stamped as BLOCKED so they're only looked up once
+        if (stamps[next] == generation && costs[next] <= next_cost)
+          continue;
 
-            const int up_position_y = y - 1;
-            const int down_position_y = y + 1;
-            const int left_position_x = x - 1;
-            const int right_position_x = x + 1;
+        if (dx != 0 && dy != 0 && (!is_open(x + dx, y) || !is_open(x, y + dy)))
+          continue;
 
-            // UP
-            if (direction == "up" && entity_x == x && up_position_y == entity_y) {
-              is_blocked = true;
-            }
-            // DOWN
-            else if (direction == "down" && entity_x == x && entity_y == down_position_y) {
-              is_blocked = true;
-            }
-            // LEFT
-            else if (direction == "left" && entity_x == left_position_x && entity_y == y) {
-              is_blocked = true;
-            }
-            // RIGHT
-            else if (direction == "right" && entity_x == right_position_x && entity_y == y) {
-              is_blocked = true;
-            }
+        if (!is_open(nx, ny)) {
+          stamps[next] = generation;
+          costs[next] = BLOCKED;
+          continue;
+        }
 
-            if (is_blocked) {
-              // fmt::println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, entity_x, entity_y);
+        relax(next, index, next_cost, nx, ny);
+      }
+    }
 
-              result.set("entity_name", e->get_name());
-              result.set("entity_full_name", fmt::format("{}-{}", e->get_name(), e->get_id()));
-              result.set("entity_position", lua.create_table_with("x", entity_x, "y", entity_y));
-              result.set("direction", direction);
-              break;
-            }
+    return {};
+  }
+
+  int bench_paths(const std::uint64_t seed) {
+    constexpr std::array<std::pair<int, int>, 2> sizes{{{300, 200}, {1000, 1000}}};
+    constexpr int maps_per_size = 3;
+    constexpr int queries_per_map = 100;
+
+    const auto cost_of = [](const std::vector<common::Point> &path) {
+      int cost = 0;
+      for (std::size_t i = 1; i < path.size(); i++)
+        cost += path[i].x != path[i - 1].x && path[i].y != path[i - 1].y ? 14 : 10;
+      return cost;
+    };
+    // Every cell open, every step to a neighbor and no diagonal squeezing past a wall
+    const auto is_walkable = [](const common::TileGrid<std::uint8_t> &grid, const std::vector<common::Point> &path) {
+      for (std::size_t i = 0; i < path.size(); i++) {
+        const auto [x, y] = path[i];
+        if (grid(y, x) == 0)
+          return false;
+        if (i == 0)
+          continue;
+
+        const int dx = x - path[i - 1].x;
+        const int dy = y - path[i - 1].y;
+        if (std::abs(dx) > 1 || std::abs(dy) > 1 || (dx == 0 && dy == 0))
+          return false;
+        if (dx != 0 && dy != 0 && (grid(y - dy, x) == 0 || grid(y, x - dx) == 0))
+          return false;
+      }
+      return true;
+    };
+
+    AStar astar{};
+    int mismatches = 0;
+
+    for (const auto &[width, height]: sizes) {
+      std::chrono::duration<double, std::milli> astar_time{}, jps_time{};
+      std::size_t astar_expanded = 0, jps_expanded = 0;
+
+      for (int m = 0; m < maps_per_size; m++) {
+        auto cells = level_generation::init_cellular_automata_bit_grid(width, height, seed + m);
+        level_generation::perform_cellular_automaton(cells, 10);
+        const auto regions = level_generation::label_regions(cells);
+        const auto grid = level_generation::bit_grid_to_tile_grid(cells);
+
+        // Both ends in the largest region so there's always a path
+        std::vector<common::Point> floor{};
+        for (int y = 0; y < height; y++) {
+          for (int x = 0; x < width; x++) {
+            if (regions.get_region(x, y) == regions.largest)
+              floor.push_back({x, y});
+          }
+        }
+        if (floor.empty())
+          continue;
+
+        common::Xoshiro256 rng(seed + m);
+        for (int q = 0; q < queries_per_map; q++) {
+          const auto start = floor[rng.next_int(0, static_cast<int>(floor.size()) - 1)];
+          const auto goal = floor[rng.next_int(0, static_cast<int>(floor.size()) - 1)];
+
+          auto began = std::chrono::steady_clock::now();
+          const auto by_astar = astar.find_path(*grid, start, goal, {PathAlgorithm::A_STAR, true});
+          astar_time += std::chrono::steady_clock::now() - began;
+          astar_expanded += astar.get_nodes_expanded();
+
+          began = std::chrono::steady_clock::now();
+          const auto by_jps = astar.find_path(*grid, start, goal, {PathAlgorithm::JUMP_POINT, true});
+          jps_time += std::chrono::steady_clock::now() - began;
+          jps_expanded += astar.get_nodes_expanded();
+
+          if (by_astar.empty() != by_jps.empty() || cost_of(by_astar) != cost_of(by_jps) ||
+              !is_walkable(*grid, by_jps)) {
+            fmt::println("mismatch on {}x{} map {}: ({}, {}) to ({}, {}), A* cost {} JPS cost {}", width, height, m,
+                         start.x, start.y, goal.x, goal.y, cost_of(by_astar), cost_of(by_jps));
+            mismatches++;
           }
         }
       }
+
+      constexpr int queries = maps_per_size * queries_per_map;
+      fmt::println("{}x{}, per query: A* {:.2f}ms ({} expanded), JPS {:.2f}ms ({} expanded)", width, height,
+                   astar_time.count() / queries, astar_expanded / queries, jps_time.count() / queries,
+                   jps_expanded / queries);
     }
 
-    return result;
+    if (mismatches == 0)
+      fmt::println("every JPS path matched A*");
+    return mismatches == 0 ? 0 : 1;
   }
 
-  sol::table EntityManager::get_lua_entities_in_viewport(const std::function<bool(int x, int y)> &predicate,
-                                                         const sol::this_state s) const {
-    // loop through all entity groups and find the entities that are in the viewport
-    // return a table of entities that are in the viewport
-    sol::state_view lua(s);
-    sol::table result = lua.create_table();
+  void PathHierarchy::build(const common::TileGrid<std::uint8_t> &grid, common::WorkerPool *pool) {
+    width = grid.get_width();
+    height = grid.get_height();
+    clusters_across = (width + cluster_size - 1) / cluster_size;
+    clusters_down = (height + cluster_size - 1) / cluster_size;
+
+    const auto cluster_count = static_cast<std::size_t>(clusters_across) * clusters_down;
+    clusters.assign(cluster_count, {});
+    vertical_borders.assign(cluster_count, {});
+    horizontal_borders.assign(cluster_count, {});
+    dirty.assign(cluster_count, 0);
+    has_dirty = false;
+
+    for (int cy = 0; cy < clusters_down; cy++) {
+      for (int cx = 0; cx < clusters_across; cx++) {
+        build_border(grid, cx, cy, true);
+        build_border(grid, cx, cy, false);
+      }
+    }
 
-    for (const auto &eg: *entity_groups) {
-      for (const auto &e: *eg->entities) {
-        if (auto lua_component = e->find_first_component_by_type<roguely::components::LuaComponent>();
-          lua_component != nullptr) {
-          if (auto lua_components_table = lua_component->get_properties(); lua_components_table.valid()) {
-            if (auto position_component = lua_components_table["position_component"]; position_component.valid()) {
-              const auto x = position_component["x"];
-
-              if (const auto y = position_component["y"]; predicate(x, y)) {
-                result.set(fmt::format("{}-{}", e->get_name(), e->get_id()),
-                           lua.create_table_with(
-                             "group_name", eg->name,
-                             "name", e->get_name(),
-                             "full_name", fmt::format("{}-{}", e->get_name(), e->get_id())));
-              }
-            }
-          }
-        }
+    // Each cluster only writes its own entry once the borders are in place
+    if (pool != nullptr) {
+      pool->parallel_for(static_cast<int>(cluster_count), [&](const int i) {
+        thread_local Flood scratch{};
+        build_cluster(grid, i % clusters_across, i / clusters_across, scratch);
+      });
+    } else {
+      for (int cy = 0; cy < clusters_down; cy++) {
+        for (int cx = 0; cx < clusters_across; cx++)
+          build_cluster(grid, cx, cy, flood);
       }
     }
 
-    return result;
+    update_node_ids();
   }
-}
-
-namespace roguely::sprites {
-  SpriteSheet::SpriteSheet(SDL_Renderer *renderer, const std::string &n, const std::string &p, int sw, int sh, int sf) {
-    path = p;
-    name = n;
-    sprite_width = sw;
-    sprite_height = sh;
 
-    if (sf <= 0)
-      sf = 1;
+  void PathHierarchy::mark_dirty(const int x, const int y) {
+    if (!is_built() || x < 0 || y < 0 || x >= width || y >= height)
+      return;
 
-    scale_factor = sf;
+    dirty[cluster_index_of({x, y})] = 1;
+    has_dirty = true;
+  }
 
-    // fmt::println("loading spritesheet: {}", path);
-    // fmt::println("sprite width: {} | sprite height: {}", sprite_width, sprite_height);
-    // fmt::println("scale factor: {}", scale_factor);
+  void PathHierarchy::build_border(const common::TileGrid<std::uint8_t> &grid, const int cx, const int cy,
+                                   const bool vertical) {
+    const auto index = cy * clusters_across + cx;
+    auto &border = vertical ? vertical_borders[index] : horizontal_borders[index];
+    border.clear();
 
-    const auto tileset = IMG_Load(p.c_str());
-    spritesheet_texture = SDL_CreateTextureFromSurface(renderer, tileset);
-    const int total_sprites_on_sheet = tileset->w / sw * tileset->h / sh;
-    sprites = std::make_unique<std::vector<std::shared_ptr<SDL_Rect> > >(0);
-    // fmt::println("total sprites on sheet: {}", total_sprites_on_sheet);
+    if ((vertical && cx + 1 >= clusters_across) || (!vertical && cy + 1 >= clusters_down))
+      return;
 
-    SDL_GetTextureColorMod(spritesheet_texture, &o_red, &o_green, &o_blue);
+    // Walk along the edge, k is the position along it
+    const int edge = vertical ? (cx + 1) * cluster_size - 1 : (cy + 1) * cluster_size - 1;
+    const int first = vertical ? cy * cluster_size : cx * cluster_size;
+    const int last = std::min(vertical ? height : width, first + cluster_size);
+    const auto point_at = [&](const int k) {
+      return vertical ? common::Point{edge, k} : common::Point{k, edge};
+    };
+    const auto is_open = [&](const int k) {
+      return vertical
+               ? grid(k, edge) != 0 && grid(k, edge + 1) != 0
+               : grid(edge, k) != 0 && grid(edge + 1, k) != 0;
+    };
+
+    int run_start = -1;
+    for (int k = first; k <= last; k++) {
+      if (k < last && is_open(k)) {
+        if (run_start < 0)
+          run_start = k;
+        continue;
+      }
 
-    for (int y = 0; y < total_sprites_on_sheet / (sw + sh); y++) {
-      for (int x = 0; x < total_sprites_on_sheet / (sw + sh); x++) {
-        SDL_Rect rect = {x * sw, y * sh, sw, sh};
-        sprites->emplace_back(std::make_shared<SDL_Rect>(rect));
+      if (run_start >= 0) {
+        if (const int run_end = k - 1; run_end - run_start + 1 >= WIDE_ENTRANCE) {
+          border.push_back(point_at(run_start));
+          border.push_back(point_at(run_end));
+        } else {
+          border.push_back(point_at((run_start + run_end) / 2));
+        }
+        run_start = -1;
       }
     }
-
-    sprites->resize(total_sprites_on_sheet);
-
-    SDL_FreeSurface(tileset);
   }
 
-  void SpriteSheet::draw_sprite(SDL_Renderer *renderer, const int sprite_id, const int x, const int y) const {
-    draw_sprite(renderer, sprite_id, x, y, scale_factor);
+  void PathHierarchy::build_cluster(const common::TileGrid<std::uint8_t> &grid, const int cx, const int cy,
+                                    Flood &scratch) {
+    auto &cluster = clusters[cy * clusters_across + cx];
+    cluster.bounds = common::Rect{
+      {cx * cluster_size, cy * cluster_size},
+      {std::min(cluster_size, width - cx * cluster_size), std::min(cluster_size, height - cy * cluster_size)}
+    };
+    cluster.nodes.clear();
+
+    const auto add_side = [&](const Side side, const std::vector<common::Point> *border, const int dx, const int dy) {
+      cluster.side_offsets[side] = static_cast<int>(cluster.nodes.size());
+      if (border == nullptr)
+        return;
+      for (const auto &[x, y]: *border)
+        cluster.nodes.push_back({x + dx, y + dy});
+    };
+
+    // The same order get_twin expects
+    add_side(LEFT, cx > 0 ? &vertical_borders[cy * clusters_across + cx - 1] : nullptr, 1, 0);
+    add_side(RIGHT, cx + 1 < clusters_across ? &vertical_borders[cy * clusters_across + cx] : nullptr, 0, 0);
+    add_side(TOP, cy > 0 ? &horizontal_borders[(cy - 1) * clusters_across + cx] : nullptr, 0, 1);
+    add_side(BOTTOM, cy + 1 < clusters_down ? &horizontal_borders[cy * clusters_across + cx] : nullptr, 0, 0);
+    cluster.side_offsets[4] = static_cast<int>(cluster.nodes.size());
+
+    const auto n = cluster.nodes.size();
+    cluster.distances.assign(n * n, UNREACHABLE);
+    for (std::size_t i = 0; i < n; i++) {
+      flood_cluster(grid, cluster.bounds, cluster.nodes[i], scratch);
+      for (std::size_t j = 0; j < n; j++)
+        cluster.distances[i * n + j] = flood_distance(cluster.bounds, cluster.nodes[j], scratch);
+    }
   }
 
-  void SpriteSheet::draw_sprite(SDL_Renderer *renderer, int sprite_id, const int x, const int y,
-                                const int scale_factor) const {
-    if (sprite_id < 0 || sprite_id > sprites->capacity()) {
-      fmt::println("sprite id out of range: {}", sprite_id);
-      return;
+  void PathHierarchy::rebuild_dirty(const common::TileGrid<std::uint8_t> &grid) {
+    std::vector<int> changed{};
+    for (int i = 0; i < static_cast<int>(dirty.size()); i++) {
+      if (dirty[i])
+        changed.push_back(i);
     }
 
-    int width = sprite_width;
-    int height = sprite_height;
+    // A cluster's borders decide the nodes of its neighbors too, so they get
+    // rebuilt along with it
+    for (const auto i: changed) {
+      const int cx = i % clusters_across;
+      const int cy = i / clusters_across;
+
+      build_border(grid, cx, cy, true);
+      build_border(grid, cx, cy, false);
+      if (cx > 0)
+        build_border(grid, cx - 1, cy, true);
+      if (cy > 0)
+        build_border(grid, cx, cy - 1, false);
+
+      for (const auto &[dx, dy]: std::array<std::pair<int, int>, 4>{{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}}) {
+        if (cx + dx >= 0 && cy + dy >= 0 && cx + dx < clusters_across && cy + dy < clusters_down)
+          dirty[(cy + dy) * clusters_across + cx + dx] = 1;
+      }
+    }
 
-    if (scale_factor > 0) {
-      width = sprite_width * scale_factor;
-      height = sprite_height * scale_factor;
+    for (int i = 0; i < static_cast<int>(dirty.size()); i++) {
+      if (dirty[i]) {
+        build_cluster(grid, i % clusters_across, i / clusters_across, flood);
+        dirty[i] = 0;
+      }
     }
 
-    const SDL_Rect dest = {x, y, width, height};
-    const auto &sprite_rect = sprites->at(sprite_id);
-    SDL_RenderCopy(renderer, spritesheet_texture, &(*sprite_rect), &dest);
+    has_dirty = false;
+    update_node_ids();
   }
 
-  void SpriteSheet::draw_sprite_sheet(SDL_Renderer *renderer, const int x, const int y) const {
-    int col = 0;
-    int row_height = 0;
-
-    // fmt::println("scale_factor: {}", scale_factor);
+  void PathHierarchy::update_node_ids() {
+    node_bases.resize(clusters.size());
+    node_clusters.clear();
 
-    for (int i = 0; i < sprites->size(); i++) {
-      // fmt::println("col * sprite_width = {}", col * sprite_width);
-      // fmt::println("col * (sprite_width * scale_factor) = {}", col * (sprite_width * scale_factor));
+    int next = 0;
+    for (int i = 0; i < static_cast<int>(clusters.size()); i++) {
+      node_bases[i] = next;
+      next += static_cast<int>(clusters[i].nodes.size());
+      node_clusters.insert(node_clusters.end(), clusters[i].nodes.size(), i);
+    }
 
-      draw_sprite(renderer, i, x + (col * (sprite_width * scale_factor)), y + row_height);
-      col++;
+    node_count = next;
+  }
 
-      if ((i + 1) % 16 == 0) {
-        row_height += sprite_height * scale_factor;
-        col = 0;
+  void PathHierarchy::flood_cluster(const common::TileGrid<std::uint8_t> &grid, const common::Rect &bounds,
+                                    const common::Point from, Flood &scratch) {
+    const int w = bounds.size.width;
+    const int h = bounds.size.height;
+    auto &flood = scratch.distances;
+    auto &flood_queue = scratch.queue;
+    flood.assign(static_cast<std::size_t>(w) * h, UNREACHABLE);
+    flood_queue.clear();
+
+    const int start = (from.y - bounds.point.y) * w + (from.x - bounds.point.x);
+    flood[start] = 0;
+    flood_queue.push_back(start);
+
+    for (std::size_t head = 0; head < flood_queue.size(); head++) {
+      const int i = flood_queue[head];
+      const int x = i % w;
+      const int y = i / w;
+
+      for (const auto &[dx, dy]: std::array<std::pair<int, int>, 4>{{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}}) {
+        const int nx = x + dx;
+        const int ny = y + dy;
+        if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+          continue;
+
+        const int next = ny * w + nx;
+        if (flood[next] != UNREACHABLE || grid(bounds.point.y + ny, bounds.point.x + nx) == 0)
+          continue;
+
+        flood[next] = flood[i] + 1;
+        flood_queue.push_back(next);
       }
     }
   }
 
-  sol::table SpriteSheet::get_sprites_as_lua_table(const sol::this_state s) const {
-    sol::state_view lua(s);
-    sol::table sprites_table = lua.create_table();
+  int PathHierarchy::get_twin(const int cluster_index, const int local) const {
+    const auto &cluster = clusters[cluster_index];
+
+    int side = LEFT;
+    while (local >= cluster.side_offsets[side + 1])
+      side++;
+
+    const int transition = local - cluster.side_offsets[side];
+    int other = cluster_index;
+    int other_side = LEFT;
+    switch (side) {
+      case LEFT: other -= 1;
+        other_side = RIGHT;
+        break;
+      case RIGHT: other += 1;
+        other_side = LEFT;
+        break;
+      case TOP: other -= clusters_across;
+        other_side = BOTTOM;
+        break;
+      default: other += clusters_across;
+        other_side = TOP;
+        break;
+    }
 
-    for (std::size_t i = 0, sp = sprites->size(); i != sp; ++i) {
-      const auto &sprite_rect = sprites->at(i);
+    return node_bases[other] + clusters[other].side_offsets[other_side] + transition;
+  }
 
-      sol::table rect_table = lua.create_table();
+  std::vector<common::Point> PathHierarchy::find_path(const common::TileGrid<std::uint8_t> &grid,
+                                                      const common::Point start, const common::Point goal) {
+    nodes_expanded = 0;
 
-      rect_table.set("x", sprite_rect->x);
-      rect_table.set("y", sprite_rect->y);
-      rect_table.set("w", sprite_rect->w);
-      rect_table.set("h", sprite_rect->h);
+    if (!grid.contains(start.y, start.x) || !grid.contains(goal.y, goal.x) || grid(start.y, start.x) == 0 ||
+        grid(goal.y, goal.x) == 0)
+      return {};
 
-      sprites_table.set(i, rect_table);
+    if (!is_built() || width != grid.get_width() || height != grid.get_height())
+      build(grid);
+    else if (has_dirty)
+      rebuild_dirty(grid);
+
+    // Start and goal are joined to the graph through the nodes of their clusters
+    const int start_cluster = cluster_index_of(start);
+    const int goal_cluster = cluster_index_of(goal);
+    const auto &start_nodes = clusters[start_cluster].nodes;
+    const auto &goal_nodes = clusters[goal_cluster].nodes;
+
+    flood_cluster(grid, clusters[start_cluster].bounds, start, flood);
+    std::vector<int> start_distances(start_nodes.size());
+    for (std::size_t i = 0; i < start_nodes.size(); i++)
+      start_distances[i] = flood_distance(clusters[start_cluster].bounds, start_nodes[i], flood);
+    const int direct = start_cluster == goal_cluster
+                         ? flood_distance(clusters[goal_cluster].bounds, goal, flood)
+                         : UNREACHABLE;
+
+    flood_cluster(grid, clusters[goal_cluster].bounds, goal, flood);
+    std::vector<int> goal_distances(goal_nodes.size());
+    for (std::size_t i = 0; i < goal_nodes.size(); i++)
+      goal_distances[i] = flood_distance(clusters[goal_cluster].bounds, goal_nodes[i], flood);
+
+    const int start_node = node_count;
+    const int goal_node = node_count + 1;
+    const auto cell_count = static_cast<std::size_t>(node_count) + 2;
+    if (stamps.size() != cell_count) {
+      stamps.assign(cell_count, 0);
+      costs.resize(cell_count);
+      parents.resize(cell_count);
+      generation = 0;
     }
+    if (++generation == 0) {
+      std::ranges::fill(stamps, 0);
+      generation = 1;
+    }
+    open.clear();
+
+    const auto point_of = [&](const int node) {
+      if (node == start_node)
+        return start;
+      if (node == goal_node)
+        return goal;
+      return clusters[node_clusters[node]].nodes[node - node_bases[node_clusters[node]]];
+    };
+    const auto cluster_of = [&](const int node) {
+      if (node == start_node)
+        return start_cluster;
+      if (node == goal_node)
+        return goal_cluster;
+      return node_clusters[node];
+    };
+    const auto compare = [](const OpenNode &a, const OpenNode &b) { return a.f > b.f; };
+    const auto relax = [&](const int node, const int parent, const int cost) {
+      if (stamps[node] == generation && costs[node] <= cost)
+        return;
+
+      stamps[node] = generation;
+      costs[node] = cost;
+      parents[node] = parent;
+
+      const auto [x, y] = point_of(node);
+      open.push_back({cost + std::abs(x - goal.x) + std::abs(y - goal.y), cost, node});
+      std::ranges::push_heap(open, compare);
+    };
+
+    stamps[start_node] = generation;
+    costs[start_node] = 0;
+    parents[start_node] = -1;
+    open.push_back({0, 0, start_node});
+
+    bool found = false;
+    while (!open.empty()) {
+      std::ranges::pop_heap(open, compare);
+      const auto [f, g, node] = open.back();
+      open.pop_back();
+
+      if (g > costs[node])
+        continue;
+
+      if (node == goal_node) {
+        found = true;
+        break;
+      }
 
-    return sprites_table;
-  }
-}
+      nodes_expanded++;
 
-namespace roguely::map {
-  void Map::draw_map(SDL_Renderer *renderer, const roguely::common::Dimension &dimensions,
-                     const std::shared_ptr<roguely::sprites::SpriteSheet> &sprite_sheet,
-                     const std::function<void(int, int, int, int, int, int, int)> &draw_hook) {
-    const int scale_factor = sprite_sheet->get_scale_factor();
-    const int sprite_width = sprite_sheet->get_sprite_width();
-    const int sprite_height = sprite_sheet->get_sprite_height();
+      if (node == start_node) {
+        for (std::size_t i = 0; i < start_nodes.size(); i++) {
+          if (start_distances[i] != UNREACHABLE)
+            relax(node_bases[start_cluster] + static_cast<int>(i), node, start_distances[i]);
+        }
+        if (direct != UNREACHABLE)
+          relax(goal_node, node, direct);
+        continue;
+      }
 
-    const int texture_width = dimensions.size.width * (sprite_width * scale_factor);
-    const int texture_height = dimensions.size.height * (sprite_height * scale_factor);
+      const int cluster_index = node_clusters[node];
+      const auto &cluster = clusters[cluster_index];
+      const int local = node - node_bases[cluster_index];
+      const auto n = cluster.nodes.size();
 
-    if (!current_map_segment_dimension.eq(dimensions)) {
-      current_map_segment_dimension = dimensions;
+      for (std::size_t j = 0; j < n; j++) {
+        if (const int d = cluster.distances[local * n + j]; d != UNREACHABLE && static_cast<int>(j) != local)
+          relax(node_bases[cluster_index] + static_cast<int>(j), node, g + d);
+      }
 
-      if (current_map_segment_texture != nullptr)
-        SDL_DestroyTexture(current_map_segment_texture);
+      relax(get_twin(cluster_index, local), node, g + 1);
 
-      current_map_segment_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
-                                                      texture_width, texture_height);
-      SDL_SetRenderTarget(renderer, current_map_segment_texture);
-      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-      SDL_RenderClear(renderer);
+      if (cluster_index == goal_cluster && goal_distances[local] != UNREACHABLE)
+        relax(goal_node, node, g + goal_distances[local]);
+    }
 
-      for (int rows = dimensions.point.y; rows < dimensions.size.height; rows++) {
-        for (int cols = dimensions.point.x; cols < dimensions.size.width; cols++) {
-          const int dx = (cols * sprite_width * scale_factor) -
-                         (dimensions.point.x * sprite_width * scale_factor);
-          const int dy = (rows * sprite_height * scale_factor) -
-                         (dimensions.point.y * sprite_height * scale_factor);
-
-          const int cell_id = (*map)(rows, cols);
-
-          if (draw_hook != nullptr) {
-            // rows, cols = map Y, X
-            // dx, dy = world X, Y
-            const auto light_cell = (*light_map)(rows, cols);
-            // fmt::println("light cell: {}", light_cell);
-            draw_hook(rows, cols, dx, dy, cell_id, light_cell, scale_factor);
-          }
-        }
+    if (!found)
+      return {};
+
+    std::vector<int> abstract_path{};
+    for (int node = goal_node; node != -1; node = parents[node])
+      abstract_path.push_back(node);
+    std::ranges::reverse(abstract_path);
+
+    // Fill in each hop, hops inside a cluster get a search of just that cluster
+    // and hops between clusters are a single step
+    std::vector<common::Point> path{start};
+    for (std::size_t i = 1; i < abstract_path.size(); i++) {
+      const auto from = point_of(abstract_path[i - 1]);
+      const auto to = point_of(abstract_path[i]);
+
+      if (const int cluster_index = cluster_of(abstract_path[i - 1]); cluster_index == cluster_of(abstract_path[i])) {
+        const auto segment = refiner.find_path(clusters[cluster_index].bounds, from, to,
+                                               [&grid](const int x, const int y) { return grid(y, x) != 0; });
+        if (segment.empty())
+          return {};
+        path.insert(path.end(), segment.begin() + 1, segment.end());
+      } else {
+        path.push_back(to);
       }
     }
 
-    SDL_SetRenderTarget(renderer, nullptr);
-    const SDL_Rect destination = {0, 0, texture_width, texture_height};
-    SDL_RenderCopy(renderer, current_map_segment_texture, nullptr, &destination);
+    return path;
   }
 
-  void Map::draw_map(SDL_Renderer *renderer, const common::Dimension &dimensions, const int x, const int y,
-                     const int a, const std::function<void(int, int, int)> &draw_hook) {
-    if (!current_full_map_dimension.eq(dimensions)) {
-      current_full_map_dimension = dimensions;
+  void PathCache::check_version(const std::uint64_t map_version) {
+    if (map_version == version)
+      return;
 
-      if (current_full_map_texture != nullptr)
-        SDL_DestroyTexture(current_full_map_texture);
+    if (!entries.empty())
+      stats.invalidations++;
 
-      current_full_map_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width,
-                                                   height);
-      SDL_SetTextureBlendMode(current_full_map_texture, SDL_BLENDMODE_BLEND);
-      SDL_SetRenderTarget(renderer, current_full_map_texture);
-      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-      SDL_SetTextureAlphaMod(current_full_map_texture, a);
-      SDL_RenderClear(renderer);
+    clear();
+    version = map_version;
+  }
 
-      for (int rows = 0; rows < height; rows++) {
-        for (int cols = 0; cols < width; cols++) {
-          const int cell_id = (*map)(rows, cols);
+  void PathCache::clear() {
+    entries.clear();
+    paths.clear();
+    goal_paths.clear();
+    cell_count = 0;
+  }
 
-          if (draw_hook != nullptr) {
-            draw_hook(rows, cols, cell_id);
-          }
-        }
-      }
+  void PathCache::erase(const Entries::iterator entry) {
+    paths.erase(entry->key);
+    if (const auto goal = goal_paths.find(goal_key(entry->key)); goal != goal_paths.end() && goal->second == entry)
+      goal_paths.erase(goal);
+    cell_count -= cells_of(*entry);
+    entries.erase(entry);
+  }
+
+  std::optional<std::vector<common::Point> > PathCache::find(const std::uint64_t map_version,
+                                                             const common::Point start, const common::Point goal,
+                                                             const int mode) {
+    check_version(map_version);
+
+    const Key key{start.x, start.y, goal.x, goal.y, mode};
+    if (const auto it = paths.find(key); it != paths.end()) {
+      stats.hits++;
+      entries.splice(entries.begin(), entries, it->second);
+      return it->second->path;
     }
 
-    SDL_SetRenderTarget(renderer, nullptr);
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-    const SDL_Rect destination = {x, y, width, height};
-    SDL_RenderCopy(renderer, current_full_map_texture, nullptr, &destination);
-  }
+    // Looking along the path costs about as much as copying what's left of it
+    if (const auto it = goal_paths.find(goal_key(key)); it != goal_paths.end()) {
+      const auto &path = it->second->path;
+      if (const auto on_path = std::ranges::find_if(path, [&](const common::Point &p) { return p.eq(start); });
+        on_path != path.end()) {
+        stats.partial_hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return std::vector<common::Point>(on_path, path.end());
+      }
+    }
 
-  void Map::calculate_field_of_view(const roguely::common::Dimension &dimensions) {
-    light_map = std::make_shared<boost::numeric::ublas::matrix<int> >(height, width, 0);
+    stats.misses++;
+    return std::nullopt;
+  }
 
-    // Iterate through all angles in the 360-degree field of view
-    for (int angle = 0; angle < 360; angle += 1) {
-      const float radians = angle * 0.01745329f; // Conversion factor from degrees to radians
-      const float dx = std::cos(radians);
-      const float dy = std::sin(radians);
+  void PathCache::store(const std::uint64_t map_version, const common::Point start, const common::Point goal,
+                        const int mode, const std::vector<common::Point> &path) {
+    check_version(map_version);
 
-      float newX = dimensions.supplimental_point.x + dx;
-      float newY = dimensions.supplimental_point.y + dy;
+    const Key key{start.x, start.y, goal.x, goal.y, mode};
+    if (const auto it = paths.find(key); it != paths.end())
+      erase(it->second);
 
-      // Keep expanding in the current direction until reaching a wall or map boundary
-      while (newX >= 0 && newX < width && newY >= 0 && newY < height) {
-        // Mark the cell as visible
-        (*light_map)(static_cast<int>(newY), static_cast<int>(newX)) = 1;
+    Entry entry{key, path};
+    const auto cells = cells_of(entry);
+    if (cells > MAX_CELLS)
+      return;
 
-        // Stop expanding if a wall is encountered
-        if ((*map)(static_cast<int>(newY), static_cast<int>(newX)) == 0)
-          break;
+    while (cell_count + cells > MAX_CELLS)
+      erase(std::prev(entries.end()));
 
-        // Move to the next cell in the current direction
-        newX += dx;
-        newY += dy;
-      }
-    }
+    entries.push_front(std::move(entry));
+    cell_count += cells;
+    paths.emplace(key, entries.begin());
+    if (!path.empty())
+      goal_paths.insert_or_assign(goal_key(key), entries.begin());
   }
 
-  roguely::common::Point Map::get_random_point(const std::set<int> &off_limit_sprites_ids) const {
-    if (width == 0 || height == 0) {
-      throw std::runtime_error("Empty map");
+  void DistanceField::prepare(const common::Rect &b) {
+    const auto cell_count = static_cast<std::size_t>(b.size.width) * b.size.height;
+    bounds = b;
+
+    if (stamps.size() != cell_count) {
+      stamps.assign(cell_count, 0);
+      distances.resize(cell_count);
+      generation = 0;
     }
 
-    if (off_limit_sprites_ids.empty()) {
-      return roguely::common::Point{generate_random_int(0, height - 1), generate_random_int(0, width - 1)};
+    if (++generation == 0) {
+      std::ranges::fill(stamps, 0);
+      generation = 1;
     }
 
-    const size_t maxAttempts = height * width;
-    size_t attempts = 0;
+    reached.clear();
+  }
 
-    while (attempts < maxAttempts) {
-      const int row = generate_random_int(0, height - 1);
+  void DistanceField::compute(const common::Rect &b, const std::vector<common::Point> &sources,
+                              const int max_distance, const std::function<bool(int x, int y)> &is_walkable) {
+    prepare(b);
 
-      if (const int col = generate_random_int(0, width - 1); !off_limit_sprites_ids.contains((*map)(row, col))) {
-        // fmt::println("Found random point: ({},{}) = {}", row, col, (*map)(row, col));
-        return roguely::common::Point{col, row};
-      }
+    for (const auto &[x, y]: sources) {
+      if (!contains(x, y) || !is_walkable(x, y))
+        continue;
 
-      attempts++;
+      const auto i = index_of(x, y);
+      if (stamps[i] == generation)
+        continue;
+
+      stamps[i] = generation;
+      distances[i] = 0;
+      reached.push_back(static_cast<std::uint32_t>(i));
     }
 
-    throw std::runtime_error("Unable to find a random point in map");
+    // reached doubles as the BFS queue
+    for (std::size_t head = 0; head < reached.size(); head++) {
+      const auto i = reached[head];
+      const int distance = distances[i] + 1;
+      if (max_distance > 0 && distance > max_distance)
+        continue;
+
+      const int x = bounds.point.x + static_cast<int>(i % bounds.size.width);
+      const int y = bounds.point.y + static_cast<int>(i / bounds.size.width);
+
+      for (const auto &[dx, dy]: DIRECTIONS) {
+        const int nx = x + dx;
+        const int ny = y + dy;
+        if (!contains(nx, ny))
+          continue;
+
+        const auto next = index_of(nx, ny);
+        if (stamps[next] == generation)
+          continue;
+
+        // Walls get stamped too so they're only looked up once
+        stamps[next] = generation;
+        if (!is_walkable(nx, ny)) {
+          distances[next] = UNREACHABLE;
+          continue;
+        }
+
+        distances[next] = distance;
+        reached.push_back(static_cast<std::uint32_t>(next));
+      }
+    }
   }
 
-  std::vector<std::pair<int, int> > AStar::FindPath(const boost::numeric::ublas::matrix<int> &grid, int start_row,
-                                                    int start_col, const int goal_row, const int goal_col) const {
-    // Check if the starting position is a zero
-    if (grid(start_col, start_row) != 0)
-      return {};
+  void DistanceField::compute_flee(const DistanceField &field) {
+    prepare(field.bounds);
 
-    // Store grid size
-    const int grid_rows = static_cast<int>(grid.size1());
-    const int grid_cols = static_cast<int>(grid.size2());
-
-    // Create a priority queue to store the open list
-    std::priority_queue<pq_entry, std::vector<pq_entry>, std::greater<> > open_list;
-    // Create a matrix to store the cost of reaching each cell
-    boost::numeric::ublas::matrix<int> cost(grid_rows, grid_cols, INT_MAX);
-    // Create a matrix to store the parent of each cell
-    boost::numeric::ublas::matrix<std::pair<int, int> > parent(grid_rows, grid_cols);
-    // Initialize the cost of the start cell to 0
-    cost(start_row, start_col) = 0;
-    // Add the start cell to the open list with a priority of 0
-    open_list.emplace(0, std::make_pair(start_row, start_col));
-
-    while (!open_list.empty()) {
-      // Get the cell with the lowest cost from the open list
-      auto [_, top_pair] = open_list.top();
-      auto [x, y] = top_pair;
-      open_list.pop();
-
-      // Check if we have reached the goal cell
-      if (x == goal_col && y == goal_row) {
-        // Reconstruct the path from the goal to the start
-        std::vector<std::pair<int, int> > path;
-        while (x != start_row || y != start_col) {
-          path.emplace_back(x, y);
-          std::tie(x, y) = parent(x, y);
+    int lowest = 0;
+    for (const auto i: field.reached) {
+      stamps[i] = generation;
+      distances[i] = -(field.distances[i] * 6) / 5;
+      lowest = std::min(lowest, distances[i]);
+      reached.push_back(i);
+    }
+
+    // Unit steps, so a bucket per distance (Dial's algorithm) is all the
+    // priority queue that's needed
+    for (auto &bucket: buckets)
+      bucket.clear();
+    buckets.resize(static_cast<std::size_t>(-lowest) + 1);
+    for (const auto i: reached)
+      buckets[distances[i] - lowest].push_back(i);
+
+    for (std::size_t b = 0; b < buckets.size(); b++) {
+      // Relaxing a cell can add to the bucket being walked so index rather than iterate
+      for (std::size_t k = 0; k < buckets[b].size(); k++) {
+        const auto i = buckets[b][k];
+        const int distance = distances[i];
+        if (distance - lowest != static_cast<int>(b))
+          continue;
+
+        const int x = bounds.point.x + static_cast<int>(i % bounds.size.width);
+        const int y = bounds.point.y + static_cast<int>(i / bounds.size.width);
+
+        for (const auto &[dx, dy]: DIRECTIONS) {
+          const int nx = x + dx;
+          const int ny = y + dy;
+          if (!contains(nx, ny))
+            continue;
+
+          const auto next = index_of(nx, ny);
+          if (stamps[next] != generation || distances[next] == UNREACHABLE || distances[next] <= distance + 1)
+            continue;
+
+          distances[next] = distance + 1;
+          buckets[distances[next] - lowest].push_back(static_cast<std::uint32_t>(next));
         }
-        path.emplace_back(start_row, start_col);
-        std::ranges::reverse(path);
-        return path;
       }
+    }
+  }
 
-      // Explore the neighbors of the current cell
-      for (int i = 0; i < 4; i++) {
-        int nx = x + dx[i];
+  int DistanceField::get_distance(const int x, const int y) const {
+    if (!contains(x, y))
+      return UNREACHABLE;
 
-        // Check if the neighbor is within the grid bounds
-        if (int ny = y + dy[i]; nx >= 0 && nx < grid_rows && ny >= 0 && ny < grid_cols && grid(nx, ny) == 0) {
-          // Calculate the cost of reaching the neighbor
+    const auto i = index_of(x, y);
+    return stamps[i] == generation ? distances[i] : UNREACHABLE;
+  }
 
-          // Check if the new cost is lower than the current cost
-          if (const int new_cost = cost(x, y) + 1; new_cost < cost(nx, ny)) {
-            // Update the cost and parent of the neighbor
-            cost(nx, ny) = new_cost;
-            parent(nx, ny) = std::make_pair(x, y);
+  std::optional<common::Point> DistanceField::next_step(const int x, const int y,
+                                                        const std::function<bool(int x, int y)> &can_enter) const {
+    int best = get_distance(x, y);
+    if (best == UNREACHABLE)
+      return std::nullopt;
 
-            // Calculate the priority of the neighbor (cost + heuristic)
-            // Add the neighbor to the open list
-            open_list.emplace(new_cost + heuristic(nx, ny, goal_col, goal_row), std::make_pair(nx, ny));
-          }
-        }
+    std::optional<common::Point> step{};
+    for (const auto &[dx, dy]: DIRECTIONS) {
+      const int nx = x + dx;
+      const int ny = y + dy;
+
+      if (const int distance = get_distance(nx, ny); distance < best && (!can_enter || can_enter(nx, ny))) {
+        best = distance;
+        step = common::Point{nx, ny};
       }
     }
 
-    return {};
+    return step;
   }
 }
 
 namespace roguely::engine {
   Engine::Engine() {
-    std::srand(static_cast<unsigned int>(std::time(nullptr)));
-
     Mix_OpenAudio(44100, AUDIO_S16SYS, 2, 4096);
     Mix_Volume(-1, 3);
     Mix_VolumeMusic(5);
 
+    worker_pool = std::make_unique<roguely::common::WorkerPool>();
+    random_service = std::make_unique<roguely::common::RandomService>(
+      (static_cast<std::uint64_t>(std::random_device{}()) << 32) | std::random_device{}());
     entity_manager = std::make_unique<roguely::ecs::EntityManager>(lua.lua_state());
     maps = std::make_unique<std::vector<std::shared_ptr<roguely::map::Map> > >();
     systems = std::make_unique<std::unordered_map<std::string, sol::function> >();
@@ -917,6 +3553,25 @@ namespace roguely::engine {
       return -1;
     }
 
+    // Optional, defaults to one worker per core
+    if (game_config["worker_threads"].valid() && game_config["worker_threads"].get_type() == sol::type::number) {
+      const int worker_threads = game_config["worker_threads"];
+      wait_for_pending_maps();
+      worker_pool = std::make_unique<roguely::common::WorkerPool>(std::max(worker_threads, 1));
+    }
+
+    // Optional, a fixed seed makes runs reproducible
+    if (game_config["random_seed"].valid() && game_config["random_seed"].get_type() == sol::type::number) {
+      const std::int64_t random_seed = game_config["random_seed"];
+      random_service->set_seed(static_cast<std::uint64_t>(random_seed));
+    }
+
+    // Optional, 0 lights everything in view
+    if (game_config["fov_radius"].valid() && game_config["fov_radius"].get_type() == sol::type::number) {
+      const int radius = game_config["fov_radius"];
+      fov_radius = std::max(radius, 0);
+    }
+
     if (init_sdl(game_config, lua.lua_state()) < 0)
       return -1;
 
@@ -942,6 +3597,8 @@ namespace roguely::engine {
     while (!quit) {
       frame_start = SDL_GetTicks();
 
+      collect_pending_maps();
+
       // handle events
       while (SDL_PollEvent(&e)) {
         if (e.type == SDL_QUIT) {
@@ -949,18 +3606,10 @@ namespace roguely::engine {
         } else if (e.type == SDL_KEYDOWN) {
           if (systems->contains("keyboard_input_system")) {
             // FIXME: Fix hard coded entity group and entity name for PLAYER
-            auto keyboard_input_system_result = (*systems)["keyboard_input_system"](e.key.keysym.sym,
+            run_system((*systems)["keyboard_input_system"], e.key.keysym.sym,
               entity_manager->get_lua_entity("common", "player"),
               entity_manager->get_lua_entities(),
-              entity_manager->get_lua_entities_in_viewport(
-                [&](const int x, const int y) {
-                  return is_within_viewport(x, y);
-                },
-                lua.lua_state()));
-            if (!keyboard_input_system_result.valid()) {
-              sol::error err = keyboard_input_system_result;
-              fmt::println("Lua script error: {}", err.what());
-            }
+              entity_manager->get_lua_entities_in_viewport(get_viewport_rect(), lua.lua_state()));
           }
         }
       }
@@ -968,35 +3617,21 @@ namespace roguely::engine {
       for (auto &[fst, snd]: *systems) {
         if (fst != "tick_system" && fst != "keyboard_input_system" &&
             fst != "render_system") {
-          auto system_result = snd(entity_manager->get_lua_entity("common", "player"),
-                                   entity_manager->get_lua_entities(),
-                                   entity_manager->get_lua_entities_in_viewport(
-                                     [&](const int x, const int y) {
-                                       return is_within_viewport(x, y);
-                                     },
-                                     lua.lua_state()));
-          if (!system_result.valid()) {
-            sol::error err = system_result;
-            fmt::println("Lua script error: {}", err.what());
+          if (!run_system(snd,
+                          entity_manager->get_lua_entity("common", "player"),
+                          entity_manager->get_lua_entities(),
+                          entity_manager->get_lua_entities_in_viewport(get_viewport_rect(), lua.lua_state())))
             return -1;
-          }
         }
       }
 
       Uint32 current_time = SDL_GetTicks();
       if (constexpr Uint32 update_interval = 1000; current_time - last_update_time >= update_interval) {
         if (systems->contains("tick_system")) {
-          auto tick_system_result = (*systems)["tick_system"](entity_manager->get_lua_entity("common", "player"),
-                                                              entity_manager->get_lua_entities(),
-                                                              entity_manager->get_lua_entities_in_viewport(
-                                                                [&](const int x, const int y) {
-                                                                  return is_within_viewport(x, y);
-                                                                },
-                                                                lua.lua_state()));
-          if (!tick_system_result.valid()) {
-            sol::error err = tick_system_result;
-            fmt::println("Lua script error: {}", err.what());
-          }
+          run_system((*systems)["tick_system"],
+                     entity_manager->get_lua_entity("common", "player"),
+                     entity_manager->get_lua_entities(),
+                     entity_manager->get_lua_entities_in_viewport(get_viewport_rect(), lua.lua_state()));
         }
         last_update_time = current_time;
       }
@@ -1009,18 +3644,10 @@ namespace roguely::engine {
 
       // Call render
       if (systems->contains("render_system")) {
-        auto render_system_result = (*systems)["render_system"](delta_time,
-                                                                entity_manager->get_lua_entity("common", "player"),
-                                                                entity_manager->get_lua_entities(),
-                                                                entity_manager->get_lua_entities_in_viewport(
-                                                                  [&](const int x, const int y) {
-                                                                    return is_within_viewport(x, y);
-                                                                  },
-                                                                  lua.lua_state()));
-        if (!render_system_result.valid()) {
-          sol::error err = render_system_result;
-          fmt::println("Lua script error: {}", err.what());
-        }
+        run_system((*systems)["render_system"], delta_time,
+                   entity_manager->get_lua_entity("common", "player"),
+                   entity_manager->get_lua_entities(),
+                   entity_manager->get_lua_entities_in_viewport(get_viewport_rect(), lua.lua_state()));
       }
 
       SDL_RenderPresent(renderer);
@@ -1037,150 +3664,671 @@ namespace roguely::engine {
     return 0;
   }
 
-  bool Engine::check_game_config(sol::table game_config, sol::this_state s) {
-    constexpr bool result = true;
+  bool Engine::check_game_config(sol::table game_config, sol::this_state s) {
+    constexpr bool result = true;
+
+    const auto title = game_config["window_title"];
+    const auto window_width = game_config["window_width"];
+    const auto window_height = game_config["window_height"];
+    const auto window_icon_path = game_config["window_icon_path"];
+    const auto font_path = game_config["font_path"];
+    const auto spritesheet_name = game_config["spritesheet_name"];
+    const auto spritesheet_path = game_config["spritesheet_path"];
+    const auto spritesheet_sprite_width = game_config["spritesheet_sprite_width"];
+    const auto spritesheet_sprite_height = game_config["spritesheet_sprite_height"];
+    const auto spritesheet_sprite_scale_factor = game_config["spritesheet_sprite_scale_factor"];
+    const auto sounds = game_config["sounds"];
+
+    if (!(title.valid() && title.get_type() == sol::type::string))
+      return false;
+    if (!(window_width.valid() && window_width.get_type() == sol::type::number))
+      return false;
+    if (!(window_height.valid() && window_height.get_type() == sol::type::number))
+      return false;
+    if (!(font_path.valid() && font_path.get_type() == sol::type::string))
+      return false;
+    if (!(spritesheet_path.valid() && spritesheet_path.get_type() == sol::type::string))
+      return false;
+    if (!(sounds.valid() && sounds.get_type() == sol::type::table))
+      return false;
+    if (!(window_icon_path.valid() && window_icon_path.get_type() == sol::type::string))
+      return false;
+    if (!(spritesheet_name.valid() && spritesheet_name.get_type() == sol::type::string))
+      return false;
+    if (!(spritesheet_sprite_width.valid() && spritesheet_sprite_width.get_type() == sol::type::number))
+      return false;
+    if (!(spritesheet_sprite_height.valid() && spritesheet_sprite_height.get_type() == sol::type::number))
+      return false;
+    if (!(spritesheet_sprite_scale_factor.valid() && spritesheet_sprite_scale_factor.get_type() == sol::type::number))
+      return false;
+
+    return result;
+  }
+
+  void Engine::draw_text(const std::string &t, const int x, const int y) const {
+    draw_text(t, x, y, 255, 255, 255, 255);
+  }
+
+  void Engine::draw_text(const std::string &t, const int x, const int y, const int r, const int g, const int b,
+                         const int a) const {
+    if (!(!t.empty()))
+      return;
+
+    if (!default_font.expired()) {
+      const SDL_Color text_color = {
+        static_cast<Uint8>(r), static_cast<Uint8>(g), static_cast<Uint8>(b), static_cast<Uint8>(a)
+      };
+      default_font.lock()->draw_text(renderer, x, y, t, text_color);
+    }
+  }
+
+  void Engine::draw_sprite(const std::string &spritesheet_name, const int sprite_id, const int x, const int y, const int scale_factor) const {
+    if (sprite_sheets->contains(spritesheet_name)) {
+      (*sprite_sheets)[spritesheet_name]->draw_sprite(renderer, sprite_id, x, y, scale_factor);
+    }
+  }
+
+  void Engine::set_draw_color(SDL_Renderer *renderer, const int r, const int g, const int b, const int a) {
+    SDL_SetRenderDrawColor(renderer, r, g, b, a);
+  }
+
+  void Engine::draw_point(SDL_Renderer *renderer, const int x, const int y) {
+    SDL_RenderDrawPoint(renderer, x, y);
+  }
+
+  void Engine::draw_rect(SDL_Renderer *renderer, const int x, const int y, const int w, const int h) {
+    const SDL_Rect r = {x, y, w, h};
+    SDL_RenderDrawRect(renderer, &r);
+  }
+
+  void Engine::draw_filled_rect(SDL_Renderer *renderer, const int x, const int y, const int w, const int h) {
+    const SDL_Rect r = {x, y, w, h};
+    SDL_RenderFillRect(renderer, &r);
+  }
+
+  void Engine::draw_filled_rect_with_color(SDL_Renderer *renderer, const int x, const int y, const int w, const int h, const int r, const int g, const int b,
+                                           const int a) {
+    const SDL_Rect rect = {x, y, w, h};
+    SDL_SetRenderDrawColor(renderer, r, g, b, a);
+    SDL_RenderFillRect(renderer, &rect);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  }
+
+  void Engine::draw_graphic(SDL_Renderer *renderer, const std::string &path, const int window_width, const int x, const int y,
+                            const bool centered, const int scale_factor) {
+    if (!std::filesystem::exists(path)) {
+      fmt::println("graphic file does not exist: {}", path);
+      return;
+    }
+
+    const auto graphic = IMG_Load(path.c_str());
+    const auto graphic_texture = SDL_CreateTextureFromSurface(renderer, graphic);
+
+    const SDL_Rect src = {0, 0, graphic->w, graphic->h};
+    SDL_Rect dest = {x, y, graphic->w, graphic->h};
+
+    if (scale_factor > 0) {
+      if (centered)
+        dest = {((window_width / (2 + static_cast<int>(scale_factor))) - (graphic->w / 2)), y, graphic->w, graphic->h};
+
+      SDL_RenderSetScale(renderer, static_cast<float>(scale_factor), static_cast<float>(scale_factor));
+      SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
+      SDL_RenderSetScale(renderer, 1, 1);
+    } else {
+      if (centered)
+        dest = {((window_width / 2) - (graphic->w / 2)), y, graphic->w, graphic->h};
+
+      SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
+    }
+
+    SDL_FreeSurface(graphic);
+    SDL_DestroyTexture(graphic_texture);
+  }
+
+  void Engine::play_sound(const std::string &name) {
+    if (!(!name.empty()))
+      return;
+
+    const auto sound = std::ranges::find_if(*sounds,
+                                            [&](const auto &s) {
+                                              return s->name == name;
+                                            });
+
+    if (sound != sounds->end()) {
+      (*sound)->play();
+    }
+  }
+
+  std::shared_ptr<roguely::map::Map> Engine::generate_map(const std::string &name, int map_width, int map_height,
+                                                         const std::uint64_t seed,
+                                                         const level_generation::RegionOptions &region_options) const {
+    // fmt::println("generating map: {}", name);
+
+    auto cells = roguely::level_generation::init_cellular_automata_bit_grid(map_width, map_height, seed,
+                                                                            worker_pool.get());
+    roguely::level_generation::perform_cellular_automaton(cells, 10, worker_pool.get());
+    auto regions = roguely::level_generation::process_regions(cells, region_options);
+    auto map = roguely::level_generation::bit_grid_to_tile_grid(cells);
+
+    auto result = std::make_shared<roguely::map::Map>(name, map_width, map_height, map);
+    result->set_regions(std::move(regions));
+    // Otherwise the first long path would stall a frame building it
+    result->build_path_hierarchy(worker_pool.get());
+    return result;
+  }
+
+  level_generation::RegionOptions Engine::get_region_options(const sol::optional<sol::table> &options) {
+    level_generation::RegionOptions region_options{};
+
+    if (options.has_value() && options->valid()) {
+      if (const auto min_region_size = (*options)["min_region_size"];
+        min_region_size.valid() && min_region_size.get_type() == sol::type::number) {
+        region_options.min_region_size = min_region_size;
+      }
+      if (const auto connect_regions = (*options)["connect_regions"];
+        connect_regions.valid() && connect_regions.get_type() == sol::type::boolean) {
+        region_options.connect_regions = connect_regions;
+      }
+    }
+
+    return region_options;
+  }
+
+  int Engine::generate_map_async(const std::string &name, const int map_width, const int map_height,
+                                 const std::uint64_t seed, const level_generation::RegionOptions &region_options) {
+    const int handle = next_map_handle++;
+
+    // Nothing shared is touched on the worker, the seed is decided up front
+    pending_maps.emplace(handle, PendingMap{
+                           name,
+                           worker_pool->submit([this, name, map_width, map_height, seed, region_options] {
+                             return generate_map(name, map_width, map_height, seed, region_options);
+                           })
+                         });
+
+    return handle;
+  }
+
+  bool Engine::collect_pending_map(const int handle, const bool wait) {
+    const auto pending = pending_maps.find(handle);
+    if (pending == pending_maps.end())
+      return handle > 0 && handle < next_map_handle && !failed_maps.contains(handle);
+
+    if (!wait && pending->second.map.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return false;
+
+    auto ready = true;
+    try {
+      register_map(pending->second.map.get());
+    } catch (const std::exception &e) {
+      fmt::println("unable to generate map {}: {}", pending->second.name, e.what());
+      failed_maps.insert(handle);
+      ready = false;
+    }
+
+    pending_maps.erase(pending);
+    return ready;
+  }
+
+  void Engine::collect_pending_maps() {
+    // Collecting erases, so the handles are taken up front
+    std::vector<int> handles{};
+    handles.reserve(pending_maps.size());
+    for (const auto &handle: pending_maps | std::views::keys)
+      handles.push_back(handle);
+
+    for (const auto handle: handles)
+      collect_pending_map(handle, false);
+  }
+
+  void Engine::wait_for_pending_maps() {
+    for (auto &pending: pending_maps | std::views::values) {
+      if (pending.map.valid())
+        pending.map.wait();
+    }
+  }
+
+  void Engine::register_map(const std::shared_ptr<roguely::map::Map> &map) const {
+    // A map with the same name is replaced rather than shadowed
+    if (const auto existing = std::ranges::find_if(*maps, [&](const std::shared_ptr<roguely::map::Map> &m) {
+      return m->get_name() == map->get_name();
+    }); existing != maps->end()) {
+      *existing = map;
+    } else {
+      maps->push_back(map);
+    }
+  }
+
+  void Engine::for_each_positioned_entity(const std::string &group_name,
+                                          const std::function<void(const sol::table &, const sol::table &, int, int)> &
+                                          callback) const {
+    const sol::table entities = entity_manager->get_lua_entities()[group_name];
+    if (!entities.valid())
+      return;
+
+    entities.for_each([&](const sol::object &, const sol::object &value) {
+      if (!value.is<sol::table>())
+        return;
+
+      const auto entity = value.as<sol::table>();
+      const sol::table components = entity["components"];
+      if (!components.valid())
+        return;
+
+      const sol::table position_component = components["position_component"];
+      if (!position_component.valid())
+        return;
+
+      const int x = position_component["x"];
+      const int y = position_component["y"];
+      callback(entity, components, x, y);
+    });
+  }
+
+  std::optional<common::Point> Engine::get_entity_position(const sol::table &components) {
+    return ecs::EntityManager::get_lua_position(components);
+  }
+
+  map::PathOptions Engine::get_path_options(const sol::optional<sol::table> &options, bool &hierarchical) {
+    map::PathOptions path_options{};
+    hierarchical = true;
+
+    if (options.has_value() && options->valid()) {
+      if (const auto algorithm = (*options)["algorithm"];
+        algorithm.valid() && algorithm.get_type() == sol::type::string) {
+        if (const std::string name = algorithm; name == "astar") {
+          hierarchical = false;
+        } else if (name == "jps") {
+          path_options.algorithm = map::PathAlgorithm::JUMP_POINT;
+          hierarchical = false;
+        } else if (name != "hierarchical") {
+          throw sol::error(fmt::format("unknown path algorithm {}", name));
+        }
+      }
+      if (const auto diagonal = (*options)["diagonal"]; diagonal.valid() && diagonal.get_type() == sol::type::boolean) {
+        path_options.diagonal = diagonal;
+        if (path_options.diagonal)
+          hierarchical = false;
+      }
+    }
+
+    return path_options;
+  }
+
+  std::vector<common::Point> Engine::find_path(const common::Point start, const common::Point goal,
+                                               const map::PathOptions &options, const bool hierarchical) {
+    const auto &map = current_map_info.map;
+    if (map == nullptr)
+      return {};
+
+    // Anything further than a couple of clusters goes through the hierarchy
+    const bool use_hierarchy = hierarchical && !map->is_chunked() &&
+                               std::abs(start.x - goal.x) + std::abs(start.y - goal.y) >
+                               map::PathHierarchy::DEFAULT_CLUSTER_SIZE * 2;
+    const int mode = static_cast<int>(options.algorithm) | (options.diagonal ? 2 : 0) | (use_hierarchy ? 4 : 0);
+
+    auto &cache = map->get_path_cache();
+    if (auto cached = cache.find(map->get_version(), start, goal, mode); cached.has_value())
+      return std::move(*cached);
+
+    auto path = use_hierarchy ? map->find_long_path(start, goal) : map->find_path(path_finder, start, goal, options);
+    cache.store(map->get_version(), start, goal, mode, path);
+    return path;
+  }
+
+  map::SpawnOptions Engine::get_spawn_options(const sol::optional<sol::table> &options) {
+    map::SpawnOptions spawn_options{};
+
+    if (options.has_value() && options->valid()) {
+      if (const auto min_distance = (*options)["min_distance"];
+        min_distance.valid() && min_distance.get_type() == sol::type::number) {
+        spawn_options.min_distance = min_distance;
+      }
+      if (const auto region = (*options)["region"]; region.valid() && region.get_type() == sol::type::number) {
+        spawn_options.region = region;
+      }
+      if (const auto min_player_distance = (*options)["min_player_distance"];
+        min_player_distance.valid() && min_player_distance.get_type() == sol::type::number) {
+        spawn_options.avoid_distance = min_player_distance;
+
+        if (const auto player = entity_manager->get_lua_entity("common", "player"); player.valid())
+          spawn_options.avoid = get_entity_position(player["components"]);
+      }
+    }
+
+    return spawn_options;
+  }
+
+  int Engine::spawn_batch(const std::string &group_name, const std::string &name, const sol::table &components,
+                          const int count, const map::SpawnOptions &options, const sol::this_state s) {
+    if (current_map_info.map == nullptr)
+      return 0;
+
+    const auto &map = current_map_info.map;
+    auto &rng = random_service->get_stream(common::RandomStream::MAPGEN);
+    std::vector<common::Point> points{};
+
+    // min_distance holds against everything already on the map too, not just the batch
+    std::vector<ecs::SpatialIndex::Entry> nearby{};
+    const auto near_placed = [&](const int x, const int y) {
+      // Same test get_spawn_points uses inside the batch, closer than min_distance is too close
+      const auto min_distance = std::max(options.min_distance, 1);
+      const auto too_close = [&](const int px, const int py) {
+        return (px - x) * (px - x) + (py - y) * (py - y) < min_distance * min_distance;
+      };
+      nearby.clear();
+      entity_manager->get_spatial_index().query_radius(x, y, min_distance, nearby);
+      return std::ranges::any_of(nearby, [&](const ecs::SpatialIndex::Entry &e) { return too_close(e.x, e.y); }) ||
+             std::ranges::any_of(pending_points, [&](const common::Point &p) { return too_close(p.x, p.y); });
+    };
+
+    if (!map->is_chunked()) {
+      sync_free_cells();
+      points = map->get_spawn_points(count, options, rng, [&](const int x, const int y) {
+        return map->is_occupied(x, y) || near_placed(x, y);
+      });
+    } else {
+      // Chunked maps don't track occupancy so gather it once up front
+      std::unordered_set<std::uint64_t> taken{};
+      const auto key = [](const int x, const int y) {
+        return static_cast<std::uint64_t>(static_cast<std::uint32_t>(x)) << 32 | static_cast<std::uint32_t>(y);
+      };
+      for (const auto &entity_group_name: entity_manager->get_entity_group_names()) {
+        for_each_positioned_entity(entity_group_name, [&](const sol::table &, const sol::table &, const int x,
+                                                          const int y) {
+          taken.insert(key(x, y));
+        });
+      }
+      points = map->get_spawn_points(count, options, rng, [&](const int x, const int y) {
+        return taken.contains(key(x, y)) || near_placed(x, y);
+      });
+    }
+
+    std::vector<std::shared_ptr<ecs::Entity> > entities{};
+    entities.reserve(points.size());
 
-    const auto title = game_config["window_title"];
-    const auto window_width = game_config["window_width"];
-    const auto window_height = game_config["window_height"];
-    const auto window_icon_path = game_config["window_icon_path"];
-    const auto font_path = game_config["font_path"];
-    const auto spritesheet_name = game_config["spritesheet_name"];
-    const auto spritesheet_path = game_config["spritesheet_path"];
-    const auto spritesheet_sprite_width = game_config["spritesheet_sprite_width"];
-    const auto spritesheet_sprite_height = game_config["spritesheet_sprite_height"];
-    const auto spritesheet_sprite_scale_factor = game_config["spritesheet_sprite_scale_factor"];
-    const auto sounds = game_config["sounds"];
+    for (const auto &[x, y]: points) {
+      const auto entity = entity_manager->create_entity(name);
+      auto components_copy = ecs::EntityManager::copy_table(components, s);
+      components_copy["position_component"] = sol::state_view(s).create_table_with("x", x, "y", y);
+      entity->add<components::LuaComponent>("lua component", components_copy, s);
+      entities.emplace_back(entity);
 
-    if (!(title.valid() && title.get_type() == sol::type::string))
-      return false;
-    if (!(window_width.valid() && window_width.get_type() == sol::type::number))
-      return false;
-    if (!(window_height.valid() && window_height.get_type() == sol::type::number))
-      return false;
-    if (!(font_path.valid() && font_path.get_type() == sol::type::string))
-      return false;
-    if (!(spritesheet_path.valid() && spritesheet_path.get_type() == sol::type::string))
-      return false;
-    if (!(sounds.valid() && sounds.get_type() == sol::type::table))
-      return false;
-    if (!(window_icon_path.valid() && window_icon_path.get_type() == sol::type::string))
-      return false;
-    if (!(spritesheet_name.valid() && spritesheet_name.get_type() == sol::type::string))
-      return false;
-    if (!(spritesheet_sprite_width.valid() && spritesheet_sprite_width.get_type() == sol::type::number))
-      return false;
-    if (!(spritesheet_sprite_height.valid() && spritesheet_sprite_height.get_type() == sol::type::number))
-      return false;
-    if (!(spritesheet_sprite_scale_factor.valid() && spritesheet_sprite_scale_factor.get_type() == sol::type::number))
-      return false;
+      if (!map->is_chunked())
+        map->occupy(x, y);
+      claim_pending_point(x, y);
+    }
 
-    return result;
+    defer([this, group_name, entities = std::move(entities), s] {
+      entity_manager->add_entities_to_group(group_name, entities, s);
+      for (const auto &entity: entities)
+        track_position(group_name, entity->get_id());
+    });
+    return static_cast<int>(points.size());
   }
 
-  void Engine::draw_text(const std::string &t, const int x, const int y) const {
-    draw_text(t, x, y, 255, 255, 255, 255);
+  bool Engine::flush_commands() {
+    pending_points.clear();
+    try {
+      commands.flush();
+      return true;
+    } catch (const std::exception &e) {
+      commands.clear();
+      fmt::println("Lua script error: {}", e.what());
+      return false;
+    }
   }
 
-  void Engine::draw_text(const std::string &t, const int x, const int y, const int r, const int g, const int b,
-                         const int a) const {
-    if (!(!t.empty()))
+  void Engine::sync_free_cells() {
+    if (current_map_info.map == nullptr || free_cells_map.lock() == current_map_info.map)
       return;
 
-    if (!default_font.expired()) {
-      const SDL_Color text_color = {
-        static_cast<Uint8>(r), static_cast<Uint8>(g), static_cast<Uint8>(b), static_cast<Uint8>(a)
-      };
-      default_font.lock()->draw_text(renderer, x, y, t, text_color);
+    current_map_info.map->clear_occupancy();
+
+    for (const auto &group_name: entity_manager->get_entity_group_names()) {
+      for_each_positioned_entity(group_name, [&](const sol::table &, const sol::table &, const int x, const int y) {
+        current_map_info.map->occupy(x, y);
+      });
     }
+
+    free_cells_map = current_map_info.map;
   }
 
-  void Engine::draw_sprite(const std::string &spritesheet_name, const int sprite_id, const int x, const int y, const int scale_factor) const {
-    if (sprite_sheets->contains(spritesheet_name)) {
-      (*sprite_sheets)[spritesheet_name]->draw_sprite(renderer, sprite_id, x, y, scale_factor);
+  void Engine::move_entity(const sol::table &entity, const int x, const int y) {
+    const sol::table components = entity["components"];
+    const auto position = get_entity_position(components);
+    if (!position.has_value())
+      return;
+
+    if (current_map_info.map != nullptr) {
+      if (free_cells_map.lock() == current_map_info.map) {
+        current_map_info.map->vacate(position->x, position->y);
+        current_map_info.map->occupy(x, y);
+      }
+      current_map_info.map->redraw_cell(position->x, position->y);
+      current_map_info.map->redraw_cell(x, y);
     }
-  }
 
-  void Engine::set_draw_color(SDL_Renderer *renderer, const int r, const int g, const int b, const int a) {
-    SDL_SetRenderDrawColor(renderer, r, g, b, a);
-  }
+    // Changed in place so anything holding on to the component sees it
+    auto fields = ecs::EntityManager::get_proxied_fields(components["position_component"]);
+    fields["x"] = x;
+    fields["y"] = y;
 
-  void Engine::draw_point(SDL_Renderer *renderer, const int x, const int y) {
-    SDL_RenderDrawPoint(renderer, x, y);
+    if (const sol::optional<ecs::EntityHandle> id = entity["id"]; id.has_value())
+      entity_manager->set_entity_position(*id, x, y);
   }
 
-  void Engine::draw_rect(SDL_Renderer *renderer, const int x, const int y, const int w, const int h) {
-    const SDL_Rect r = {x, y, w, h};
-    SDL_RenderDrawRect(renderer, &r);
+  // pairs() on a watched table walks its fields as well, over a shallow copy
+  static std::tuple<sol::function, sol::table, sol::lua_nil_t> proxied_pairs(const sol::table &self,
+                                                                              const sol::this_state s) {
+    sol::state_view lua(s);
+    sol::table all = lua.create_table();
+    const auto add = [&](const sol::object &key, const sol::object &value) { all[key] = value; };
+    ecs::EntityManager::get_proxied_fields(self).for_each(add);
+    self.for_each(add);
+    const sol::function next = lua["next"];
+    return {next, all, sol::nil};
   }
 
-  void Engine::draw_filled_rect(SDL_Renderer *renderer, const int x, const int y, const int w, const int h) {
-    const SDL_Rect r = {x, y, w, h};
-    SDL_RenderFillRect(renderer, &r);
+  void Engine::track_position(const std::string &group_name, const ecs::EntityHandle id) {
+    const sol::table entity = entity_manager->get_lua_entity(group_name, id);
+    if (!entity.valid())
+      return;
+
+    sol::table components = entity["components"];
+    if (!components.valid())
+      return;
+
+    // position_component is kept out of the table itself so replacing it lands in __newindex too
+    sol::state_view lua(components.lua_state());
+    sol::table fields = lua.create_table();
+    if (const auto position = components.raw_get<sol::optional<sol::table> >("position_component");
+      position.has_value()) {
+      fields["position_component"] = make_position_proxy(group_name, id, *position);
+      components.raw_set("position_component", sol::nil);
+    }
+
+    sol::table meta = lua.create_table();
+    meta["__index"] = fields;
+    meta["__newindex"] = [this, group_name, id](sol::table self, const sol::object &key, const sol::object &value) {
+      if (key.is<std::string>() && key.as<std::string>() == "position_component")
+        set_position_component(group_name, id, self, value);
+      else
+        self.raw_set(key, value);
+    };
+    meta["__pairs"] = proxied_pairs;
+    components[sol::metatable_key] = meta;
   }
 
-  void Engine::draw_filled_rect_with_color(SDL_Renderer *renderer, const int x, const int y, const int w, const int h, const int r, const int g, const int b,
-                                           const int a) {
-    const SDL_Rect rect = {x, y, w, h};
-    SDL_SetRenderDrawColor(renderer, r, g, b, a);
-    SDL_RenderFillRect(renderer, &rect);
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  sol::table Engine::make_position_proxy(const std::string &group_name, const ecs::EntityHandle id,
+                                         const sol::table &fields) {
+    sol::state_view lua(fields.lua_state());
+    sol::table proxy = lua.create_table();
+    sol::table meta = lua.create_table();
+    meta["__index"] = fields;
+    meta["__newindex"] = [this, group_name, id](const sol::table &self, const sol::object &key,
+                                                const sol::object &value) {
+      auto proxied = ecs::EntityManager::get_proxied_fields(self);
+      const auto name = key.is<std::string>() ? key.as<std::string>() : std::string{};
+      const sol::table entity = entity_manager->get_lua_entity(group_name, id);
+      sol::object current{};
+      if (entity.valid())
+        current = entity["components"]["position_component"];
+
+      // Only moves the entity while this is still its position_component
+      if ((name != "x" && name != "y") || !entity.valid() || !(current == self)) {
+        proxied.raw_set(key, value);
+        return;
+      }
+
+      if (value.get_type() != sol::type::number)
+        throw sol::error(fmt::format("position_component.{} has to be a number", name));
+
+      const int v = value.as<int>();
+      const int x = proxied["x"];
+      const int y = proxied["y"];
+      move_entity(entity, name == "x" ? v : x, name == "y" ? v : y);
+    };
+    meta["__pairs"] = proxied_pairs;
+    proxy[sol::metatable_key] = meta;
+    return proxy;
   }
 
-  void Engine::draw_graphic(SDL_Renderer *renderer, const std::string &path, const int window_width, const int x, const int y,
-                            const bool centered, const int scale_factor) {
-    if (!std::filesystem::exists(path)) {
-      fmt::println("graphic file does not exist: {}", path);
+  void Engine::set_position_component(const std::string &group_name, const ecs::EntityHandle id,
+                                      const sol::table &components, const sol::object &value) {
+    auto fields = ecs::EntityManager::get_proxied_fields(components);
+    const sol::table entity = entity_manager->get_lua_entity(group_name, id);
+    if (!entity.valid()) {
+      fields["position_component"] = value;
       return;
     }
 
-    const auto graphic = IMG_Load(path.c_str());
-    const auto graphic_texture = SDL_CreateTextureFromSurface(renderer, graphic);
+    const auto map = current_map_info.map;
+    const bool track_free_cells = map != nullptr && free_cells_map.lock() == map;
+    const auto position = get_entity_position(components);
+
+    if (value.get_type() == sol::type::lua_nil) {
+      if (position.has_value()) {
+        if (track_free_cells)
+          map->vacate(position->x, position->y);
+        if (map != nullptr)
+          map->redraw_cell(position->x, position->y);
+        entity_manager->erase_entity_position(id);
+      }
+      fields["position_component"] = sol::nil;
+      return;
+    }
 
-    const SDL_Rect src = {0, 0, graphic->w, graphic->h};
-    SDL_Rect dest = {x, y, graphic->w, graphic->h};
+    if (value.get_type() != sol::type::table)
+      throw sol::error("position_component has to be a table with a number x and y");
 
-    if (scale_factor > 0) {
-      if (centered)
-        dest = {((window_width / (2 + static_cast<int>(scale_factor))) - (graphic->w / 2)), y, graphic->w, graphic->h};
+    const sol::table replacement = value;
+    if (replacement["x"].get_type() != sol::type::number || replacement["y"].get_type() != sol::type::number)
+      throw sol::error("position_component has to be a table with a number x and y");
 
-      SDL_RenderSetScale(renderer, static_cast<float>(scale_factor), static_cast<float>(scale_factor));
-      SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
-      SDL_RenderSetScale(renderer, 1, 1);
-    } else {
-      if (centered)
-        dest = {((window_width / 2) - (graphic->w / 2)), y, graphic->w, graphic->h};
+    const int x = replacement["x"];
+    const int y = replacement["y"];
 
-      SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
+    // The new table's fields are taken over, starting from where the entity is now so move_entity sees the move
+    auto copy = ecs::EntityManager::copy_table(replacement, components.lua_state());
+    if (position.has_value()) {
+      copy["x"] = position->x;
+      copy["y"] = position->y;
+      fields["position_component"] = make_position_proxy(group_name, id, copy);
+      move_entity(entity, x, y);
+      return;
     }
 
-    SDL_FreeSurface(graphic);
-    SDL_DestroyTexture(graphic_texture);
+    fields["position_component"] = make_position_proxy(group_name, id, copy);
+    if (track_free_cells)
+      map->occupy(x, y);
+    if (map != nullptr)
+      map->redraw_cell(x, y);
+    if (const auto group = entity_manager->get_entity_group(group_name); group != nullptr)
+      entity_manager->insert_entity_position(id, group->id, x, y);
   }
 
-  void Engine::play_sound(const std::string &name) {
-    if (!(!name.empty()))
+  void Engine::draw_map_entities(const std::vector<std::string> &group_names) {
+    if (current_map_info.map == nullptr)
       return;
 
-    const auto sound = std::ranges::find_if(*sounds,
-                                            [&](const auto &s) {
-                                              return s->name == name;
-                                            });
-
-    if (sound != sounds->end()) {
-      (*sound)->play();
+    const sol::table game = lua["Game"];
+    std::vector<ecs::SpatialIndex::Entry> in_view{};
+
+    for (const auto &group_name: group_names) {
+      const auto group = entity_manager->get_entity_group(group_name);
+      if (group == nullptr)
+        continue;
+
+      in_view.clear();
+      entity_manager->get_spatial_index().query_rect(get_viewport_rect(), in_view, group->id);
+      // Bucket order depends on hashing and removals, entities sharing a cell are drawn oldest first
+      std::ranges::sort(in_view, [](const ecs::SpatialIndex::Entry &a, const ecs::SpatialIndex::Entry &b) {
+        return std::tie(a.y, a.x, a.id) < std::tie(b.y, b.x, b.id);
+      });
+
+      for (const auto &[id, group_id, x, y]: in_view) {
+        // Same as drawing the map, nothing shows up outside of the field of view
+        if (!current_map_info.map->is_visible(x, y))
+          continue;
+
+        const sol::table entity = group->lua_entities[id];
+        if (!entity.valid())
+          continue;
+
+        const sol::table components = entity["components"];
+        const sol::table sprite_component = components["sprite_component"];
+        if (!sprite_component.valid())
+          continue;
+
+        const std::string spritesheet_name = sprite_component["spritesheet_name"];
+        const auto sprite_sheet = sprite_sheets->find(spritesheet_name);
+        if (sprite_sheet == sprite_sheets->end())
+          continue;
+
+        const auto [dx, dy] = map::Map::map_to_world(x, y, current_dimension, sprite_sheet->second);
+
+        if (const auto render = sprite_component["render"]; render.valid() && render.get_type() == sol::type::function) {
+          const sol::function render_function = render;
+          if (const auto result = render_function(sprite_component, game, entity, dx, dy,
+                                                  sprite_sheet->second->get_scale_factor()); !result.valid()) {
+            const sol::error err = result;
+            fmt::println("Lua script error: {}", err.what());
+          }
+        } else {
+          const int sprite_id = sprite_component["sprite_id"];
+          sprite_sheet->second->draw_sprite(renderer, sprite_id, dx, dy);
+        }
+      }
     }
   }
 
-  std::shared_ptr<roguely::map::Map> Engine::generate_map(const std::string &name, int map_width, int map_height) {
-    // fmt::println("generating map: {}", name);
+  void Engine::draw_minimap_markers(const int x, const int y, const std::vector<MinimapMarker> &markers) {
+    if (current_map_info.map == nullptr)
+      return;
+
+    std::vector<SDL_Rect> rects{};
 
-    auto map = roguely::level_generation::init_cellular_automata(map_width, map_height);
-    roguely::level_generation::perform_cellular_automaton(map, map_width, map_height, 10);
+    for (const auto &marker: markers) {
+      rects.clear();
 
-    // auto map = std::make_shared<boost::numeric::ublas::matrix<int>>(map_height, map_width, 1);
+      for_each_positioned_entity(marker.group_name, [&](const sol::table &, const sol::table &, const int ex,
+                                                        const int ey) {
+        if (!marker.visible_only || current_map_info.map->is_visible(ex, ey))
+          rects.push_back({x + ex - marker.size / 2, y + ey - marker.size / 2, marker.size, marker.size});
+      });
 
-    return std::make_shared<roguely::map::Map>(name, map_width, map_height, map);
+      SDL_SetRenderDrawColor(renderer, marker.color.r, marker.color.g, marker.color.b, marker.color.a);
+      SDL_RenderFillRects(renderer, rects.data(), static_cast<int>(rects.size()));
+    }
+  }
+
+  std::shared_ptr<roguely::map::Map> Engine::generate_chunked_map(const std::string &name, const int map_width,
+                                                                 const int map_height, const std::uint64_t seed,
+                                                                 const int chunk_size, const int max_resident_chunks) {
+    auto chunks = std::make_shared<roguely::map::ChunkStore>(name, map_width, map_height, seed, chunk_size,
+                                                             max_resident_chunks);
+    return std::make_shared<roguely::map::Map>(name, map_width, map_height, chunks);
   }
 
   sol::function Engine::check_if_lua_function_defined(const sol::this_state s, const std::string &name) {
@@ -1231,22 +4379,117 @@ namespace roguely::engine {
                        draw_graphic(renderer, path, window_width, x, y, centered, scale_factor);
                      });
     _lua.set_function("play_sound", [&](const std::string &name) { play_sound(name); });
-    _lua.set_function("get_random_number", [&](const int min, const int max) { return generate_random_int(min, max); });
+    _lua.set_function("get_random_number", [&](const int min, const int max) {
+      return random_service->next_int(common::RandomStream::GENERAL, min, max);
+    });
+    _lua.set_function("get_random_number_from_stream", [&](const std::string &stream_name, const int min, const int max) {
+      if (const auto stream = common::random_stream_from_string(stream_name); stream.has_value()) {
+        return random_service->next_int(*stream, min, max);
+      }
+      fmt::println("unknown random stream: {}", stream_name);
+      return random_service->next_int(common::RandomStream::GENERAL, min, max);
+    });
+    _lua.set_function("set_random_seed", [&](const std::int64_t seed) {
+      random_service->set_seed(static_cast<std::uint64_t>(seed));
+    });
+    _lua.set_function("get_random_seed", [&]() { return static_cast<std::int64_t>(random_service->get_seed()); });
     _lua.set_function("generate_uuid", [&]() { return generate_uuid(); });
-    _lua.set_function("generate_map", [&](const std::string &name, const int map_width, const int map_height) {
-      const auto map = generate_map(name, map_width, map_height);
+    _lua.set_function("generate_map", [&](const std::string &name, const int map_width, const int map_height,
+                                          const sol::optional<sol::table> &options) {
+      const auto map = generate_map(name, map_width, map_height,
+                                    random_service->get_stream(common::RandomStream::MAPGEN)(),
+                                    get_region_options(options));
+      current_map_info.name = name;
+      current_map_info.map = map;
+      maps->push_back(map);
+    });
+    _lua.set_function("generate_map_async", [&](const std::string &name, const int map_width, const int map_height,
+                                                const sol::optional<std::int64_t> &seed,
+                                                const sol::optional<sol::table> &options) {
+      const auto map_seed = seed.has_value()
+                              ? static_cast<std::uint64_t>(*seed)
+                              : random_service->get_stream(common::RandomStream::MAPGEN)();
+      return generate_map_async(name, map_width, map_height, map_seed, get_region_options(options));
+    });
+    _lua.set_function("is_map_ready", [&](const int handle) { return collect_pending_map(handle, false); });
+    _lua.set_function("await_map", [&](const int handle) { return collect_pending_map(handle, true); });
+    _lua.set_function("generate_chunked_map", [&](const std::string &name, const int map_width, const int map_height,
+                                                  const sol::optional<int> &chunk_size,
+                                                  const sol::optional<int> &max_resident_chunks) {
+      const auto map = generate_chunked_map(name, map_width, map_height,
+                                            random_service->get_stream(common::RandomStream::MAPGEN)(),
+                                            chunk_size.value_or(64), max_resident_chunks.value_or(64));
       current_map_info.name = name;
       current_map_info.map = map;
       maps->push_back(map);
     });
+    _lua.set_function("set_fov_radius", [&](const int radius) { fov_radius = std::max(radius, 0); });
+    _lua.set_function("get_fov_radius", [&]() { return fov_radius; });
+    _lua.set_function("is_visible", [&](const int x, const int y) {
+      return current_map_info.map != nullptr && current_map_info.map->is_visible(x, y);
+    });
+    _lua.set_function("get_visible_points", [&](const sol::this_state s) {
+      sol::state_view lua(s);
+      sol::table points = lua.create_table();
+
+      if (current_map_info.map != nullptr) {
+        int i = 1;
+        for (const auto &[x, y]: current_map_info.map->get_visible_points())
+          points.set(i++, lua.create_table_with("x", x, "y", y));
+      }
+
+      return points;
+    });
+    _lua.set_function("is_explored", [&](const int x, const int y) {
+      return current_map_info.map != nullptr && current_map_info.map->is_explored(x, y);
+    });
+    _lua.set_function("get_explored_count", [&]() {
+      return current_map_info.map != nullptr ? current_map_info.map->get_explored_count() : 0;
+    });
+    _lua.set_function("take_explored_regions", [&](const sol::this_state s) {
+      sol::state_view lua(s);
+      sol::table regions = lua.create_table();
+
+      if (current_map_info.map != nullptr) {
+        int i = 1;
+        for (const auto &[point, size]: current_map_info.map->take_explored_regions()) {
+          regions.set(i++, lua.create_table_with("x", point.x, "y", point.y, "width", size.width, "height",
+                                                 size.height));
+        }
+      }
+
+      return regions;
+    });
+    _lua.set_function("get_region_id", [&](const int x, const int y) {
+      return current_map_info.map != nullptr ? current_map_info.map->get_region_id(x, y) : 0;
+    });
+    _lua.set_function("get_region_count", [&]() {
+      return current_map_info.map != nullptr ? current_map_info.map->get_region_count() : 0;
+    });
+    _lua.set_function("is_reachable", [&](const int x1, const int y1, const int x2, const int y2) {
+      return current_map_info.map != nullptr && current_map_info.map->is_reachable({x1, y1}, {x2, y2});
+    });
+    _lua.set_function("set_map_cell", [&](const int x, const int y, const int cell_id) {
+      if (current_map_info.map != nullptr) {
+        current_map_info.map->set_cell(x, y, cell_id);
+      }
+    });
     _lua.set_function("get_random_point_on_map", [&](const sol::this_state s) {
       sol::state_view lua(s);
       if (current_map_info.map != nullptr) {
         roguely::common::Point point{0, 0};
+        auto &rng = random_service->get_stream(common::RandomStream::MAPGEN);
+
+        if (!current_map_info.map->is_chunked()) {
+          sync_free_cells();
+          if (const auto free_point = current_map_info.map->get_random_free_point(rng); free_point.has_value())
+            return lua.create_table_with("x", free_point->x, "y", free_point->y);
+          return lua.create_table();
+        }
 
         do {
-          point = current_map_info.map->get_random_point({0});
-        } while (!entity_manager->lua_is_point_unique(point));
+          point = current_map_info.map->get_random_point({0}, rng);
+        } while (is_point_taken(point));
 
         return lua.create_table_with("x", point.x, "y", point.y);
       }
@@ -1258,8 +4501,125 @@ namespace roguely::engine {
         current_map_info.name = name;
       }
     });
+    _lua.set_function("set_map_sprites", [&](const std::string &name, const std::string &ss_name,
+                                             const sol::table &sprite_ids, const sol::optional<sol::table> &tints) {
+      const auto map = find_map(name);
+      const auto sprite_sheet = sprite_sheets->find(ss_name);
+      if (map == nullptr || sprite_sheet == sprite_sheets->end())
+        return;
+
+      map::TileSprites tile_sprites{sprite_sheet->second};
+      tile_sprites.sprite_ids.fill(-1);
+
+      sprite_ids.for_each([&](const sol::object &key, const sol::object &value) {
+        if (key.is<int>() && value.is<int>()) {
+          if (const int cell_id = key.as<int>(); cell_id >= 0 && cell_id < static_cast<int>(tile_sprites.sprite_ids.size()))
+            tile_sprites.sprite_ids[cell_id] = value.as<int>();
+        }
+      });
+
+      // By default only what's visible is drawn, untinted
+      if (!tints.has_value()) {
+        tile_sprites.tints[1] = SDL_Color{255, 255, 255, 255};
+      } else {
+        const std::array<std::string, 3> light_names = {"hidden", "visible", "explored"};
+        for (std::size_t i = 0; i < light_names.size(); i++) {
+          if (const sol::table tint = (*tints)[light_names[i]]; tint.valid()) {
+            const int r = tint[1];
+            const int g = tint[2];
+            const int b = tint[3];
+            tile_sprites.tints[i] = SDL_Color{static_cast<Uint8>(r), static_cast<Uint8>(g), static_cast<Uint8>(b), 255};
+          }
+        }
+      }
+
+      map->set_tile_sprites(std::move(tile_sprites));
+    });
+    _lua.set_function("draw_map_entities", [&](const sol::table &group_names) {
+      std::vector<std::string> groups{};
+      for (std::size_t i = 1; i <= group_names.size(); i++) {
+        if (group_names[i].valid()) {
+          const std::string group = group_names[i];
+          groups.emplace_back(group);
+        }
+      }
+      draw_map_entities(groups);
+    });
+    _lua.set_function("set_minimap_colors", [&](const std::string &name, const sol::table &colors,
+                                                const sol::optional<sol::table> &unexplored) {
+      const auto map = find_map(name);
+      if (map == nullptr)
+        return;
+
+      const auto pack = [](const sol::table &color) {
+        const int r = color[1];
+        const int g = color[2];
+        const int b = color[3];
+        const int a = color[4];
+        return static_cast<std::uint32_t>(r & 0xff) << 24 | static_cast<std::uint32_t>(g & 0xff) << 16 |
+               static_cast<std::uint32_t>(b & 0xff) << 8 | static_cast<std::uint32_t>(a & 0xff);
+      };
+
+      map::MinimapColors minimap_colors{};
+
+      colors.for_each([&](const sol::object &key, const sol::object &value) {
+        if (key.is<int>() && value.is<sol::table>()) {
+          if (const int cell_id = key.as<int>(); cell_id >= 0 && cell_id < static_cast<int>(minimap_colors.palette.size()))
+            minimap_colors.palette[cell_id] = pack(value.as<sol::table>());
+        }
+      });
+
+      if (unexplored.has_value())
+        minimap_colors.unexplored = pack(*unexplored);
+
+      map->set_minimap_colors(minimap_colors);
+    });
+    _lua.set_function("draw_minimap", [&](const std::string &name, const int x, const int y, const int a,
+                                          const sol::optional<sol::table> &markers) {
+      if (current_map_info.name != name) {
+        if (const auto map = find_map(name); map != nullptr) {
+          current_map_info.map = map;
+          current_map_info.name = name;
+        }
+      }
+
+      if (current_map_info.name != name)
+        return;
+
+      current_map_info.map->draw_minimap(renderer, x, y, a);
+
+      if (!markers.has_value())
+        return;
+
+      std::vector<MinimapMarker> minimap_markers{};
+      for (std::size_t i = 1; i <= markers->size(); i++) {
+        const sol::table marker = (*markers)[i];
+        if (!marker.valid())
+          continue;
+
+        const std::string group_name = marker["group"];
+        const sol::table color = marker["color"];
+        const int r = color[1];
+        const int g = color[2];
+        const int b = color[3];
+        int size = 1;
+        if (marker["size"].valid())
+          size = marker["size"];
+        bool visible_only = false;
+        if (marker["visible_only"].valid())
+          visible_only = marker["visible_only"];
+
+        minimap_markers.push_back({
+          group_name, SDL_Color{static_cast<Uint8>(r), static_cast<Uint8>(g), static_cast<Uint8>(b), 255}, size,
+          visible_only
+        });
+      }
+
+      draw_minimap_markers(x, y, minimap_markers);
+    });
     _lua.set_function("draw_visible_map",
-                     [&](const std::string &name, const std::string &ss_name, const sol::function &draw_map_callback) {
+                     [&](const std::string &name, const std::string &ss_name,
+                         const sol::optional<sol::function> &draw_map_callback) {
                        if (current_map_info.name != name) {
                          if (const auto map = find_map(name); map != nullptr) {
                            current_map_info.map = map;
@@ -1267,11 +4627,13 @@ namespace roguely::engine {
                          }
                        }
 
-                       if (current_map_info.name == name) {
+                       if (current_map_info.name == name && !draw_map_callback.has_value()) {
+                         current_map_info.map->draw_map(renderer, current_dimension);
+                       } else if (current_map_info.name == name) {
                          current_map_info.map->draw_map(renderer, current_dimension, sprite_sheets->at(ss_name),
                                                         [&](int rows, int cols, int dx, int dy, int cell_id,
                                                             int light_cell, int scale_factor) {
-                                                          const auto draw_map_callback_result = draw_map_callback(
+                                                          const auto draw_map_callback_result = (*draw_map_callback)(
                                                             rows, cols, dx, dy, cell_id, light_cell, scale_factor);
                                                           if (!draw_map_callback_result.valid()) {
                                                             const sol::error err = draw_map_callback_result;
@@ -1304,27 +4666,231 @@ namespace roguely::engine {
     _lua.set_function("add_entity",
                      [&](const std::string &group_name, const std::string &name, const sol::table &components,
                          sol::this_state s) {
-                       const auto entity = std::make_shared<ecs::Entity>(name);
+                       const auto entity = entity_manager->create_entity(name);
                        auto components_copy = ecs::EntityManager::copy_table(components, s);
-                       const auto lua_component = std::make_shared<roguely::components::LuaComponent>(
-                         "lua component", components_copy, s);
-                       entity->add_component(lua_component);
-                       entity_manager->add_entity_to_group(group_name, entity, s);
+                       entity->add<roguely::components::LuaComponent>("lua component", components_copy, s);
+
+                       if (const auto position = get_entity_position(components_copy); position.has_value()) {
+                         if (current_map_info.map != nullptr && free_cells_map.lock() == current_map_info.map)
+                           current_map_info.map->occupy(position->x, position->y);
+                         claim_pending_point(position->x, position->y);
+                       }
+
+                       defer([this, group_name, entity, s] {
+                         entity_manager->add_entity_to_group(group_name, entity, s);
+                         track_position(group_name, entity->get_id());
+                       });
                      });
-    _lua.set_function("remove_entity", [&](const std::string &entity_group_name, const std::string &entity_id) {
-      entity_manager->remove_entity(entity_group_name, entity_id);
+    _lua.set_function("remove_entity", [&](const std::string &entity_group_name, const ecs::EntityHandle entity_id) {
+      defer([this, entity_group_name, entity_id] {
+        if (current_map_info.map != nullptr) {
+          if (const auto entity = entity_manager->get_entity_by_id(entity_group_name, entity_id); entity != nullptr) {
+            if (const auto lua_component = entity->get<components::LuaComponent>();
+              lua_component != nullptr) {
+              if (const auto position = get_entity_position(lua_component->get_properties()); position.has_value()) {
+                if (free_cells_map.lock() == current_map_info.map)
+                  current_map_info.map->vacate(position->x, position->y);
+                // Otherwise it stays in the viewport texture until something else redraws the cell
+                current_map_info.map->redraw_cell(position->x, position->y);
+              }
+            }
+          }
+        }
+
+        entity_manager->remove_entity(entity_group_name, entity_id);
+      });
+    });
+    _lua.set_function("is_entity_alive", [&](const ecs::EntityHandle entity_id) {
+      return entity_manager->is_entity_alive(entity_id);
+    });
+    _lua.set_function("spawn_batch", [&](const std::string &group_name, const std::string &name,
+                                         const sol::table &components, const int count,
+                                         const sol::optional<sol::table> &options, const sol::this_state s) {
+      return spawn_batch(group_name, name, components, count, get_spawn_options(options), s);
+    });
+    _lua.set_function("find_path", [&](const int start_x, const int start_y, const int goal_x, const int goal_y,
+                                       const sol::optional<sol::table> &options, const sol::this_state s) {
+      sol::state_view lua(s);
+      sol::table points = lua.create_table();
+
+      if (current_map_info.map == nullptr)
+        return points;
+
+      bool hierarchical = false;
+      const auto path_options = get_path_options(options, hierarchical);
+
+      int i = 1;
+      for (const auto &[x, y]: find_path({start_x, start_y}, {goal_x, goal_y}, path_options, hierarchical))
+        points.set(i++, lua.create_table_with("x", x, "y", y));
+
+      return points;
+    });
+    _lua.set_function("get_path_cache_stats", [&](const sol::this_state s) {
+      sol::state_view lua(s);
+      if (current_map_info.map == nullptr)
+        return lua.create_table();
+
+      const auto &cache = current_map_info.map->get_path_cache();
+      const auto &[hits, partial_hits, misses, invalidations] = cache.get_stats();
+      const auto lookups = hits + partial_hits + misses;
+      const double hit_rate = lookups == 0 ? 0.0 : static_cast<double>(hits + partial_hits) / static_cast<double>(lookups);
+
+      return lua.create_table_with("hits", hits, "partial_hits", partial_hits, "misses", misses,
+                                   "invalidations", invalidations, "hit_rate", hit_rate, "size", cache.size(),
+                                   "cells", cache.get_cell_count());
+    });
+    _lua.set_function("find_paths_batch", [&](const sol::table &queries, const sol::optional<sol::table> &options,
+                                              const sol::this_state s) {
+      sol::state_view lua(s);
+      sol::table results = lua.create_table();
+
+      if (current_map_info.map == nullptr)
+        return results;
+
+      std::vector<std::pair<common::Point, common::Point> > points{};
+      for (std::size_t i = 1; i <= queries.size(); i++) {
+        const sol::table query = queries[i];
+        sol::table start{}, goal{};
+        if (query.valid()) {
+          start = query["start"];
+          goal = query["goal"];
+        }
+
+        // Bad queries still get a (empty) result so the results line up
+        if (!start.valid() || !goal.valid()) {
+          points.push_back({{-1, -1}, {-1, -1}});
+          continue;
+        }
+
+        const int start_x = start["x"];
+        const int start_y = start["y"];
+        const int goal_x = goal["x"];
+        const int goal_y = goal["y"];
+        points.push_back({{start_x, start_y}, {goal_x, goal_y}});
+      }
+
+      // The hierarchy isn't safe to share between workers so batches always search the grid
+      bool hierarchical = false;
+      const auto path_options = get_path_options(options, hierarchical);
+      const int mode = static_cast<int>(path_options.algorithm) | (path_options.diagonal ? 2 : 0);
+
+      // Only what isn't in the cache goes to the workers
+      auto &cache = current_map_info.map->get_path_cache();
+      const auto version = current_map_info.map->get_version();
+      std::vector<std::vector<common::Point> > paths(points.size());
+      std::vector<std::pair<common::Point, common::Point> > misses{};
+      std::vector<std::size_t> miss_indices{};
+
+      for (std::size_t q = 0; q < points.size(); q++) {
+        if (auto cached = cache.find(version, points[q].first, points[q].second, mode); cached.has_value()) {
+          paths[q] = std::move(*cached);
+        } else {
+          misses.push_back(points[q]);
+          miss_indices.push_back(q);
+        }
+      }
+
+      auto found = current_map_info.map->find_paths(misses, *worker_pool, path_options);
+      for (std::size_t m = 0; m < found.size(); m++) {
+        cache.store(version, misses[m].first, misses[m].second, mode, found[m]);
+        paths[miss_indices[m]] = std::move(found[m]);
+      }
+
+      int i = 1;
+      for (const auto &path: paths) {
+        sol::table path_points = lua.create_table();
+        int j = 1;
+        for (const auto &[x, y]: path)
+          path_points.set(j++, lua.create_table_with("x", x, "y", y));
+        results.set(i++, path_points);
+      }
+
+      return results;
+    });
+    _lua.set_function("compute_distance_field", [&](const std::string &field_name, const sol::table &sources,
+                                                    const sol::optional<int> &max_distance) {
+      if (current_map_info.map == nullptr)
+        return;
+
+      std::vector<common::Point> points{};
+      sources.for_each([&](const sol::object &, const sol::object &value) {
+        if (value.is<sol::table>()) {
+          const auto source = value.as<sol::table>();
+          const int x = source["x"];
+          const int y = source["y"];
+          points.push_back({x, y});
+        }
+      });
+
+      current_map_info.map->compute_distance_field(distance_fields[field_name], points, max_distance.value_or(0));
+    });
+    _lua.set_function("compute_flee_field", [&](const std::string &field_name, const std::string &from_field_name) {
+      const auto from = distance_fields.find(from_field_name);
+      if (from == distance_fields.end() || field_name == from_field_name)
+        throw sol::error(fmt::format("compute_flee_field: can't compute {} from {}", field_name, from_field_name));
+
+      // References to unordered_map elements survive the insert
+      distance_fields[field_name].compute_flee(from->second);
+    });
+    _lua.set_function("get_field_distance", [&](const int x, const int y, const std::string &field_name) {
+      sol::optional<int> distance{};
+      if (const auto field = distance_fields.find(field_name); field != distance_fields.end()) {
+        if (const auto d = field->second.get_distance(x, y); d != map::DistanceField::UNREACHABLE)
+          distance = d;
+      }
+      return distance;
+    });
+    _lua.set_function("next_step", [&](const int x, const int y, const std::string &field_name,
+                                       const sol::optional<bool> &avoid_occupied, const sol::this_state s) {
+      sol::state_view lua(s);
+      sol::optional<sol::table> step_table{};
+
+      const auto field = distance_fields.find(field_name);
+      if (field == distance_fields.end() || current_map_info.map == nullptr)
+        return step_table;
+
+      std::function<bool(int, int)> can_enter{};
+      if (avoid_occupied.value_or(false) && !current_map_info.map->is_chunked()) {
+        sync_free_cells();
+        can_enter = [&](const int nx, const int ny) { return !current_map_info.map->is_occupied(nx, ny); };
+      }
+
+      if (const auto step = field->second.next_step(x, y, can_enter); step.has_value())
+        step_table = lua.create_table_with("x", step->x, "y", step->y);
+
+      return step_table;
+    });
+    _lua.set_function("move_entity", [&](const std::string &entity_group_name, const sol::object &entity_name_or_id,
+                                         const int x, const int y) {
+      sol::table entity = sol::nil;
+      if (entity_name_or_id.get_type() == sol::type::number)
+        entity = entity_manager->get_lua_entity(entity_group_name, entity_name_or_id.as<ecs::EntityHandle>());
+      else if (entity_name_or_id.get_type() == sol::type::string)
+        entity = entity_manager->get_lua_entity(entity_group_name, entity_name_or_id.as<std::string>());
+
+      if (entity.valid())
+        move_entity(entity, x, y);
+      else if (deferring && entity_name_or_id.get_type() == sol::type::string) {
+        // Probably added earlier in this system, so go after it
+        defer([this, entity_group_name, name = entity_name_or_id.as<std::string>(), x, y] {
+          if (const auto queued = entity_manager->get_lua_entity(entity_group_name, name); queued.valid())
+            move_entity(queued, x, y);
+        });
+      }
     });
     _lua.set_function("remove_component",
                      [&](const std::string &entity_group_name, const std::string &entity_name,
                          const std::string &component_name) {
-                       entity_manager->remove_lua_component(entity_group_name, entity_name, component_name);
+                       defer([this, entity_group_name, entity_name, component_name] {
+                         entity_manager->remove_lua_component(entity_group_name, entity_name, component_name);
+                       });
                      });
     _lua.set_function("get_component_value",
                      [&](const std::string &entity_group_name, const std::string &entity_name,
                          const std::string &component_name, const std::string &key, const sol::this_state s) {
                        sol::state_view lua(s);
                        if (const auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name); entity != nullptr) {
-                         if (const auto component = entity->find_first_component_by_type<components::LuaComponent>(); component != nullptr) {
+                         if (const auto component = entity->get<components::LuaComponent>(); component != nullptr) {
                            if (auto lua_component = component->get_property<sol::table>(component_name); lua_component != sol::nil) {
                              return static_cast<sol::object>(lua_component[key]);
                            }
@@ -1335,13 +4901,33 @@ namespace roguely::engine {
     _lua.set_function("set_component_value",
                      [&](const std::string &entity_group_name, const std::string &entity_name,
                          const std::string &component_name, const std::string &key, const sol::object& value) {
-                       if (const auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name); entity != nullptr) {
-                         if (const auto component = entity->find_first_component_by_type<roguely::components::LuaComponent>(); component != nullptr) {
+                       const auto set_value = [this, entity_group_name, entity_name, component_name, key, value] {
+                         const auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name);
+                         if (entity == nullptr)
+                           return false;
+
+                         // Positions go through move_entity so the free cells and spatial index follow
+                         if (component_name == "position_component" && (key == "x" || key == "y")) {
+                           const auto lua_entity = entity_manager->get_lua_entity(entity_group_name, entity->get_id());
+                           const auto position = get_entity_position(lua_entity["components"]);
+                           if (position.has_value() && value.get_type() == sol::type::number) {
+                             const int v = value.as<int>();
+                             move_entity(lua_entity, key == "x" ? v : position->x, key == "y" ? v : position->y);
+                           }
+                           return true;
+                         }
+
+                         if (const auto component = entity->get<roguely::components::LuaComponent>(); component != nullptr) {
                            if (auto lua_component = component->get_property<sol::table>(component_name); lua_component != sol::nil) {
                              lua_component.set(key, value);
                            }
                          }
-                       }
+                         return true;
+                       };
+
+                       // Not there yet if it was added earlier in this system
+                       if (!set_value() && deferring)
+                         defer([set_value] { set_value(); });
                      });
     _lua.set_function("update_player_viewport",
       [&](const int x, const int y, const int width, const int height) {
@@ -1362,14 +4948,22 @@ namespace roguely::engine {
     _lua.set_function("add_system", [&](const std::string &name, const sol::function& system_callback) {
       systems->insert({name, system_callback});
     });
-    _lua.set_function("get_random_key_from_table", [&](const sol::table &table) {
+    _lua.set_function("get_random_key_from_table", [&](const sol::table &table, const sol::optional<std::string> &stream_name) {
       if (table.valid()) {
         std::vector<std::string> keys = {};
         table.for_each([&](const sol::object &key, const sol::object&) { keys.push_back(key.as<std::string>()); });
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, static_cast<int>(keys.size()) - 1);
-        return keys[dis(gen)];
+        if (keys.empty())
+          return std::string{};
+
+        // Lua's table order changes from run to run, sort so a seed gives the same picks
+        std::ranges::sort(keys);
+
+        auto stream = common::RandomStream::GENERAL;
+        if (stream_name.has_value()) {
+          stream = common::random_stream_from_string(*stream_name).value_or(common::RandomStream::GENERAL);
+        }
+
+        return keys[random_service->next_int(stream, 0, static_cast<int>(keys.size()) - 1)];
       }
       return std::string{};
     });
@@ -1380,6 +4974,31 @@ namespace roguely::engine {
                      [&](const std::string &entity_name, const int x, const int y, const sol::function &point_callback) {
                        return entity_manager->lua_for_each_overlapping_point(entity_name, x, y, point_callback);
                      });
+    _lua.set_function("get_entities_at", [&](const int x, const int y, const sol::optional<std::string> &group_name,
+                                             const sol::this_state s) {
+      return entity_manager->query_lua_entities(group_name, [&](auto &hits, const auto group) {
+        entity_manager->get_spatial_index().query_point(x, y, hits, group);
+      }, s);
+    });
+    _lua.set_function("get_entities_in_rect", [&](const int x, const int y, const int width, const int height,
+                                                  const sol::optional<std::string> &group_name, const sol::this_state s) {
+      return entity_manager->query_lua_entities(group_name, [&](auto &hits, const auto group) {
+        entity_manager->get_spatial_index().query_rect({{x, y}, {width, height}}, hits, group);
+      }, s);
+    });
+    _lua.set_function("get_entities_in_radius", [&](const int x, const int y, const int radius,
+                                                    const sol::optional<std::string> &group_name,
+                                                    const sol::this_state s) {
+      return entity_manager->query_lua_entities(group_name, [&](auto &hits, const auto group) {
+        entity_manager->get_spatial_index().query_radius(x, y, radius, hits, group);
+      }, s);
+    });
+    _lua.set_function("get_nearest_entities", [&](const int x, const int y, const int count,
+                                                  const sol::optional<std::string> &group_name, const sol::this_state s) {
+      return entity_manager->query_lua_entities(group_name, [&](auto &hits, const auto group) {
+        entity_manager->get_spatial_index().query_nearest(x, y, static_cast<std::size_t>(std::max(count, 0)), hits, group);
+      }, s);
+    });
     _lua.set_function("get_blocked_points",
                      [&](const std::string &entity_group, const int x, const int y, const std::string &direction,
                          const sol::this_state s) {
@@ -1393,6 +5012,9 @@ namespace roguely::engine {
     _lua.set_function("force_redraw_map", [&]() {
       if (current_map_info.map != nullptr) { current_map_info.map->trigger_redraw(); }
     });
+    _lua.set_function("redraw_map_cell", [&](const int x, const int y) {
+      if (current_map_info.map != nullptr) { current_map_info.map->redraw_cell(x, y); }
+    });
     _lua.set_function("add_font", [&](const std::string &name, const std::string &font_path, const int font_size) {
       auto text = std::make_shared<roguely::common::Text>();
       text->load_font(font_path, font_size);
@@ -1414,19 +5036,17 @@ namespace roguely::engine {
       };
 
       auto is_up_blocked =
-          entity_manager->lua_is_point_unique(points[0]) && current_map_info.map->is_point_blocked(
+          !is_point_taken(points[0]) && current_map_info.map->is_point_blocked(
             points[0].x, points[0].y);
       auto is_down_blocked =
-          entity_manager->lua_is_point_unique(points[1]) && current_map_info.map->is_point_blocked(
+          !is_point_taken(points[1]) && current_map_info.map->is_point_blocked(
             points[1].x, points[1].y);
       auto is_left_blocked =
-          entity_manager->lua_is_point_unique(points[2]) && current_map_info.map->is_point_blocked(
+          !is_point_taken(points[2]) && current_map_info.map->is_point_blocked(
             points[2].x, points[2].y);
       auto is_right_blocked =
-          entity_manager->lua_is_point_unique(points[3]) && current_map_info.map->is_point_blocked(
+          !is_point_taken(points[3]) && current_map_info.map->is_point_blocked(
             points[3].x, points[3].y);
-      entity_manager->lua_is_point_unique(points[3]) && current_map_info.map->is_point_blocked(
-        points[3].x, points[3].y);
 
       sol::table adjacent_points = lua.create_table_with(
         "up", lua.create_table_with("blocked", is_up_blocked, "x", points[0].x, "y", points[0].y),
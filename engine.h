@@ -9,9 +9,26 @@
 #include <utility>
 #include <vector>
 #include <set>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <array>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <span>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+#include <climits>
 #include <magic_enum/magic_enum.hpp>
 #include <boost/uuid/uuid_generators.hpp>
-#include <boost/numeric/ublas/matrix.hpp>
 #include <fmt/core.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
@@ -27,20 +44,6 @@ extern std::string generate_uuid();
 
 extern int generate_random_int(int min, int max);
 
-namespace roguely::level_generation {
-  // Quick and dirty cellular automata that I learned about from YouTube. We
-  // can do more but currently are just doing the very least to get a playable
-  // level.
-
-  int get_neighbor_wall_count(const std::shared_ptr<boost::numeric::ublas::matrix<int> > &map, int map_width, int map_height,
-                              int x, int y);
-
-  void perform_cellular_automaton(const std::shared_ptr<boost::numeric::ublas::matrix<int> > &map, int map_width,
-                                  int map_height, int passes);
-
-  std::shared_ptr<boost::numeric::ublas::matrix<int> > init_cellular_automata(int map_width, int map_height);
-}
-
 namespace roguely::common {
   struct Point {
     bool eq(Point p) const;
@@ -56,6 +59,11 @@ namespace roguely::common {
     int height{};
   };
 
+  struct Rect {
+    Point point{};
+    Size size{};
+  };
+
   struct Dimension {
     bool eq(const Dimension &d) const;
 
@@ -64,6 +72,244 @@ namespace roguely::common {
     Size size{};
   };
 
+  // One bit per cell, rows are padded out to a whole number of 64 bit words so
+  // a row can be processed a word at a time without straddling the next row.
+  class BitGrid {
+  public:
+    BitGrid() = default;
+
+    BitGrid(const int w, const int h)
+      : width(w), height(h), words_per_row((w + 63) / 64),
+        bits(static_cast<std::size_t>(words_per_row) * h, 0) {
+    }
+
+    [[nodiscard]] bool get(const int x, const int y) const {
+      return (bits[static_cast<std::size_t>(y) * words_per_row + (x >> 6)] >> (x & 63)) & 1;
+    }
+
+    void set(const int x, const int y, const bool value) {
+      auto &word = bits[static_cast<std::size_t>(y) * words_per_row + (x >> 6)];
+      const std::uint64_t mask = std::uint64_t{1} << (x & 63);
+      word = value ? (word | mask) : (word & ~mask);
+    }
+
+    [[nodiscard]] std::uint64_t *row(const int y) { return bits.data() + static_cast<std::size_t>(y) * words_per_row; }
+    [[nodiscard]] const std::uint64_t *row(const int y) const { return bits.data() + static_cast<std::size_t>(y) * words_per_row; }
+
+    void clear() { std::ranges::fill(bits, 0); }
+
+    [[nodiscard]] auto get_width() const { return width; }
+    [[nodiscard]] auto get_height() const { return height; }
+    [[nodiscard]] auto get_words_per_row() const { return words_per_row; }
+
+  private:
+    int width{};
+    int height{};
+    int words_per_row{};
+    std::vector<std::uint64_t> bits{};
+  };
+
+  // Hands out storage starting on a cache line boundary
+  template<typename T, std::size_t Alignment = 64>
+  struct CacheAlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+      using other = CacheAlignedAllocator<U, Alignment>;
+    };
+
+    CacheAlignedAllocator() = default;
+
+    template<typename U>
+    explicit CacheAlignedAllocator(const CacheAlignedAllocator<U, Alignment> &) noexcept {
+    }
+
+    T *allocate(const std::size_t n) {
+      return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T *p, std::size_t) noexcept { ::operator delete(p, std::align_val_t{Alignment}); }
+
+    bool operator==(const CacheAlignedAllocator &) const noexcept { return true; }
+  };
+
+  // Row-major grid of map cells indexed as (row, col). operator() doesn't
+  // check bounds so hot loops stay tight, at() does. Use BitGrid when a cell
+  // is just a bit.
+  template<typename T>
+  class TileGrid {
+    static_assert(!std::is_same_v<T, bool>, "Use BitGrid for grids of bits");
+
+  public:
+    TileGrid() = default;
+
+    TileGrid(const int w, const int h, const T value = T{})
+      : width(w), height(h), cells(static_cast<std::size_t>(w) * h, value) {
+    }
+
+    [[nodiscard]] T &operator()(const int row, const int col) {
+      return cells[static_cast<std::size_t>(row) * width + col];
+    }
+
+    [[nodiscard]] const T &operator()(const int row, const int col) const {
+      return cells[static_cast<std::size_t>(row) * width + col];
+    }
+
+    // Flat row-major index
+    [[nodiscard]] T &operator[](const std::size_t i) { return cells[i]; }
+    [[nodiscard]] const T &operator[](const std::size_t i) const { return cells[i]; }
+
+    [[nodiscard]] T &at(const int row, const int col) {
+      if (!contains(row, col))
+        throw std::out_of_range("TileGrid index out of range");
+      return (*this)(row, col);
+    }
+
+    [[nodiscard]] const T &at(const int row, const int col) const {
+      if (!contains(row, col))
+        throw std::out_of_range("TileGrid index out of range");
+      return (*this)(row, col);
+    }
+
+    [[nodiscard]] bool contains(const int row, const int col) const {
+      return row >= 0 && col >= 0 && row < height && col < width;
+    }
+
+    [[nodiscard]] std::span<T> row(const int r) {
+      return {cells.data() + static_cast<std::size_t>(r) * width, static_cast<std::size_t>(width)};
+    }
+
+    [[nodiscard]] std::span<const T> row(const int r) const {
+      return {cells.data() + static_cast<std::size_t>(r) * width, static_cast<std::size_t>(width)};
+    }
+
+    void fill(const T value) { std::ranges::fill(cells, value); }
+
+    [[nodiscard]] T *data() { return cells.data(); }
+    [[nodiscard]] const T *data() const { return cells.data(); }
+    [[nodiscard]] auto begin() { return cells.begin(); }
+    [[nodiscard]] auto end() { return cells.end(); }
+    [[nodiscard]] auto begin() const { return cells.begin(); }
+    [[nodiscard]] auto end() const { return cells.end(); }
+    [[nodiscard]] std::size_t size() const { return cells.size(); }
+    [[nodiscard]] bool empty() const { return cells.empty(); }
+
+    [[nodiscard]] auto get_width() const { return width; }
+    [[nodiscard]] auto get_height() const { return height; }
+
+  private:
+    int width{};
+    int height{};
+    std::vector<T, CacheAlignedAllocator<T> > cells{};
+  };
+
+  // Used for seeding and for hashing coordinates into random values
+  constexpr std::uint64_t splitmix64(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+
+  // xoshiro256** (https://prng.di.unimi.it/). Satisfies UniformRandomBitGenerator
+  // so it can still be handed to <random> if need be.
+  class Xoshiro256 {
+  public:
+    using result_type = std::uint64_t;
+
+    Xoshiro256() : Xoshiro256(0) {
+    }
+
+    explicit Xoshiro256(const std::uint64_t seed) { this->seed(seed); }
+
+    void seed(std::uint64_t seed);
+
+    result_type operator()();
+
+    // Advances the generator 2^128 steps, used to split one seed into
+    // non-overlapping streams
+    void jump();
+
+    // Uniform int in [min, max]. Unlike std::uniform_int_distribution this gives
+    // the same sequence on every compiler, which matters for reproducible runs.
+    int next_int(int min, int max);
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+  private:
+    std::array<std::uint64_t, 4> state{};
+  };
+
+  enum class RandomStream {
+    GENERAL,
+    MAPGEN,
+    AI,
+    LOOT
+  };
+
+  extern std::optional<RandomStream> random_stream_from_string(std::string name);
+
+  // Engine owned random numbers. Every stream comes from the one seed but draws
+  // from one stream never shift another, so e.g. mobs wandering around doesn't
+  // change what the next level or the next treasure chest looks like.
+  class RandomService {
+  public:
+    explicit RandomService(const std::uint64_t seed) { set_seed(seed); }
+
+    void set_seed(std::uint64_t seed);
+
+    [[nodiscard]] auto get_seed() const { return seed; }
+
+    Xoshiro256 &get_stream(const RandomStream stream) { return streams[static_cast<std::size_t>(stream)]; }
+
+    int next_int(const RandomStream stream, const int min, const int max) { return get_stream(stream).next_int(min, max); }
+
+  private:
+    std::uint64_t seed{};
+    std::array<Xoshiro256, magic_enum::enum_count<RandomStream>()> streams{};
+  };
+
+  // A fixed set of worker threads fed from one job queue. parallel_for hands out
+  // indices from a shared counter and the calling thread works through them
+  // too, so it is safe to call from a job that is already running on the pool.
+  class WorkerPool {
+  public:
+    explicit WorkerPool(unsigned int thread_count = std::thread::hardware_concurrency());
+
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    template<typename F>
+    auto submit(F &&f) -> std::future<std::invoke_result_t<F> > {
+      auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()> >(std::forward<F>(f));
+      auto result = task->get_future();
+      {
+        std::lock_guard lock(mutex);
+        jobs.emplace_back([task] { (*task)(); });
+      }
+      jobs_available.notify_one();
+      return result;
+    }
+
+    void parallel_for(int count, const std::function<void(int)> &fn);
+
+    [[nodiscard]] auto get_thread_count() const { return static_cast<int>(workers.size()); }
+
+  private:
+    void worker_loop();
+
+    std::vector<std::thread> workers{};
+    std::deque<std::function<void()> > jobs{};
+    std::mutex mutex{};
+    std::condition_variable jobs_available{};
+    bool stopping{};
+  };
+
   struct Sound {
     std::string name;
     Mix_Chunk *sound;
@@ -96,6 +342,73 @@ namespace roguely::common {
   };
 }
 
+namespace roguely::level_generation {
+  // Quick and dirty cellular automata that I learned about from YouTube. We
+  // can do more but currently are just doing the very least to get a playable
+  // level.
+
+  int get_neighbor_wall_count(const common::TileGrid<std::uint8_t> &map, int map_width, int map_height,
+                              int x, int y);
+
+  void perform_cellular_automaton(const std::shared_ptr<common::TileGrid<std::uint8_t> > &map, int map_width,
+                                  int map_height, int passes);
+
+  // Whether a cell starts out as floor depends only on the seed and its
+  // coordinates, so the map can be filled in any order or in parallel.
+  bool is_active_cell(std::uint64_t seed, int x, int y);
+
+  std::shared_ptr<common::TileGrid<std::uint8_t> > init_cellular_automata(int map_width, int map_height, std::uint64_t seed);
+
+  // Bit packed version of the above. Floor cells are set bits, walls are clear
+  // bits. Produces the same map as the matrix version for the same seed but
+  // works on 64 cells at a time and ping-pongs between two buffers instead of
+  // copying the map every pass.
+
+  common::BitGrid init_cellular_automata_bit_grid(int map_width, int map_height, std::uint64_t seed,
+                                                  common::WorkerPool *pool = nullptr);
+
+  // When a worker pool is given each pass is split into row bands that run in
+  // parallel. Every band reads the previous pass (including the rows just
+  // outside the band) and writes only its own rows, so the result is the same
+  // no matter how many threads there are.
+  void perform_cellular_automaton(common::BitGrid &map, int passes, common::WorkerPool *pool = nullptr);
+
+  // Runs the automaton over just a window of a map_width x map_height map. The
+  // window's own edge is treated as wall, so only cells further than `passes`
+  // from the edge of the window match what the whole map would have there.
+  common::BitGrid generate_cellular_automata_region(int region_x, int region_y, int region_width, int region_height,
+                                                    int map_width, int map_height, std::uint64_t seed, int passes);
+
+  std::shared_ptr<common::TileGrid<std::uint8_t> > bit_grid_to_tile_grid(const common::BitGrid &map);
+
+  // 4-connected floor regions. Region ids start at 1, walls are 0.
+  struct MapRegions {
+    int width{};
+    int height{};
+    common::TileGrid<std::int32_t> labels{};
+    std::vector<int> sizes{}; // by region id, sizes[0] is unused
+    std::int32_t largest{};
+
+    [[nodiscard]] std::int32_t get_region(const int x, const int y) const {
+      if (x < 0 || y < 0 || x >= width || y >= height)
+        return 0;
+      return labels(y, x);
+    }
+
+    [[nodiscard]] int get_region_count() const { return static_cast<int>(sizes.size()) - 1; }
+  };
+
+  struct RegionOptions {
+    int min_region_size{}; // smaller regions are filled in with wall
+    bool connect_regions{}; // carve corridors so every region joins the largest
+  };
+
+  MapRegions label_regions(const common::BitGrid &map);
+
+  // Applies the options to the map and returns the final labels
+  MapRegions process_regions(common::BitGrid &map, const RegionOptions &options);
+}
+
 namespace roguely::ecs {
   enum class EntityGroupName {
     PLAYER,
@@ -106,6 +419,23 @@ namespace roguely::ecs {
 
   extern std::string entity_group_name_to_string(roguely::ecs::EntityGroupName group_name);
 
+  using ComponentTypeId = std::uint32_t;
+
+  // Low 32 bits are the storage slot, high 32 bits the slot's generation. Generations start at 1 so 0 is never a
+  // live handle, and a slot that gets reused bumps its generation so old handles stop resolving
+  using EntityHandle = std::uint64_t;
+
+  constexpr EntityHandle INVALID_ENTITY = 0;
+
+  constexpr std::uint32_t get_handle_slot(const EntityHandle handle) { return static_cast<std::uint32_t>(handle); }
+  constexpr std::uint32_t get_handle_generation(const EntityHandle handle) { return static_cast<std::uint32_t>(handle >> 32); }
+
+  constexpr EntityHandle make_handle(const std::uint32_t slot, const std::uint32_t generation) {
+    return static_cast<EntityHandle>(generation) << 32 | slot;
+  }
+
+  class Entity;
+
   class Component {
   public:
     virtual ~Component() = default;
@@ -114,184 +444,442 @@ namespace roguely::ecs {
     void set_name(const std::string &name) { component_name = name; }
     [[nodiscard]] auto get_id() const { return id; }
 
-    explicit Component(std::string name, std::string id = generate_uuid()) : component_name(std::move(name)), id(std::move(id)) {
+    explicit Component(std::string name) : component_name(std::move(name)), id(next_id()) {
     }
 
+    // Pools keep components by value and move them around on removal
+    Component(const Component &) = default;
+    Component(Component &&) noexcept = default;
+    Component &operator=(const Component &) = default;
+    Component &operator=(Component &&) noexcept = default;
+
   private:
+    // Components are reached through their entity's handle, the id is just a serial that's never reused
+    static std::uint64_t next_id() {
+      static std::uint64_t next = 0;
+      return ++next;
+    }
+
     std::string component_name{"unnamed component"};
 
   protected:
-    std::string id{};
+    std::uint64_t id{};
   };
 
   template<class T>
   concept ComponentType = std::is_base_of_v<roguely::ecs::Component, T>;
 
-  class Entity {
+  namespace detail {
+    inline ComponentTypeId next_component_type_id() {
+      static ComponentTypeId next = 0;
+      return next++;
+    }
+  }
+
+  // Handed out on first use per type, from the static type so there's no RTTI involved
+  template<ComponentType T>
+  ComponentTypeId component_type_id() {
+    static const auto id = detail::next_component_type_id();
+    return id;
+  }
+
+  // Sparse set keyed by entity slot. The typed pools below keep their components by value in a dense array that
+  // lines up with owners, removal swaps the last element into the hole
+  class ComponentPoolBase {
   public:
-    Entity() : Entity(generate_uuid(), "unnamed entity") {
+    static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+
+    virtual ~ComponentPoolBase() = default;
+
+    [[nodiscard]] bool contains(const std::uint32_t entity) const {
+      return entity < sparse.size() && sparse[entity] != NONE;
+    }
+
+    [[nodiscard]] virtual Component *get_component(std::uint32_t entity) = 0;
+    virtual void erase(std::uint32_t entity) = 0;
+
+    [[nodiscard]] auto size() const { return owners.size(); }
+    [[nodiscard]] const auto &get_owners() const { return owners; }
+
+  protected:
+    std::uint32_t insert_owner(const std::uint32_t entity) {
+      if (entity >= sparse.size())
+        sparse.resize(entity + 1, NONE);
+      sparse[entity] = static_cast<std::uint32_t>(owners.size());
+      owners.emplace_back(entity);
+      return sparse[entity];
     }
 
-    explicit Entity(const std::string &name) : Entity(generate_uuid(), name) {
+    // Gives back the dense index that was freed, the caller moves its last component there
+    std::uint32_t erase_owner(const std::uint32_t entity) {
+      const auto index = sparse[entity];
+      const auto last = static_cast<std::uint32_t>(owners.size() - 1);
+      if (index != last) {
+        owners[index] = owners[last];
+        sparse[owners[index]] = index;
+      }
+      owners.pop_back();
+      sparse[entity] = NONE;
+      return index;
     }
 
-    Entity(std::string id, std::string name) : id(std::move(id)), name(std::move(name)) {
-      components = std::make_unique<std::vector<std::shared_ptr<Component> > >();
+    std::vector<std::uint32_t> sparse{};
+    std::vector<std::uint32_t> owners{};
+  };
+
+  // One T per entity. Pointers from get are good until the next insert into or erase from this pool
+  template<ComponentType T>
+  class ComponentPool final : public ComponentPoolBase {
+  public:
+    [[nodiscard]] T *get(const std::uint32_t entity) {
+      return contains(entity) ? &components[sparse[entity]] : nullptr;
     }
 
-    template<ComponentType T>
-    std::shared_ptr<T> find_first_component_by_type() {
-      for (auto &c: *components) {
-        auto casted = std::dynamic_pointer_cast<T>(c);
+    [[nodiscard]] const T *get(const std::uint32_t entity) const {
+      return contains(entity) ? &components[sparse[entity]] : nullptr;
+    }
 
-        if (casted != nullptr) {
-          return casted;
-        }
-      }
+    [[nodiscard]] Component *get_component(const std::uint32_t entity) override { return get(entity); }
 
-      return nullptr;
+    // Replaces whatever the entity already had
+    template<typename... Args>
+    T &emplace(const std::uint32_t entity, Args &&... args) {
+      if (contains(entity))
+        return components[sparse[entity]] = T(std::forward<Args>(args)...);
+      insert_owner(entity);
+      return components.emplace_back(std::forward<Args>(args)...);
     }
 
-    template<ComponentType T>
-    std::shared_ptr<T> find_first_component_by_name(const std::string &name) {
-      std::vector<std::shared_ptr<T> > matches{};
+    void erase(const std::uint32_t entity) override {
+      if (!contains(entity))
+        return;
+      if (const auto index = erase_owner(entity); index != components.size() - 1)
+        components[index] = std::move(components.back());
+      components.pop_back();
+    }
 
-      for (auto &c: *components) {
-        auto casted = std::dynamic_pointer_cast<T>(c);
+    [[nodiscard]] auto &get_components() { return components; }
+    [[nodiscard]] const auto &get_components() const { return components; }
 
-        if (casted != nullptr && casted->get_name() == name) {
-          return casted;
-        }
+  private:
+    std::vector<T> components{};
+  };
+
+  // Owns the per type pools and hands out entity slots. Each EntityManager has one and entities register with it on
+  // construction, it's main thread only like the rest of the ECS
+  class ComponentStorage {
+  public:
+    EntityHandle create_entity(Entity *entity) {
+      if (!free_slots.empty()) {
+        const auto slot = free_slots.back();
+        free_slots.pop_back();
+        entities[slot] = entity;
+        return make_handle(slot, generations[slot]);
       }
+      entities.emplace_back(entity);
+      generations.emplace_back(1);
+      return make_handle(static_cast<std::uint32_t>(entities.size() - 1), 1);
+    }
 
-      return nullptr;
+    void destroy_entity(const EntityHandle handle) {
+      if (!is_alive(handle))
+        return;
+
+      const auto slot = get_handle_slot(handle);
+      for (const auto &pool: pools) {
+        if (pool != nullptr)
+          pool->erase(slot);
+      }
+      entities[slot] = nullptr;
+      if (++generations[slot] == 0)
+        generations[slot] = 1;
+      free_slots.emplace_back(slot);
     }
 
-    template<ComponentType T>
-    auto find_components_by_name(const std::string &name) {
-      std::vector<std::shared_ptr<T> > matches{};
+    [[nodiscard]] bool is_alive(const EntityHandle handle) const {
+      const auto slot = get_handle_slot(handle);
+      return slot < entities.size() && entities[slot] != nullptr && generations[slot] == get_handle_generation(handle);
+    }
 
-      for (auto &c: *components) {
-        auto casted = std::dynamic_pointer_cast<T>(c);
+    // nullptr for stale handles
+    [[nodiscard]] Entity *get_entity(const EntityHandle handle) const {
+      return is_alive(handle) ? entities[get_handle_slot(handle)] : nullptr;
+    }
 
-        if (casted != nullptr && casted->get_name() == name) {
-          matches.emplace_back(casted);
-        }
-      }
+    template<ComponentType T>
+    ComponentPool<T> &get_pool() {
+      const auto type = component_type_id<T>();
+      if (type >= pools.size())
+        pools.resize(type + 1);
+      if (pools[type] == nullptr)
+        pools[type] = std::make_unique<ComponentPool<T> >();
+      return static_cast<ComponentPool<T> &>(*pools[type]);
+    }
 
-      return matches;
+    template<ComponentType T>
+    [[nodiscard]] ComponentPool<T> *find_pool() const {
+      const auto type = component_type_id<T>();
+      return type < pools.size() ? static_cast<ComponentPool<T> *>(pools[type].get()) : nullptr;
+    }
+
+    [[nodiscard]] ComponentPoolBase *find_pool(const ComponentTypeId type) const {
+      return type < pools.size() ? pools[type].get() : nullptr;
     }
 
     template<ComponentType T>
-    auto find_components_by_type() {
-      std::vector<std::shared_ptr<T> > matches{};
+    [[nodiscard]] T *get(const std::uint32_t slot) const {
+      const auto pool = find_pool<T>();
+      return pool != nullptr ? pool->get(slot) : nullptr;
+    }
 
-      for (auto &c: *components) {
-        auto casted = std::dynamic_pointer_cast<T>(c);
+    // Walks T's dense array in order, f gets the owning entity and the component
+    template<ComponentType T, typename F>
+    void each(F &&f) const {
+      const auto pool = find_pool<T>();
+      if (pool == nullptr)
+        return;
+
+      auto &components = pool->get_components();
+      const auto &owners = pool->get_owners();
+      for (std::size_t i = 0; i < components.size(); i++)
+        f(*entities[owners[i]], components[i]);
+    }
 
-        if (casted != nullptr) {
-          matches.emplace_back(casted);
-        }
-      }
+  private:
+    std::vector<std::unique_ptr<ComponentPoolBase> > pools{};
+    std::vector<Entity *> entities{};
+    std::vector<std::uint32_t> generations{};
+    std::vector<std::uint32_t> free_slots{};
+  };
 
-      return matches;
+  class Entity {
+  public:
+    explicit Entity(ComponentStorage &storage) : Entity(storage, "unnamed entity") {
+    }
+
+    // The name is only a label, the handle is what identifies the entity. The storage has to outlive us
+    Entity(ComponentStorage &storage, std::string name) : name(std::move(name)), storage(&storage),
+                                                           handle(storage.create_entity(this)),
+                                                           slot(get_handle_slot(handle)) {
     }
 
+    ~Entity() { storage->destroy_entity(handle); }
+
+    // The storage keeps a pointer back to us
+    Entity(const Entity &) = delete;
+    Entity &operator=(const Entity &) = delete;
+
+    // O(1) lookup in T's pool. Types match exactly (no upcasts), the pointer is good until T's pool next changes
     template<ComponentType T>
-    auto find_components_by_type(std::function<bool(std::shared_ptr<T>)> predicate) {
-      std::vector<std::shared_ptr<T> > matches{};
+    [[nodiscard]] T *get() const { return storage->get<T>(slot); }
 
-      for (auto &c: *components) {
-        auto casted = std::dynamic_pointer_cast<T>(c);
+    template<ComponentType T>
+    [[nodiscard]] bool has() const { return get<T>() != nullptr; }
+
+    // Built in T's pool, replacing any T the entity already had
+    template<ComponentType T, typename... Args>
+    T &add(Args &&... args) {
+      if (!has<T>())
+        types.emplace_back(component_type_id<T>());
+      return storage->get_pool<T>().emplace(slot, std::forward<Args>(args)...);
+    }
 
-        if (casted != nullptr && predicate(casted)) {
-          matches.emplace_back(casted);
-        }
-      }
+    template<ComponentType T>
+    T &add_component(T component) { return add<T>(std::move(component)); }
 
-      return matches;
+    template<ComponentType T>
+    void remove() {
+      if (!has<T>())
+        return;
+      storage->get_pool<T>().erase(slot);
+      types.erase(std::ranges::find(types, component_type_id<T>()));
     }
 
-    [[nodiscard]] auto get_name() const { return name; }
-    [[nodiscard]] auto get_id() const { return id; }
-    void add_component(const std::shared_ptr<Component>& c) const { components->emplace_back(c); }
+    template<ComponentType T>
+    [[nodiscard]] T *find_first_component_by_type() const { return get<T>(); }
 
-    void add_components(std::vector<std::shared_ptr<Component> > c) const {
-      components->insert(components->end(), c.begin(), c.end());
+    template<ComponentType T>
+    [[nodiscard]] T *find_first_component_by_name(const std::string &name) const {
+      const auto c = get<T>();
+      return c != nullptr && c->get_name() == name ? c : nullptr;
     }
 
     template<ComponentType T>
-    void remove_components(std::vector<std::shared_ptr<T> > c) {
-      for (auto &component: c) {
-        auto it = std::find(components->begin(), components->end(), component);
-        if (it != components->end()) {
-          components->erase(it);
-        }
-      }
+    std::vector<T *> find_components_by_type(const std::function<bool(const T &)> &predicate) const {
+      if (const auto c = get<T>(); c != nullptr && predicate(*c))
+        return {c};
+      return {};
     }
 
     template<ComponentType T>
-    void remove_component(std::shared_ptr<T> component) {
-      auto it = std::find(components->begin(), components->end(), component);
-      if (it != components->end()) {
-        components->erase(it);
-      }
+    std::vector<T *> find_component_by_type(const std::function<bool(const T &)> &predicate) const {
+      return find_components_by_type<T>(predicate);
     }
 
-    void for_each_component(const std::function<void(std::shared_ptr<Component> &)> &fc) const {
-      for (auto &c: *components) {
-        fc(c);
+    [[nodiscard]] const auto &get_name() const { return name; }
+    [[nodiscard]] auto get_id() const { return handle; }
+    [[nodiscard]] auto get_slot() const { return slot; }
+
+    // In the order they were added
+    void for_each_component(const std::function<void(Component &)> &fc) const {
+      for (const auto type: types) {
+        if (const auto c = storage->find_pool(type)->get_component(slot); c != nullptr)
+          fc(*c);
       }
     }
 
-    void clear_components() const { components->clear(); }
-    [[nodiscard]] auto get_component_count() const { return components->size(); }
+    void clear_components() {
+      for (const auto type: types)
+        storage->find_pool(type)->erase(slot);
+      types.clear();
+    }
+
+    [[nodiscard]] auto get_component_count() const { return types.size(); }
 
-  private:
-    std::string id{};
+  protected:
+    std::string name = {"unnamed entity"};
+    ComponentStorage *storage{};
+    EntityHandle handle{INVALID_ENTITY};
+    std::uint32_t slot{};
+    std::vector<ComponentTypeId> types{};
+  };
+
+  using GroupId = std::uint32_t;
 
+  // Entity positions bucketed into BUCKET_SIZE squares. Buckets are hashed so it doesn't need to know how big the
+  // map is (chunked maps can be huge), and every entity remembers its bucket and place in it so moves and removals
+  // are O(1). Queries only touch the buckets they overlap
+  class SpatialIndex {
   public:
-    template<typename T>
-    std::vector<std::shared_ptr<T> > find_component_by_type(std::function<bool(std::shared_ptr<T>)> predicate) {
-      std::vector<std::shared_ptr<T> > results;
-      for (const auto &component: *components) {
-        if (auto casted_component = std::dynamic_pointer_cast<T>(component);
-          casted_component && predicate(casted_component)) {
-          results.emplace_back(casted_component);
-        }
-      }
-      return results;
+    struct Entry {
+      EntityHandle id{};
+      GroupId group{};
+      int x{};
+      int y{};
+    };
+
+    static constexpr int BUCKET_SHIFT = 3;
+    static constexpr int BUCKET_SIZE = 1 << BUCKET_SHIFT;
+
+    void insert(EntityHandle id, GroupId group, int x, int y);
+    void move(EntityHandle id, int x, int y);
+    void erase(EntityHandle id);
+
+    [[nodiscard]] bool contains(const EntityHandle id) const { return find_location(id) != nullptr; }
+    [[nodiscard]] std::optional<roguely::common::Point> get_position(EntityHandle id) const;
+    [[nodiscard]] bool is_occupied(int x, int y) const;
+    [[nodiscard]] auto size() const { return count; }
+
+    // All of these append to results, group limits them to a single entity group
+    void query_point(int x, int y, std::vector<Entry> &results, std::optional<GroupId> group = std::nullopt) const;
+    void query_rect(const roguely::common::Rect &rect, std::vector<Entry> &results,
+                    std::optional<GroupId> group = std::nullopt) const;
+    void query_radius(int x, int y, int radius, std::vector<Entry> &results,
+                      std::optional<GroupId> group = std::nullopt) const;
+    // Nearest first (straight line distance), ties go to the lower handle so hashing order doesn't leak out
+    void query_nearest(int x, int y, std::size_t k, std::vector<Entry> &results,
+                       std::optional<GroupId> group = std::nullopt) const;
+
+  private:
+    struct Location {
+      EntityHandle id{INVALID_ENTITY};
+      std::uint64_t bucket{};
+      std::uint32_t index{};
+    };
+
+    static std::uint64_t get_bucket_key(const int bx, const int by) {
+      return static_cast<std::uint64_t>(static_cast<std::uint32_t>(bx)) << 32 | static_cast<std::uint32_t>(by);
     }
 
-  protected:
-    std::string name = {"unnamed entity"};
-    std::unique_ptr<std::vector<std::shared_ptr<Component> > > components{};
+    [[nodiscard]] const Location *find_location(EntityHandle id) const;
+    Entry take(Location location);
+    void place(const Entry &entry);
+
+    std::unordered_map<std::uint64_t, std::vector<Entry> > buckets{};
+    // By handle slot
+    std::vector<Location> locations{};
+    std::size_t count{};
   };
 
+  // entities is kept in step with the indices by EntityManager, don't add to or remove from it directly. Removal
+  // swaps the last entity into the hole so neither entities nor ids_by_name stay in the order things were added
   struct EntityGroup {
+    struct Location {
+      std::size_t index{};
+      std::size_t name_index{};
+    };
+
+    GroupId id{};
     std::string name{};
     std::shared_ptr<std::vector<std::shared_ptr<Entity> > > entities{};
+    std::unordered_map<EntityHandle, Location> index_by_id{};
+    // A name lookup gives back the front one, which is the first added until something with that name is removed
+    std::unordered_map<std::string, std::vector<EntityHandle> > ids_by_name{};
+    sol::table lua_entities{};
+  };
+
+  // Structural changes made while a system runs are recorded here and played back in order at the next sync point,
+  // so a system can add or remove entities while it walks a group with pairs()
+  class CommandBuffer {
+  public:
+    void record(std::function<void()> command) { commands.emplace_back(std::move(command)); }
+
+    void flush() {
+      // Swapped out first so a command that records another doesn't invalidate what we're walking
+      const auto pending = std::move(commands);
+      commands.clear();
+      for (const auto &command: pending) {
+        command();
+      }
+    }
+
+    void clear() { commands.clear(); }
+
+    [[nodiscard]] auto size() const { return commands.size(); }
+    [[nodiscard]] bool empty() const { return commands.empty(); }
+
+  private:
+    std::vector<std::function<void()> > commands{};
   };
 
   class EntityManager {
   public:
     explicit EntityManager(sol::this_state s) {
       sol::state_view lua(s);
+      storage = std::make_unique<ComponentStorage>();
       entity_groups = std::make_unique<std::vector<std::shared_ptr<EntityGroup> > >();
+      group_ids = std::make_unique<std::unordered_map<std::string, GroupId> >();
+      spatial_index = std::make_unique<SpatialIndex>();
       lua_entities = lua.create_table();
     }
 
+    // Entities belong to the manager that made them, add them to groups in that manager
+    [[nodiscard]] std::shared_ptr<Entity> create_entity(const std::string &entity_name) const {
+      return std::make_shared<Entity>(*storage, entity_name);
+    }
+
+    [[nodiscard]] bool is_entity_alive(const EntityHandle entity_id) const { return storage->is_alive(entity_id); }
+
+    // Every entity with a T, in the order T's pool keeps them, f gets (Entity &, T &)
+    template<ComponentType T, typename F>
+    void each(F &&f) const { storage->each<T>(std::forward<F>(f)); }
+
     void add_entity_to_group(const std::string &group_name, const std::shared_ptr<Entity>& e, sol::this_state s);
 
+    // Looks the group up once for the lot
+    void add_entities_to_group(const std::string &group_name, const std::vector<std::shared_ptr<Entity> > &entities,
+                               sol::this_state s);
+
     void add_entity_to_group(const EntityGroupName group_name, std::shared_ptr<Entity> e, const sol::this_state s) {
       add_entity_to_group(entity_group_name_to_string(group_name), std::move(e), s);
     }
 
+    // Returns the existing group if there is one
     [[nodiscard]] std::shared_ptr<EntityGroup> create_entity_group(const std::string &group_name) const;
 
     [[nodiscard]] std::shared_ptr<Entity> create_entity_in_group(const std::string &group_name, const std::string &entity_name) const;
 
-    void remove_entity(const std::string &entity_group_name, const std::string &entity_id);
+    void remove_entity(const std::string &entity_group_name, EntityHandle entity_id);
 
     [[nodiscard]] std::vector<std::string> get_entity_group_names() const {
       std::vector<std::string> results{};
@@ -303,6 +891,31 @@ namespace roguely::ecs {
 
     [[nodiscard]] std::shared_ptr<EntityGroup> get_entity_group(const std::string &group_name) const;
 
+    [[nodiscard]] std::shared_ptr<EntityGroup> get_entity_group(const GroupId group_id) const {
+      return group_id < entity_groups->size() ? (*entity_groups)[group_id] : nullptr;
+    }
+
+    // Every entity with a position_component. Positions have to be changed through set_entity_position for this
+    // to stay right, the engine does that for writes from Lua
+    [[nodiscard]] const SpatialIndex &get_spatial_index() const { return *spatial_index; }
+
+    void set_entity_position(const EntityHandle entity_id, const int x, const int y) const {
+      spatial_index->move(entity_id, x, y);
+    }
+
+    // For a position_component given to or taken from an entity already in a group
+    void insert_entity_position(const EntityHandle entity_id, const GroupId group, const int x, const int y) const {
+      spatial_index->insert(entity_id, group, x, y);
+    }
+
+    void erase_entity_position(const EntityHandle entity_id) const { spatial_index->erase(entity_id); }
+
+    // Tables the engine watches writes to are left empty with their fields behind __index, anything else is
+    // returned as is
+    static sol::table get_proxied_fields(const sol::table &table);
+
+    static std::optional<roguely::common::Point> get_lua_position(const sol::table &components);
+
     [[nodiscard]] std::shared_ptr<EntityGroup> get_entity_group(const EntityGroupName group_name) const {
       return get_entity_group(entity_group_name_to_string(group_name));
     }
@@ -313,7 +926,7 @@ namespace roguely::ecs {
       return get_entities_in_group(entity_group_name_to_string(group_name));
     }
 
-    std::string get_entity_id_by_name(const std::string &group_name, const std::string &entity_name) const;
+    [[nodiscard]] EntityHandle get_entity_id_by_name(const std::string &group_name, const std::string &entity_name) const;
 
     [[nodiscard]] std::shared_ptr<Entity> get_entity_by_name(const std::string &group_name, const std::string &entity_name) const;
 
@@ -321,14 +934,14 @@ namespace roguely::ecs {
       return get_entity_by_name(entity_group_name_to_string(group_name), entity_name);
     }
 
-    [[nodiscard]] std::shared_ptr<Entity> get_entity_by_id(const std::string &group_name, const std::string &entity_id) const;
+    [[nodiscard]] std::shared_ptr<Entity> get_entity_by_id(const std::string &group_name, EntityHandle entity_id) const;
 
-    [[nodiscard]] std::shared_ptr<Entity> get_entity_by_id(const EntityGroupName group_name, const std::string &entity_id) const {
+    [[nodiscard]] std::shared_ptr<Entity> get_entity_by_id(const EntityGroupName group_name, const EntityHandle entity_id) const {
       return get_entity_by_id(entity_group_name_to_string(group_name), entity_id);
     }
 
     template<typename T>
-    auto find_entities_by_component_type(const std::string& entity_group, std::function<bool(std::shared_ptr<T>)> predicate) {
+    auto find_entities_by_component_type(const std::string& entity_group, std::function<bool(const T &)> predicate) {
       auto group = get_entity_group(entity_group);
 
       std::vector<std::shared_ptr<Entity> > matches{};
@@ -354,26 +967,26 @@ namespace roguely::ecs {
 
     [[nodiscard]] sol::table get_lua_entities() const { return lua_entities; }
 
-    sol::table get_lua_entity(const std::string &entity_group, const std::string &entity_name) {
-      const sol::table entities = lua_entities[entity_group];
-      sol::table result = sol::nil;
-
-      if (!entities.valid()) {
+    [[nodiscard]] sol::table get_lua_entity(const std::string &entity_group, const std::string &entity_name) const {
+      const auto group = get_entity_group(entity_group);
+      if (group == nullptr) {
         fmt::println("get_lua_entity: entities is not valid");
-        return result;
+        return sol::nil;
       }
 
-      entities.for_each([&](const sol::object &key, const sol::table &value) {
-        if (key.is<std::string>()) {
-          if (const auto key_str = key.as<std::string>(); key_str.compare(0, entity_name.size(), entity_name) == 0) {
-            result = value;
-            return false;
-          }
-        }
-        return true;
-      });
+      const auto ids = group->ids_by_name.find(entity_name);
+      if (ids == group->ids_by_name.end())
+        return sol::nil;
 
-      return result;
+      return group->lua_entities[ids->second.front()];
+    }
+
+    [[nodiscard]] sol::table get_lua_entity(const std::string &entity_group, const EntityHandle entity_id) const {
+      const auto group = get_entity_group(entity_group);
+      if (group == nullptr)
+        return sol::nil;
+
+      return group->lua_entities[entity_id];
     }
 
     void remove_lua_component(const std::string &entity_group, const std::string &entity_name,
@@ -395,25 +1008,41 @@ namespace roguely::ecs {
     [[nodiscard]] sol::table get_lua_blocked_points(const std::string &entity_group, int x, int y, const std::string &direction,
                                       sol::this_state s) const;
 
-    sol::table get_lua_entities_in_viewport(const std::function<bool(int x, int y)> &predicate, sol::this_state s) const;
+    sol::table get_lua_entities_in_viewport(const roguely::common::Rect &viewport, sol::this_state s) const;
+
+    // Runs query against the spatial index, limited to group_name if there is one, and hands the hits back as a list
+    // of { id, group_name, name, x, y }
+    sol::table query_lua_entities(const sol::optional<std::string> &group_name,
+                                  const std::function<void(std::vector<SpatialIndex::Entry> &, std::optional<GroupId>)> &
+                                  query, sol::this_state s) const;
 
     static sol::table copy_table(const sol::table &original, sol::this_state s) {
       sol::state_view lua(original.lua_state());
       sol::table copy = lua.create_table();
 
-      original.for_each([&](const sol::object &key, const sol::object &value) {
+      const auto copy_field = [&](const sol::object &key, const sol::object &value) {
         if (value.is<sol::table>()) {
           copy[key] = copy_table(value.as<sol::table>(), s);
         } else {
           copy[key] = value;
         }
-      });
+      };
+
+      if (const auto fields = get_proxied_fields(original); !(fields == original))
+        fields.for_each(copy_field);
+      original.for_each(copy_field);
 
       return copy;
     }
 
   private:
+    static void index_entity(EntityGroup &group, const std::shared_ptr<Entity> &e);
+
+    // Declared first so it outlives the entities in the groups
+    std::unique_ptr<ComponentStorage> storage{};
     std::unique_ptr<std::vector<std::shared_ptr<EntityGroup> > > entity_groups{};
+    std::unique_ptr<std::unordered_map<std::string, GroupId> > group_ids{};
+    std::unique_ptr<SpatialIndex> spatial_index{};
     sol::table lua_entities{};
   };
 }
@@ -450,18 +1079,7 @@ namespace roguely::components {
     void set_properties(const sol::table &props, sol::this_state s) { properties = props; }
 
     static sol::table copy_table(const sol::table &original, const sol::this_state s) {
-      sol::state_view lua(original.lua_state());
-      sol::table copy = lua.create_table();
-
-      original.for_each([&](const sol::object &key, const sol::object &value) {
-        if (value.is<sol::table>()) {
-          copy[key] = copy_table(value.as<sol::table>(), s);
-        } else {
-          copy[key] = value;
-        }
-      });
-
-      return copy;
+      return roguely::ecs::EntityManager::copy_table(original, s);
     }
 
   private:
@@ -522,13 +1140,432 @@ namespace roguely::sprites {
 }
 
 namespace roguely::map {
+  // A square piece of a chunked map. Cells are row major, chunk_size * chunk_size.
+  struct MapChunk {
+    int chunk_x{};
+    int chunk_y{};
+    std::vector<std::uint8_t> cells{};
+    bool dirty{}; // changed since it was generated or paged in
+    std::uint64_t last_used{};
+  };
+
+  // Backs maps that are too big to keep in memory. Chunks are generated on
+  // demand from the map seed with the same cellular automaton as a regular map
+  // (and come out identical to it), only a bounded number are kept resident and
+  // cold chunks are dropped. Chunks that were changed are paged out to disk
+  // first, everything else is just regenerated when it's needed again.
+  class ChunkStore {
+  public:
+    ChunkStore(std::string name, int world_width, int world_height, std::uint64_t seed, int chunk_size,
+               std::size_t max_resident_chunks, int passes = 10);
+
+    ~ChunkStore();
+
+    ChunkStore(const ChunkStore &) = delete;
+
+    ChunkStore &operator=(const ChunkStore &) = delete;
+
+    // Out of bounds cells are walls
+    int get_cell(int x, int y);
+
+    void set_cell(int x, int y, int value);
+
+    // Only looks at chunks that are already resident, never loads anything
+    [[nodiscard]] std::optional<int> peek_cell(int x, int y) const;
+
+    // Calls fn(x, y, cell) for every cell of every resident chunk, in no particular order
+    void for_each_resident_cell(const std::function<void(int x, int y, int cell)> &fn) const;
+
+    // Loads every chunk overlapping the rectangle (map cells, end exclusive) plus
+    // a ring of one chunk around it and keeps those resident until the next call
+    void stream_region(int x, int y, int end_x, int end_y);
+
+    [[nodiscard]] auto get_chunk_size() const { return chunk_size; }
+    [[nodiscard]] auto get_resident_chunk_count() const { return chunks.size(); }
+    [[nodiscard]] auto get_max_resident_chunks() const { return max_resident_chunks; }
+
+  private:
+    MapChunk &get_chunk(int chunk_x, int chunk_y);
+
+    void generate_chunk(MapChunk &chunk) const;
+
+    void evict_cold_chunks();
+
+    [[nodiscard]] std::filesystem::path get_chunk_path(int chunk_x, int chunk_y) const;
+
+    [[nodiscard]] bool is_pinned(const MapChunk &chunk) const {
+      return chunk.chunk_x >= pinned_begin.x && chunk.chunk_x < pinned_end.x &&
+             chunk.chunk_y >= pinned_begin.y && chunk.chunk_y < pinned_end.y;
+    }
+
+    static std::uint64_t chunk_key(const int chunk_x, const int chunk_y) {
+      return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(chunk_x)) << 32) | static_cast<std::uint32_t>(chunk_y);
+    }
+
+    std::string name{};
+    int world_width{};
+    int world_height{};
+    std::uint64_t seed{};
+    int chunk_size{};
+    std::size_t max_resident_chunks{};
+    int passes{};
+    std::filesystem::path page_directory{};
+
+    std::unordered_map<std::uint64_t, std::unique_ptr<MapChunk> > chunks{};
+    std::set<std::uint64_t> paged_out_chunks{};
+    MapChunk *last_chunk{};
+    std::uint64_t use_counter{};
+    bool page_out_failed{};
+    common::Point pinned_begin{};
+    common::Point pinned_end{};
+  };
+
+  // What draw_map uses to draw cells natively
+  struct TileSprites {
+    std::shared_ptr<sprites::SpriteSheet> sprite_sheet{};
+    std::array<int, 256> sprite_ids{}; // by cell id, -1 draws nothing
+    // Color mod by light value (0 = never seen, 1 = visible, 2 = explored), cells
+    // without one aren't drawn
+    std::array<std::optional<SDL_Color>, 3> tints{};
+  };
+
+  // Passable cells that nothing is standing on, kept in a dense array so one can
+  // be picked at random in O(1). Cells are swap-removed, slots says where each
+  // cell is in the array (-1 when it isn't).
+  class FreeCellIndex {
+  public:
+    FreeCellIndex() = default;
+
+    FreeCellIndex(const int w, const int h)
+      : width(w), passable(w, h), slots(w, h, -1), occupancy(w, h, 0) {
+    }
+
+    void set_passable(int x, int y, bool value);
+
+    // Counts, so several entities can share a cell
+    void occupy(int x, int y);
+    void vacate(int x, int y);
+    void clear_occupancy();
+
+    [[nodiscard]] bool is_free(const int x, const int y) const { return slots(y, x) >= 0; }
+    [[nodiscard]] bool is_occupied(const int x, const int y) const { return occupancy(y, x) != 0; }
+    [[nodiscard]] std::optional<common::Point> get_random_cell(common::Xoshiro256 &rng) const;
+    [[nodiscard]] std::size_t size() const { return cells.size(); }
+    [[nodiscard]] bool empty() const { return width == 0; }
+    // y * width + x of every free cell, in no particular order
+    [[nodiscard]] const std::vector<std::uint32_t> &get_cells() const { return cells; }
+
+  private:
+    void insert(int x, int y);
+    void erase(int x, int y);
+
+    int width{};
+    common::BitGrid passable{};
+    std::vector<std::uint32_t> cells{};
+    common::TileGrid<std::int32_t> slots{};
+    common::TileGrid<std::uint16_t> occupancy{};
+  };
+
+  // Constraints for placing a batch of entities. Points in the batch are at
+  // least min_distance apart and at least avoid_distance away from avoid. Keeping
+  // away from entities that are already placed is up to the caller's is_taken.
+  struct SpawnOptions {
+    int min_distance{1};
+    // -1 means the largest region
+    std::int32_t region{-1};
+    std::optional<common::Point> avoid{};
+    int avoid_distance{};
+  };
+
+  enum class PathAlgorithm {
+    A_STAR,
+    // Jump point search, skips over runs of cells that every shortest path
+    // would treat the same. Same cost paths as A*, far fewer expansions on open
+    // maps. Only used for diagonal searches, 4-connected ones fall back to A*.
+    JUMP_POINT
+  };
+
+  struct PathOptions {
+    PathAlgorithm algorithm{PathAlgorithm::A_STAR};
+    // 8-connected rather than 4, diagonal moves can't cut corners
+    bool diagonal{};
+  };
+
+  // A* over a grid. The search state lives in flat arrays that are kept between
+  // searches and stamped with a generation rather than cleared, so a search only
+  // costs as much as the cells it looks at.
+  class AStar {
+  public:
+    AStar() = default;
+
+    // Finds a path from start to goal (both x, y) that stays inside bounds. The
+    // path includes both ends and is empty if there isn't one.
+    std::vector<common::Point> find_path(const common::Rect &bounds, common::Point start, common::Point goal,
+                                         const std::function<bool(int x, int y)> &is_walkable,
+                                         const PathOptions &options = {});
+
+    // Cells that aren't 0 are walkable
+    std::vector<common::Point> find_path(const common::TileGrid<std::uint8_t> &grid, common::Point start,
+                                         common::Point goal, const PathOptions &options = {});
+
+    [[nodiscard]] auto get_nodes_expanded() const { return nodes_expanded; }
+
+  private:
+    struct OpenNode {
+      int f;
+      int h;
+      std::uint32_t index;
+    };
+
+    // Ties go to the node closer to the goal
+    static bool before(const OpenNode &a, const OpenNode &b) { return a.f < b.f || (a.f == b.f && a.h < b.h); }
+
+    void prepare(std::size_t cell_count);
+    void push(OpenNode node);
+    OpenNode pop();
+
+    std::vector<common::Point> search(common::Point start, const PathOptions &options);
+
+    // Only valid during a search
+    [[nodiscard]] bool is_open(const int x, const int y) const {
+      return x >= bounds.point.x && y >= bounds.point.y && x < bounds.point.x + bounds.size.width &&
+             y < bounds.point.y + bounds.size.height && (grid != nullptr ? (*grid)(y, x) != 0 : (*walkable)(x, y));
+    }
+
+    // The directions worth jumping in from a node, pruned by the way we came in
+    int get_jump_directions(int x, int y, int px, int py, std::array<std::pair<int, int>, 8> &directions) const;
+    [[nodiscard]] std::optional<common::Point> jump(int x, int y, int dx, int dy) const;
+
+    static constexpr int BLOCKED = -1;
+    // Costs are in tenths so diagonals can cost 14
+    static constexpr int STRAIGHT_COST = 10;
+    static constexpr int DIAGONAL_COST = 14;
+    static constexpr std::array<std::pair<int, int>, 8> DIRECTIONS{
+      {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1}}
+    };
+
+    // Only entries stamped with the current generation mean anything
+    std::vector<std::uint32_t> stamps{};
+    std::vector<int> costs{};
+    std::vector<std::int32_t> parents{};
+    // 4-ary min heap
+    std::vector<OpenNode> open{};
+    std::uint32_t generation{};
+    std::size_t nodes_expanded{};
+
+    // What the current search is over
+    common::Rect bounds{};
+    common::Point goal{};
+    bool diagonal{};
+    // Grids are read directly, jump point search looks at a lot of cells
+    const common::TileGrid<std::uint8_t> *grid{};
+    const std::function<bool(int x, int y)> *walkable{};
+  };
+
+  // Runs A* and jump point search (8-connected) over the same random queries on
+  // generated cave maps, checks every path is walkable and that both cost the
+  // same, and prints the timings. Returns non zero if any pair disagreed. This
+  // is what `roguely --bench-paths [seed]` runs.
+  int bench_paths(std::uint64_t seed);
+
+  // Hierarchical pathfinding (HPA*). The map is cut into square clusters and
+  // wherever two clusters meet with open cells on both sides there's an
+  // entrance, a node on each side. The distances between the nodes of a cluster
+  // are worked out up front, so a long search only walks from entrance to
+  // entrance and the path is filled in a cluster at a time afterwards. Paths
+  // can come out a little longer than the shortest one.
+  class PathHierarchy {
+  public:
+    static constexpr int DEFAULT_CLUSTER_SIZE = 16;
+
+    explicit PathHierarchy(const int size = DEFAULT_CLUSTER_SIZE) : cluster_size(size) {
+    }
+
+    [[nodiscard]] bool is_built() const { return !clusters.empty(); }
+
+    // With a pool the clusters are worked out in parallel. Maps build theirs when
+    // they're generated so the first long search doesn't have to
+    void build(const common::TileGrid<std::uint8_t> &grid, common::WorkerPool *pool = nullptr);
+
+    // Only the clusters around a changed cell get rebuilt, and not until the
+    // next search
+    void mark_dirty(int x, int y);
+
+    // Cells that aren't 0 are walkable, built here if it wasn't already
+    std::vector<common::Point> find_path(const common::TileGrid<std::uint8_t> &grid, common::Point start,
+                                         common::Point goal);
+
+    [[nodiscard]] auto get_cluster_size() const { return cluster_size; }
+    [[nodiscard]] auto get_node_count() const { return node_count; }
+    [[nodiscard]] auto get_nodes_expanded() const { return nodes_expanded; }
+
+  private:
+    enum Side { LEFT, RIGHT, TOP, BOTTOM };
+
+    struct Cluster {
+      common::Rect bounds{};
+      std::vector<common::Point> nodes{};
+      // Where each side's nodes start, the last one is the node count
+      std::array<int, 5> side_offsets{};
+      // nodes x nodes
+      std::vector<int> distances{};
+    };
+
+    struct OpenNode {
+      int f;
+      int g;
+      int node;
+    };
+
+    // BFS scratch, one per thread while building
+    struct Flood {
+      std::vector<int> distances{};
+      std::vector<int> queue{};
+    };
+
+    void build_border(const common::TileGrid<std::uint8_t> &grid, int cx, int cy, bool vertical);
+    void build_cluster(const common::TileGrid<std::uint8_t> &grid, int cx, int cy, Flood &scratch);
+    void rebuild_dirty(const common::TileGrid<std::uint8_t> &grid);
+    void update_node_ids();
+
+    // BFS from a cell that doesn't leave its cluster, the results go in scratch
+    static void flood_cluster(const common::TileGrid<std::uint8_t> &grid, const common::Rect &bounds,
+                              common::Point from, Flood &scratch);
+    [[nodiscard]] static int flood_distance(const common::Rect &bounds, const common::Point p, const Flood &scratch) {
+      return scratch.distances[(p.y - bounds.point.y) * bounds.size.width + (p.x - bounds.point.x)];
+    }
+
+    [[nodiscard]] int cluster_index_of(const common::Point p) const {
+      return p.y / cluster_size * clusters_across + p.x / cluster_size;
+    }
+
+    // The node on the other side of an entrance
+    [[nodiscard]] int get_twin(int cluster_index, int local) const;
+
+    static constexpr int UNREACHABLE = INT_MAX;
+    // Runs of open cells at least this long get an entrance at both ends
+    static constexpr int WIDE_ENTRANCE = 6;
+
+    int cluster_size;
+    int width{};
+    int height{};
+    int clusters_across{};
+    int clusters_down{};
+    std::vector<Cluster> clusters{};
+    // Entrances between (cx, cy) and (cx + 1, cy), stored as the cell on the left
+    std::vector<std::vector<common::Point> > vertical_borders{};
+    // Entrances between (cx, cy) and (cx, cy + 1), stored as the cell on top
+    std::vector<std::vector<common::Point> > horizontal_borders{};
+    std::vector<std::uint8_t> dirty{};
+    bool has_dirty{};
+
+    // Nodes are numbered cluster by cluster
+    std::vector<int> node_bases{};
+    std::vector<int> node_clusters{};
+    int node_count{};
+
+    // Search scratch, stamped like AStar's
+    Flood flood{};
+    std::vector<int> costs{};
+    std::vector<int> parents{};
+    std::vector<std::uint32_t> stamps{};
+    std::uint32_t generation{};
+    std::vector<OpenNode> open{};
+    AStar refiner{};
+    std::size_t nodes_expanded{};
+  };
+
+  // Paths found on one map, kept until the map changes. A query for a goal
+  // that was searched for before, from somewhere along that path, gets the rest
+  // of the path back rather than a new search. Paths are kept up to a budget of
+  // cells in all, the least recently used go first.
+  class PathCache {
+  public:
+    struct Stats {
+      std::size_t hits{};
+      std::size_t partial_hits{};
+      std::size_t misses{};
+      std::size_t invalidations{};
+    };
+
+    // mode tells apart paths that were searched for in different ways, version
+    // is the map's and everything is dropped when it changes
+    [[nodiscard]] std::optional<std::vector<common::Point> > find(std::uint64_t map_version, common::Point start,
+                                                                  common::Point goal, int mode);
+    void store(std::uint64_t map_version, common::Point start, common::Point goal, int mode,
+               const std::vector<common::Point> &path);
+    void clear();
+
+    [[nodiscard]] const Stats &get_stats() const { return stats; }
+    [[nodiscard]] std::size_t size() const { return entries.size(); }
+    [[nodiscard]] std::size_t get_cell_count() const { return cell_count; }
+
+  private:
+    struct Key {
+      int start_x;
+      int start_y;
+      int goal_x;
+      int goal_y;
+      int mode;
+
+      bool operator==(const Key &) const = default;
+    };
+
+    struct KeyHash {
+      std::size_t operator()(const Key &key) const {
+        auto hash = static_cast<std::uint64_t>(static_cast<std::uint32_t>(key.start_x)) << 32 |
+                    static_cast<std::uint32_t>(key.start_y);
+        hash ^= common::splitmix64(static_cast<std::uint64_t>(static_cast<std::uint32_t>(key.goal_x)) << 32 |
+                                   static_cast<std::uint32_t>(key.goal_y)) + static_cast<std::uint64_t>(key.mode);
+        return static_cast<std::size_t>(common::splitmix64(hash));
+      }
+    };
+
+    struct Entry {
+      Key key{};
+      std::vector<common::Point> path{};
+    };
+    using Entries = std::list<Entry>;
+
+    void check_version(std::uint64_t map_version);
+    void erase(Entries::iterator entry);
+
+    // Keyed with the start left at 0, 0
+    static Key goal_key(const Key &key) { return {0, 0, key.goal_x, key.goal_y, key.mode}; }
+    // Empty paths still cost something to keep
+    static std::size_t cells_of(const Entry &entry) { return std::max<std::size_t>(entry.path.size(), 1); }
+
+    // About 8MB of points
+    static constexpr std::size_t MAX_CELLS = std::size_t{1} << 20;
+
+    std::uint64_t version{};
+    // Most recently used first, every path is only stored here
+    Entries entries{};
+    std::unordered_map<Key, Entries::iterator, KeyHash> paths{};
+    // The latest path to each goal
+    std::unordered_map<Key, Entries::iterator, KeyHash> goal_paths{};
+    std::size_t cell_count{};
+    Stats stats{};
+  };
+
+  class DistanceField;
+
+  // Minimap colors are packed RGBA8888, the same as the minimap texture
+  struct MinimapColors {
+    std::array<std::uint32_t, 256> palette{}; // by cell id
+    std::optional<std::uint32_t> unexplored{}; // everything is shown without one
+  };
+
   class Map {
   public:
     Map() = default;
 
-    Map(std::string n, int w, int h, const std::shared_ptr<boost::numeric::ublas::matrix<int> > &m)
-      : name(std::move(n)), width(w), height(h), map(m),
-        light_map(std::make_shared<boost::numeric::ublas::matrix<int> >(h, w, 0)) {
+    Map(std::string n, int w, int h, const std::shared_ptr<common::TileGrid<std::uint8_t> > &m)
+      : name(std::move(n)), width(w), height(h), map(m), explored(w, h) {
+    };
+
+    Map(std::string n, int w, int h, const std::shared_ptr<ChunkStore> &c)
+      : name(std::move(n)), width(w), height(h), chunks(c) {
     };
 
     void draw_map(SDL_Renderer *renderer,
@@ -536,16 +1573,69 @@ namespace roguely::map {
                   const std::shared_ptr<sprites::SpriteSheet> &sprite_sheet,
                   const std::function<void(int, int, int, int, int, int, int)> &draw_hook);
 
+    // Draws with the tile sprites, no hook needed
+    void draw_map(SDL_Renderer *renderer, const common::Dimension &dimensions);
+
     void draw_map(SDL_Renderer *renderer, const common::Dimension &dimensions, int x, int y, int a,
                   const std::function<void(int, int, int)> &draw_hook);
 
-    void calculate_field_of_view(const common::Dimension &dimensions);
+    // One pixel per cell, only the cells that changed are written to the texture
+    void draw_minimap(SDL_Renderer *renderer, int x, int y, int a);
+
+    void set_minimap_colors(const MinimapColors &c) {
+      minimap_colors = c;
+      mark_minimap_dirty(0, 0);
+      mark_minimap_dirty(width - 1, height - 1);
+    }
+
+    void set_tile_sprites(TileSprites t) {
+      tile_sprites = std::move(t);
+      trigger_redraw();
+    }
+
+    [[nodiscard]] bool has_tile_sprites() const { return tile_sprites.sprite_sheet != nullptr; }
+
+    // A radius of 0 lights everything in view
+    void calculate_field_of_view(const common::Dimension &dimensions, int radius = 0);
 
     [[nodiscard]] auto get_name() const { return name; }
     [[nodiscard]] auto get_width() const { return width; }
     [[nodiscard]] auto get_height() const { return height; }
     [[nodiscard]] auto get_map() const { return map; }
-    [[nodiscard]] auto get_light_map() const { return light_map; }
+    [[nodiscard]] const auto &get_light_map() const { return light_map; }
+    [[nodiscard]] auto get_chunks() const { return chunks; }
+    [[nodiscard]] bool is_chunked() const { return chunks != nullptr; }
+
+    // Not const, on a chunked map this can page chunks in and out (and write them to disk). Like the rest of the map
+    // it's main thread only, find_paths copies what the workers need before handing it over
+    [[nodiscard]] int get_cell(const int x, const int y) {
+      return chunks != nullptr ? chunks->get_cell(x, y) : (*map)(y, x);
+    }
+
+    void set_cell(int x, int y, int value);
+
+    // The light map only covers the viewport it was last calculated for
+    [[nodiscard]] int get_light_cell(const int x, const int y) const {
+      const int lx = x - light_origin.x;
+      const int ly = y - light_origin.y;
+      if (!light_map.contains(ly, lx))
+        return 0;
+      return light_map(ly, lx);
+    }
+
+    [[nodiscard]] bool is_visible(const int x, const int y) const { return get_light_cell(x, y) == 1; }
+
+    // Everything that has ever been in the field of view
+    [[nodiscard]] bool is_explored(int x, int y) const;
+    [[nodiscard]] auto get_explored_count() const { return explored_count; }
+
+    // Areas that have been explored since this was last called
+    [[nodiscard]] std::vector<common::Rect> take_explored_regions() { return std::exchange(explored_regions, {}); }
+
+    [[nodiscard]] std::vector<common::Point> get_visible_points() const;
+
+    // Chunked maps only, keeps the chunks around the viewport resident
+    void stream_chunks(const common::Dimension &dimensions) const;
 
     static auto map_to_world(const int x, const int y, const common::Dimension &dimensions,
                              const std::shared_ptr<sprites::SpriteSheet>& sprite_sheet) {
@@ -577,51 +1667,229 @@ namespace roguely::map {
     //   return roguely::common::Point{dx, dy};
     // }
 
-    [[nodiscard]] common::Point get_random_point(const std::set<int> &off_limit_sprites_ids) const;
+    // Optionally restricted to one region, region 0 means anywhere
+    [[nodiscard]] common::Point get_random_point(const std::set<int> &off_limit_sprites_ids, common::Xoshiro256 &rng,
+                                                 std::int32_t region = 0);
 
-    void trigger_redraw() { current_map_segment_dimension = {}; }
+    void set_regions(level_generation::MapRegions r) {
+      regions = std::move(r);
+      regions_dirty = false;
+      free_cells = {};
+    }
+    // Regions are relabelled the first time they're asked for after set_cell changed the map, so ids can change
+    [[nodiscard]] bool has_regions() const { return !regions.labels.empty(); }
+    [[nodiscard]] std::int32_t get_region_id(const int x, const int y) {
+      update_regions();
+      return regions.get_region(x, y);
+    }
+    [[nodiscard]] int get_region_count() {
+      update_regions();
+      return regions.get_region_count();
+    }
+    [[nodiscard]] std::int32_t get_largest_region() {
+      update_regions();
+      return regions.largest;
+    }
+
+    // Free cells are floor in the largest region that no entity is on. They are
+    // only tracked for regular maps, chunked maps get nothing back.
+    [[nodiscard]] std::optional<common::Point> get_random_free_point(common::Xoshiro256 &rng);
+    [[nodiscard]] bool is_free(int x, int y);
+    [[nodiscard]] bool is_occupied(int x, int y);
+    void occupy(int x, int y);
+    void vacate(int x, int y);
+    void clear_occupancy();
+
+    // Up to count points that meet the options, is_taken says which cells can't be
+    // used. Regular maps draw from the free cells and only go through all of them
+    // (or the whole map, for a region other than the largest) if random draws don't
+    // fill the batch. Chunked maps try random points.
+    [[nodiscard]] std::vector<common::Point> get_spawn_points(int count, const SpawnOptions &options,
+                                                            common::Xoshiro256 &rng,
+                                                            const std::function<bool(int x, int y)> &is_taken);
+
+    // Regular maps search the whole map, chunked maps search the box around start
+    // and goal padded by a chunk on each side
+    [[nodiscard]] std::vector<common::Point> find_path(AStar &astar, common::Point start, common::Point goal,
+                                                       const PathOptions &options = {});
+
+    // Bumped every time a cell changes
+    [[nodiscard]] auto get_version() const { return version; }
+    [[nodiscard]] PathCache &get_path_cache() { return path_cache; }
+
+    // Searches the cluster graph of a regular map rather than every cell, long
+    // paths are much cheaper this way. Chunked maps use find_path instead.
+    [[nodiscard]] std::vector<common::Point> find_long_path(common::Point start, common::Point goal);
+
+    // Builds the cluster graph find_long_path uses up front. Nothing for chunked maps
+    void build_path_hierarchy(common::WorkerPool *pool);
+
+    // Runs every query on the worker pool, each worker with its own AStar. The
+    // results come back in the same order as the queries. Chunked maps copy out
+    // the box each query needs, up to 4M cells in all, and search whatever
+    // doesn't fit on the calling thread.
+    [[nodiscard]] std::vector<std::vector<common::Point> > find_paths(
+      const std::vector<std::pair<common::Point, common::Point> > &queries, common::WorkerPool &pool,
+      const PathOptions &options = {});
+
+    // Fills field with the distance to the nearest source, out to max_distance
+    // (0 means no limit). Chunked maps are limited to a chunk when there's no
+    // max_distance.
+    void compute_distance_field(DistanceField &field, const std::vector<common::Point> &sources,
+                                int max_distance = 0);
+
+    [[nodiscard]] bool is_reachable(const common::Point from, const common::Point to) {
+      const auto region = get_region_id(from.x, from.y);
+      return region != 0 && region == get_region_id(to.x, to.y);
+    }
+
+    // Redraws the whole viewport the next time it is drawn
+    void trigger_redraw() { redraw_all = true; }
+
+    // Redraws just one cell the next time the viewport is drawn
+    void redraw_cell(const int x, const int y) {
+      if (redraw_all)
+        return;
+
+      // Past a point it's cheaper to just draw everything
+      if (dirty_cells.size() >= MAX_DIRTY_CELLS) {
+        dirty_cells.clear();
+        redraw_all = true;
+      } else
+        dirty_cells.push_back({x, y});
+    }
 
-    [[nodiscard]] auto is_point_blocked(const int x, const int y) const { return (*map)(y, x) == 0; }
+    [[nodiscard]] auto is_point_blocked(const int x, const int y) { return get_cell(x, y) == 0; }
 
   private:
+    static constexpr int EXPLORED_TILE_SIZE = 64;
+    static constexpr std::size_t MAX_DIRTY_CELLS = 4096;
+
+    // Keeps the viewport texture up to date, draw_cell is handed each cell that
+    // needs drawing along with where its slot is in the texture
+    void draw_map_segment(SDL_Renderer *renderer, const common::Dimension &dimensions, common::Size cell_size,
+                          const std::function<void(int, int, int, int)> &draw_cell);
+
+    // 1 = visible, 2 = explored before but not visible now
+    [[nodiscard]] int get_light_value(int x, int y) const;
+
+    [[nodiscard]] bool is_spawnable(int x, int y);
+
+    // Relabels the regions if a cell changed since they were last worked out
+    void update_regions();
+
+    // The part of a chunked map a path search is allowed to look at
+    [[nodiscard]] common::Rect get_path_bounds(common::Point start, common::Point goal) const;
+
+    // Built the first time it's needed
+    FreeCellIndex &get_free_cells();
+
+    void mark_minimap_dirty(const int x, const int y) {
+      minimap_dirty_min = {std::min(minimap_dirty_min.x, x), std::min(minimap_dirty_min.y, y)};
+      minimap_dirty_max = {std::max(minimap_dirty_max.x, x), std::max(minimap_dirty_max.y, y)};
+    }
+
+    // Returns true if the cell hadn't been explored before
+    bool mark_explored(int x, int y);
+
+    // The viewport is drawn into a texture that wraps around in both
+    // directions, a cell always lands in the same slot (its position modulo the
+    // viewport size). Scrolling only has to draw the row or column that came
+    // into view and everything else is just dirty cells.
+    SDL_Texture *current_map_segment_texture{};
+    common::Size map_segment_cells{};
+    common::Size map_segment_cell_size{};
+    common::Point map_segment_origin{};
+    std::vector<common::Point> dirty_cells{};
+    bool redraw_all{true};
+    TileSprites tile_sprites{};
+
+    SDL_Texture *minimap_texture{};
+    common::TileGrid<std::uint32_t> minimap_pixels{};
+    MinimapColors minimap_colors{};
+    common::Point minimap_dirty_min{INT_MAX, INT_MAX};
+    common::Point minimap_dirty_max{-1, -1};
+
     // This is our jank optimization for preventing us from creating a new
     // SDL_Texture every frame if nothing has changed. This is used in draw_map.
-    roguely::common::Dimension current_map_segment_dimension{};
     roguely::common::Dimension current_full_map_dimension{};
-    SDL_Texture *current_map_segment_texture{};
     SDL_Texture *current_full_map_texture{};
 
     std::string name{};
     int width{};
     int height{};
-    std::shared_ptr<boost::numeric::ublas::matrix<int> > map{};
-    std::shared_ptr<boost::numeric::ublas::matrix<int> > light_map{};
-  };
-
-  struct MapInfo {
-    std::string name{};
-    std::shared_ptr<roguely::map::Map> map{};
+    std::shared_ptr<common::TileGrid<std::uint8_t> > map{};
+    std::shared_ptr<ChunkStore> chunks{};
+    common::TileGrid<std::uint8_t> light_map{};
+    std::vector<std::uint32_t> lit_cells{}; // indexes into light_map, so clearing it is cheap
+    std::vector<std::uint32_t> previously_lit_cells{};
+    common::Point fov_origin{-1, -1};
+    // Chunked maps can be far too big for one bit per cell so they only keep
+    // tiles that have had something explored in them
+    common::BitGrid explored{};
+    std::unordered_map<std::uint64_t, common::BitGrid> explored_tiles{};
+    std::vector<common::Rect> explored_regions{};
+    std::size_t explored_count{};
+    common::Point light_origin{};
+    level_generation::MapRegions regions{};
+    bool regions_dirty{};
+    FreeCellIndex free_cells{};
+    PathHierarchy hierarchy{};
+    std::uint64_t version{};
+    PathCache path_cache{};
   };
 
-  class AStar {
+  // A "Dijkstra map": the number of steps from every cell to the nearest of a set
+  // of sources. One sweep serves every mob heading for (or away from) the same
+  // thing, they just keep stepping downhill with next_step.
+  class DistanceField {
   public:
-    AStar() = default;
+    static constexpr int UNREACHABLE = INT_MAX;
+
+    DistanceField() = default;
+
+    // Multi-source BFS, cells further than max_distance (when it isn't 0) are
+    // left unreachable
+    void compute(const common::Rect &bounds, const std::vector<common::Point> &sources, int max_distance,
+                 const std::function<bool(int x, int y)> &is_walkable);
+
+    // Turns a field into one for running away. Distances are scaled by -1.2 and
+    // then smoothed, so following it leads past the sources towards open space
+    // rather than into the nearest dead end.
+    void compute_flee(const DistanceField &field);
 
-    [[nodiscard]] std::vector<std::pair<int, int> > FindPath(const boost::numeric::ublas::matrix<int> &grid, int start_row,
-                                               int start_col, int goal_row, int goal_col) const;
+    [[nodiscard]] int get_distance(int x, int y) const;
+
+    // The neighbor with the lowest distance as long as it's lower than here,
+    // can_enter (if given) can rule cells out
+    [[nodiscard]] std::optional<common::Point> next_step(int x, int y,
+                                                         const std::function<bool(int x, int y)> &can_enter = {}) const;
 
   private:
-    // Heuristic function for estimating the distance between two points
-    static int heuristic(const int x1, const int y1, const int x2, const  int y2) {
-      return std::abs(x1 - x2) + std::abs(y1 - y2);
+    void prepare(const common::Rect &b);
+    [[nodiscard]] bool contains(const int x, const int y) const {
+      return x >= bounds.point.x && y >= bounds.point.y && x < bounds.point.x + bounds.size.width &&
+             y < bounds.point.y + bounds.size.height;
+    }
+    [[nodiscard]] std::size_t index_of(const int x, const int y) const {
+      return static_cast<std::size_t>(y - bounds.point.y) * bounds.size.width + (x - bounds.point.x);
     }
 
-    // Define the possible movements (up, down, left, right)
-    const int dx[4] = {-1, 1, 0, 0};
-    const int dy[4] = {0, 0, -1, 1};
+    static constexpr std::array<std::pair<int, int>, 4> DIRECTIONS{{{0, -1}, {0, 1}, {-1, 0}, {1, 0}}};
+
+    common::Rect bounds{};
+    // Like AStar, only entries stamped with the current generation are set
+    std::vector<int> distances{};
+    std::vector<std::uint32_t> stamps{};
+    std::uint32_t generation{};
+    // Every cell that was reached, in the order it was reached
+    std::vector<std::uint32_t> reached{};
+    std::vector<std::vector<std::uint32_t> > buckets{};
+  };
 
-    // Define a typedef for the priority queue entry
-    typedef std::pair<int, std::pair<int, int> > pq_entry;
+  struct MapInfo {
+    std::string name{};
+    std::shared_ptr<roguely::map::Map> map{};
   };
 }
 
@@ -630,6 +1898,9 @@ namespace roguely::engine {
   public:
     Engine();
 
+    // Map jobs still running use the worker pool, they have to finish before it goes
+    ~Engine() { wait_for_pending_maps(); }
+
     int game_loop();
 
   private:
@@ -666,7 +1937,126 @@ namespace roguely::engine {
     static void draw_graphic(SDL_Renderer *renderer, const std::string &path, int window_width, int x, int y, bool centered,
                              int scale_factor);
 
-    static std::shared_ptr<map::Map> generate_map(const std::string &name, int map_width, int map_height);
+    [[nodiscard]] std::shared_ptr<map::Map> generate_map(const std::string &name, int map_width, int map_height,
+                                                         std::uint64_t seed,
+                                                         const level_generation::RegionOptions &region_options = {}) const;
+
+    static level_generation::RegionOptions get_region_options(const sol::optional<sol::table> &options);
+
+    // Generates on the worker pool, the map is registered once it is collected
+    // with collect_pending_map (which the game loop also does every frame)
+    int generate_map_async(const std::string &name, int map_width, int map_height, std::uint64_t seed,
+                           const level_generation::RegionOptions &region_options = {});
+
+    // A handle stays ready after its map is registered, only handles that are
+    // still generating are kept around
+    bool collect_pending_map(int handle, bool wait);
+
+    void collect_pending_maps();
+
+    void wait_for_pending_maps();
+
+    void register_map(const std::shared_ptr<map::Map> &map) const;
+
+    static std::shared_ptr<map::Map> generate_chunked_map(const std::string &name, int map_width, int map_height,
+                                                          std::uint64_t seed, int chunk_size, int max_resident_chunks);
+
+    // Draws entities from the given groups that are in view, on top of the map
+    void draw_map_entities(const std::vector<std::string> &group_names);
+
+    // The free cells of the current map track entities that go through
+    // add_entity, remove_entity and move_entity. They are caught up from every
+    // entity's position whenever the current map changes.
+    void sync_free_cells();
+
+    static std::optional<common::Point> get_entity_position(const sol::table &components);
+
+    // Moves a Lua entity table, keeping the free cells and spatial index in step
+    void move_entity(const sol::table &entity, int x, int y);
+
+    // Once an entity is in a group, Lua writes to its position_component (or
+    // replacing it) are handed to move_entity rather than going unnoticed
+    void track_position(const std::string &group_name, ecs::EntityHandle id);
+    sol::table make_position_proxy(const std::string &group_name, ecs::EntityHandle id, const sol::table &fields);
+    void set_position_component(const std::string &group_name, ecs::EntityHandle id, const sol::table &components,
+                                const sol::object &value);
+
+    // hierarchical says whether long paths can go through the map's hierarchy,
+    // they can unless another algorithm or diagonal moves are asked for
+    static map::PathOptions get_path_options(const sol::optional<sol::table> &options, bool &hierarchical);
+
+    // Picks the hierarchy or the grid for the current map and goes through its
+    // path cache
+    std::vector<common::Point> find_path(common::Point start, common::Point goal, const map::PathOptions &options,
+                                         bool hierarchical);
+
+    map::SpawnOptions get_spawn_options(const sol::optional<sol::table> &options);
+
+    // Runs now, or at the end of the current system if one is running. Cells for new entities are taken straight
+    // away and cells of removed ones are given back when the removal is applied, so a cell never looks free while
+    // something is still there
+    void defer(std::function<void()> command) {
+      if (deferring)
+        commands.record(std::move(command));
+      else
+        command();
+    }
+
+    // Systems are the sync points, anything they defer is applied once they return. A system called from inside
+    // another leaves its commands for the outer one. Errors from the system or its commands are logged, returns false
+    // if there were any
+    template<typename... Args>
+    bool run_system(const sol::protected_function &system, Args &&... args) {
+      const bool was_deferring = std::exchange(deferring, true);
+      bool ok = true;
+      {
+        // Off the stack before any queued command gets to run Lua
+        const sol::protected_function_result result = system(std::forward<Args>(args)...);
+        if (!result.valid()) {
+          const sol::error err = result;
+          fmt::println("Lua script error: {}", err.what());
+          ok = false;
+        }
+      }
+      deferring = was_deferring;
+
+      if (!deferring)
+        ok = flush_commands() && ok;
+      return ok;
+    }
+
+    // Plays back what systems deferred, a command that throws drops the rest of the queue
+    bool flush_commands();
+
+    // Entities added while a system runs aren't in the spatial index until it returns, their points are kept here
+    // so nothing else gets put on top of them in the meantime
+    void claim_pending_point(const int x, const int y) {
+      if (deferring)
+        pending_points.push_back({x, y});
+    }
+
+    [[nodiscard]] bool is_point_taken(const common::Point point) const {
+      return !entity_manager->lua_is_point_unique(point) ||
+             std::ranges::any_of(pending_points, [&](const common::Point &p) { return p.eq(point); });
+    }
+
+    // Adds count copies of components to a group in one go, returns how many fit
+    int spawn_batch(const std::string &group_name, const std::string &name, const sol::table &components, int count,
+                    const map::SpawnOptions &options, sol::this_state s);
+
+    struct MinimapMarker {
+      std::string group_name{};
+      SDL_Color color{};
+      int size{};
+      bool visible_only{};
+    };
+
+    void draw_minimap_markers(int x, int y, const std::vector<MinimapMarker> &markers);
+
+    // Calls back with each entity in the group that has a position
+    void for_each_positioned_entity(const std::string &group_name,
+                                    const std::function<void(const sol::table &entity, const sol::table &components,
+                                                             int x, int y)> &callback) const;
 
     common::Dimension update_player_viewport(const common::Point player_position,
                                                       const common::Size current_map) {
@@ -684,7 +2074,8 @@ namespace roguely::engine {
       };
 
       if (current_map_info.map != nullptr) {
-        current_map_info.map->calculate_field_of_view(dimensions);
+        current_map_info.map->stream_chunks(dimensions);
+        current_map_info.map->calculate_field_of_view(dimensions, fov_radius);
       }
 
       return {view_port_x, view_port_y, player_position.x, player_position.y, view_port_width, view_port_height};
@@ -695,7 +2086,11 @@ namespace roguely::engine {
         return map->get_name() == name;
       });
 
-      return nullptr;
+      return it != maps->end() ? *it : nullptr;
+    }
+
+    [[nodiscard]] roguely::common::Rect get_viewport_rect() const {
+      return {{view_port_x, view_port_y}, {view_port_width - view_port_x, view_port_height - view_port_y}};
     }
 
     [[nodiscard]] bool is_within_viewport(const int x, const int y) const {
@@ -712,10 +2107,23 @@ namespace roguely::engine {
     int view_port_height{};
     int VIEW_PORT_WIDTH{};
     int VIEW_PORT_HEIGHT{};
+    int fov_radius{};
 
     roguely::common::Dimension current_dimension{};
     roguely::map::MapInfo current_map_info{};
 
+    struct PendingMap {
+      std::string name{};
+      std::future<std::shared_ptr<roguely::map::Map> > map{};
+    };
+
+    std::unordered_map<int, PendingMap> pending_maps{};
+    std::unordered_set<int> failed_maps{};
+    std::weak_ptr<roguely::map::Map> free_cells_map{};
+    roguely::map::AStar path_finder{};
+    std::unordered_map<std::string, roguely::map::DistanceField> distance_fields{};
+    int next_map_handle{1};
+
     SDL_Window *window{};
     SDL_Renderer *renderer{};
     Mix_Music *soundtrack{};
@@ -723,12 +2131,17 @@ namespace roguely::engine {
     // FIXME: Need to have ability to load multiple fonts
     std::weak_ptr<roguely::common::Text> default_font{};
 
+    std::unique_ptr<roguely::common::WorkerPool> worker_pool{};
+    std::unique_ptr<roguely::common::RandomService> random_service{};
     std::unique_ptr<roguely::ecs::EntityManager> entity_manager{};
     std::unique_ptr<std::vector<std::shared_ptr<roguely::common::Sound> > > sounds{};
     std::unique_ptr<std::unordered_map<std::string, std::shared_ptr<roguely::sprites::SpriteSheet> > > sprite_sheets{};
     std::unique_ptr<std::vector<std::shared_ptr<roguely::map::Map> > > maps{};
     std::unique_ptr<std::unordered_map<std::string, std::shared_ptr<roguely::common::Text> > > texts{};
     std::unique_ptr<std::unordered_map<std::string, sol::function> > systems{};
+    roguely::ecs::CommandBuffer commands{};
+    bool deferring{};
+    std::vector<common::Point> pending_points{};
 
     sol::state lua;
   };
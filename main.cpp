@@ -1,11 +1,17 @@
 #include "engine.h"
+#include <string>
+#include <string_view>
 
 int main(int argc, char *argv[])
 {
+  // Checks jump point search against A* and times both, no window needed
+  if (argc > 1 && std::string_view(argv[1]) == "--bench-paths")
+    return roguely::map::bench_paths(argc > 2 ? std::stoull(argv[2]) : 1);
+
   auto engine = std::make_unique<roguely::engine::Engine>();
   engine->game_loop();
 
-  // boost::numeric::ublas::matrix<int> grid(5, 5);
+  // roguely::common::TileGrid<std::uint8_t> grid(5, 5);
 
   // int values[5][5] = {
   //     // 0, 1, 2, 3, 4
@@ -23,16 +29,16 @@ int main(int argc, char *argv[])
   //   }
   // }
 
-  // // Define the start and goal coordinates
-  // int start_col = 2;
-  // int start_row = 2;
-  // int goal_col = 4;
-  // int goal_row = 4;
+  // // Define the start and goal coordinates (x, y)
+  // roguely::common::Point start{2, 2};
+  // roguely::common::Point goal{4, 4};
 
   // roguely::map::AStar astar;
 
-  // // Find the shortest path using A*
-  // std::vector<std::pair<int, int>> path = astar.FindPath(grid, start_row, start_col, goal_row, goal_col);
+  // // Find the shortest path using A*, 0 is open in this grid
+  // std::vector<roguely::common::Point> path = astar.find_path(
+  //     roguely::common::Rect{{0, 0}, {grid.get_width(), grid.get_height()}}, start, goal,
+  //     [&grid](int x, int y) { return grid(y, x) == 0; });
 
   // if (path.size() == 0)
   // {
@@ -41,10 +47,10 @@ int main(int argc, char *argv[])
   // }
 
   // // Print the path
-  // std::cout << "Shortest path from (" << start_row << ", " << start_col << ") to (" << goal_col << ", " << goal_row << "):\n";
+  // std::cout << "Shortest path from (" << start.x << ", " << start.y << ") to (" << goal.x << ", " << goal.y << "):\n";
   // for (const auto &point : path)
   // {
-  //   std::cout << "(" << point.first << ", " << point.second << ") ";
+  //   std::cout << "(" << point.x << ", " << point.y << ") ";
   // }
   // std::cout << std::endl;
   // fmt::print("Path size = {}", path.size());
@@ -423,24 +423,11 @@ Game = {
                 components = {
                     render_component = {
                         render = function(self, game, player, entities, dx, dy)
-                            draw_full_map("level1",
+                            draw_minimap("level1",
                                 Game.window_width - 135,
                                 Game.window_height - 135,
                                 225,
-                                function(dy, dx, cell_id)
-                                    if (cell_id == 0) then
-                                        set_draw_color(128, 128, 128, 255)
-                                        draw_point(dx, dy)
-                                    elseif (cell_id == 1) then
-                                        set_draw_color(0, 0, 0, 255)
-                                        draw_point(dx, dy)
-                                    end
-
-                                    if (dx == player.components.position_component.x and dy == player.components.position_component.y) then
-                                        set_draw_color(0, 255, 0, 255)
-                                        draw_filled_rect(dx - 2, dy - 2, 3, 3)
-                                    end
-                                end)
+                                { { group = "common", color = { 0, 255, 0 }, size = 3 } })
                         end
                     }
                 }
@@ -601,19 +588,11 @@ function spawn_player()
 end
 
 function spawn_coins()
-    for i = 1, 50 do
-        local spawn_point = get_random_point_on_map()
-        Game.entities.items.coin.components.position_component = { x = spawn_point.x, y = spawn_point.y }
-        add_entity("items", "coin", Game.entities.items.coin.components)
-    end
+    spawn_batch("items", "coin", Game.entities.items.coin.components, 50, { min_distance = 3 })
 end
 
 function spawn_health_gems()
-    for i = 1, 25 do
-        local spawn_point = get_random_point_on_map()
-        Game.entities.items.health_gem.components.position_component = { x = spawn_point.x, y = spawn_point.y }
-        add_entity("items", "health_gem", Game.entities.items.health_gem.components)
-    end
+    spawn_batch("items", "health_gem", Game.entities.items.health_gem.components, 25, { min_distance = 5 })
 end
 
 function spawn_mobs()
@@ -688,11 +667,22 @@ function spawn_mobs()
         add_mob_components(key, {x = 0, y = 0})
     end
 
+    local mob_counts = {}
     for i = 1, 50 do
-        local mob_spawn_point = get_random_point_on_map()
-        local mob = get_random_key_from_table(Game.entities.enemies)
-        add_mob_components(mob, mob_spawn_point)
-        add_entity("mobs", mob, Game.entities.enemies[mob].components)
+        local mob = get_random_key_from_table(Game.entities.enemies, "mapgen")
+        mob_counts[mob] = (mob_counts[mob] or 0) + 1
+    end
+
+    -- Sorted so the same seed places the same mobs
+    local mobs = {}
+    for mob, _ in pairs(mob_counts) do
+        table.insert(mobs, mob)
+    end
+    table.sort(mobs)
+
+    for _, mob in ipairs(mobs) do
+        spawn_batch("mobs", mob, Game.entities.enemies[mob].components, mob_counts[mob],
+                { min_distance = 2, min_player_distance = 8 })
     end
 end
 
@@ -703,6 +693,9 @@ end
 
 function spawn_golden_candle()
     local spawn_point = get_random_point_on_map()
+    if spawn_point.x == nil then
+        return
+    end
     Game.entities.items.goldencandle.components.position_component = { x = spawn_point.x, y = spawn_point.y }
     add_entity("items", "goldencandle", Game.entities.items.goldencandle.components)
 end
@@ -784,7 +777,11 @@ function _init()
 
     set_font("large")
 
-    generate_map("level1", Game.map_width, Game.map_height)
+    generate_map("level1", Game.map_width, Game.map_height, { min_region_size = 20, connect_regions = true })
+    set_map_sprites("level1", Game.spritesheet_name,
+        { [0] = Game.sprite_ids.wall, [1] = Game.sprite_ids.floor },
+        { visible = { 255, 255, 255 }, explored = { 64, 64, 64 } })
+    set_minimap_colors("level1", { [0] = { 128, 128, 128, 255 }, [1] = { 0, 0, 0, 255 } }, { 0, 0, 0, 0 })
 
     add_entity("ui", "title_scene", Game.entities.ui.title_scene.components)
     add_entity("ui", "end_scene", Game.entities.ui.end_scene.components)
@@ -808,36 +805,8 @@ end
 
 function render_system(delta_time, player, entities, entities_in_viewport)
     if player.components.current_scene_component.name == "game" then
-        draw_visible_map("level1", Game.spritesheet_name,
-            function(rows, cols, dx, dy, cell_id, light_cell, scale_factor)
-                local sprite_id = 0
-                if cell_id == 0 then
-                    sprite_id = Game.sprite_ids.wall;
-                elseif cell_id == 1 then
-                    sprite_id = Game.sprite_ids.floor;
-                end
-
-                if(player.components.position_component.x == cols and player.components.position_component.y == rows) then
-                    player.components.sprite_component:render(Game, player, dx, dy, scale_factor)
-                else
-                    if(light_cell == 1) then
-                        -- wall or floor, these are not entities
-                        draw_sprite_scaled(Game.spritesheet_name, sprite_id, dx, dy, scale_factor)
-
-                        for key, value in pairs(entities.items) do
-                            if value.components.position_component.x == cols and value.components.position_component.y == rows then
-                                value.components.sprite_component:render(Game, value, dx, dy, scale_factor)
-                            end
-                        end
-
-                        for key, value in pairs(entities.mobs) do
-                            if value.components.position_component.x == cols and value.components.position_component.y == rows then
-                                value.components.sprite_component:render(Game, value, dx, dy, scale_factor)
-                            end
-                        end
-                    end
-                end
-            end)
+        draw_visible_map("level1", Game.spritesheet_name)
+        draw_map_entities({ "items", "mobs", "common" })
 
         render_action_log()
 
@@ -881,14 +850,17 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
                     player.components.position_component.y, "right")
             walk = true
         elseif Game.keycodes[key] == "space" then
-            play_sound("warp")
+            -- Nowhere free to go, stay put
             local pos = get_random_point_on_map()
-            player.components.position_component = { x = pos.x, y = pos.y }
-
-            update_player_viewport(
-                player.components.position_component.x,
-                player.components.position_component.y,
-                Game.viewport_width, Game.viewport_height)
+            if pos.x ~= nil then
+                play_sound("warp")
+                move_entity("common", "player", pos.x, pos.y)
+
+                update_player_viewport(
+                    player.components.position_component.x,
+                    player.components.position_component.y,
+                    Game.viewport_width, Game.viewport_height)
+            end
         end
 
         local adjacent_points = get_adjacent_points(player.components.position_component.x, player.components.position_component.y)
@@ -902,11 +874,11 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
         if blocked_mob.entity_name ~= nil then
             play_sound("combat")
             player.components.combat_component = {
-                mob = blocked_mob.entity_full_name
+                mob = blocked_mob.entity_id
             }
         elseif walk then
-            player.components.position_component = { x = math.max(0, math.min(new_position.x, Game.map_width - 1)),
-                y = math.max(0, math.min(new_position.y, Game.map_height - 1)) }
+            move_entity("common", "player", math.max(0, math.min(new_position.x, Game.map_width - 1)),
+                math.max(0, math.min(new_position.y, Game.map_height - 1)))
 
             update_player_viewport(
                 player.components.position_component.x,
@@ -916,16 +888,15 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
 
             get_overlapping_points("player", player.components.position_component.x,
                 player.components.position_component.y,
-                function(entity_full_name, entity_name, components)
+                function(entity_id, entity_name, components)
                     -- FIXME: This logic should be in the loot system
 
                     if (entity_name == "health_gem") then
                         play_sound("pickup")
                         player.components.health_update_component = {
                             entity_group = "items",
-                            entity_id = entities.items[entity_full_name].id,
-                            entity_full_name = entity_full_name,
-                            value = entities.items[entity_full_name].components.value_component.value
+                            entity_id = entity_id,
+                            value = components.value_component.value
                         }
                     elseif (entity_name == "ordinary" or
                             entity_name == "common" or
@@ -936,9 +907,8 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
                         play_sound("pickup")
                         player.components.score_update_component = {
                             entity_group = "items",
-                            entity_id = entities.items[entity_full_name].id,
-                            entity_full_name = entity_full_name,
-                            value = entities.items[entity_full_name].components.value_component.value
+                            entity_id = entity_id,
+                            value = components.value_component.value
                         }
 
                         if(entity_name == "goldencandle") then
@@ -968,8 +938,7 @@ function combat_system(player, entities, entities_in_viewport)
 
             player.components.score_update_component = {
                 entity_group = "mobs",
-                entity_id = entities.mobs[player.components.combat_component.mob].id,
-                entity_full_name = player.components.combat_component.mob,
+                entity_id = player.components.combat_component.mob,
                 value = entities.mobs[player.components.combat_component.mob].components.stats_component.max_health
             }
         end
@@ -990,11 +959,11 @@ end
 function loot_system(player, entities, entities_in_viewport)
     if(player.components.score_update_component ~= nil) then
         player.components.stats_component:add_score(player, player.components.score_update_component.value)
-        local treasure_chest_spawn_position = entities[player.components.score_update_component.entity_group][player.components.score_update_component.entity_full_name].components.position_component
+        local treasure_chest_spawn_position = entities[player.components.score_update_component.entity_group][player.components.score_update_component.entity_id].components.position_component
         remove_entity(player.components.score_update_component.entity_group, player.components.score_update_component.entity_id)
 
         if(player.components.score_update_component.entity_group == "mobs") then
-            local treasure_chest_drop_chance = get_random_number(1, 100)
+            local treasure_chest_drop_chance = get_random_number_from_stream("loot", 1, 100)
             local treasure_chest_name = nil
 
             if(treasure_chest_drop_chance >= 90) then
@@ -1035,18 +1004,46 @@ function tick_system(player, entities, entities_in_viewport)
 end
 
 function mob_movement_system(player, entities, entities_in_viewport)
-    local move_chance = get_random_number(1, 100)
+    local move_chance = get_random_number_from_stream("ai", 1, 100)
 
     if(move_chance <= 20) then
+        -- One sweep for all the mobs. Those close enough chase the player and
+        -- badly hurt ones run away, the rest wander. The field isn't cut short
+        -- so that running away can lead past the player to open space.
+        local notice_distance = 8
+        compute_distance_field("player", { player.components.position_component })
+        compute_flee_field("player_flee", "player")
+
         for key, value in pairs(entities_in_viewport) do
-            if(entities.mobs[key] ~= nil) then
-                local adjacent_points = get_adjacent_points(entities.mobs[key].components.position_component.x, entities.mobs[key].components.position_component.y)
-                local dir = get_random_key_from_table(adjacent_points)
-                if not adjacent_points[dir].blocked and
-                       adjacent_points[dir].x ~= player.components.position_component.x and
-                       adjacent_points[dir].y ~= player.components.position_component.y
-                then
-                    entities.mobs[key].components.position_component = { x = adjacent_points[dir].x, y = adjacent_points[dir].y }
+            local mob = entities.mobs[key]
+            if(mob ~= nil) then
+                local position = mob.components.position_component
+                local stats = mob.components.stats_component
+                local distance = get_field_distance(position.x, position.y, "player")
+                local field = nil
+                if(distance ~= nil and distance <= notice_distance) then
+                    field = "player"
+                    if(stats.health < stats.max_health / 4) then
+                        field = "player_flee"
+                    end
+                end
+
+                local step = nil
+                if(field ~= nil) then
+                    step = next_step(position.x, position.y, field, true)
+                else
+                    local adjacent_points = get_adjacent_points(position.x, position.y)
+                    local dir = get_random_key_from_table(adjacent_points, "ai")
+                    if not adjacent_points[dir].blocked and
+                           adjacent_points[dir].x ~= player.components.position_component.x and
+                           adjacent_points[dir].y ~= player.components.position_component.y
+                    then
+                        step = adjacent_points[dir]
+                    end
+                end
+
+                if(step ~= nil) then
+                    move_entity("mobs", key, step.x, step.y)
                 end
             end
         end